@@ -0,0 +1,414 @@
+/* Benchmark for forwarding out-of-line memory.
+
+   Translates messages carrying one out-of-line region of growing size,
+   as portproxy_server () does before forwarding them, and reports the
+   time per message and the payload throughput that amounts to, next to
+   the time it would take to copy the payload through a buffer of our
+   own instead.  Since the region is only handed on, with the kernel
+   moving it along with the message, translating should take the same
+   time whatever its size.
+
+   Before that, it checks that the layouts of messages larger than
+   64 KiB are cached right, that a message whose second port array
+   can't be translated is left with none of the rights translated
+   before it, and that an array of send rights whose proxies hold
+   different numbers of references is copied out alike.
+
+   Usage: ool-forward [max-size-kb [messages]]  */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../portproxy.h"
+
+static struct port_class *class;
+static struct port_bucket *bucket;
+static mach_port_t destination;
+static mach_port_t refused;
+
+struct ool_msg
+{
+  mach_msg_header_t header;
+  mach_msg_type_long_t type;
+  vm_offset_t data;
+};
+
+static inline uint64_t
+now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Forward everything to the same place, except REFUSED.  */
+static error_t
+forward_translate (void *proxy,
+                   mach_port_right_t type,
+                   mach_port_t *right,
+                   mach_msg_type_name_t *conversion,
+                   void *hook)
+{
+  struct portproxy *p = proxy;
+
+  if (p->type == PORTPROXY_TYPE_SEND && p->port == refused)
+    return EIO;
+
+  *right = destination;
+  *conversion = MACH_MSG_TYPE_COPY_SEND;
+  return 0;
+}
+
+/* Fill in MSG as if it had just been received on LOCAL, with SIZE
+   bytes at DATA out of line.  */
+static void
+make_msg (struct ool_msg *msg, mach_port_t local,
+          vm_offset_t data, vm_size_t size)
+{
+  memset (msg, 0, sizeof *msg);
+  msg->header.msgh_bits = MACH_MSGH_BITS (0, MACH_MSG_TYPE_PORT_SEND)
+                          | MACH_MSGH_BITS_COMPLEX;
+  msg->header.msgh_size = sizeof *msg;
+  msg->header.msgh_local_port = local;
+  msg->header.msgh_id = 2035;   /* io_read reply */
+  msg->type.msgtl_header.msgt_inline = 0;
+  msg->type.msgtl_header.msgt_longform = 1;
+  msg->type.msgtl_name = MACH_MSG_TYPE_BYTE;
+  msg->type.msgtl_size = 8;
+  msg->type.msgtl_number = size;
+  msg->data = data;
+}
+
+/* Inline data that puts a port descriptor past 64 KiB into a message,
+   with a copy of that descriptor 64 KiB before it.  */
+#define LARGE_INLINE 70000
+
+struct large_msg
+{
+  mach_msg_header_t header;
+  mach_msg_type_long_t data_type;
+  unsigned char data[LARGE_INLINE];
+  mach_msg_type_t port_type;
+  mach_port_t port;
+};
+
+/* Translate two messages of the same large layout with TRANSLATOR,
+   which caches layouts, as if received on LOCAL, and fail unless the
+   port in each is translated and the lookalike in its data isn't.  */
+static void
+check_large_layout (const struct portproxy_translator *translator,
+                    mach_port_t local)
+{
+  error_t err;
+  struct large_msg *msg;
+  size_t offset;
+  mach_port_t *decoy, decoy_name;
+  int i;
+
+  msg = calloc (1, sizeof *msg);
+  assert_backtrace (msg);
+  offset = offsetof (struct large_msg, port_type) - 65536;
+  /* Give it a send right, so that copying it in would work.  */
+  decoy_name = mach_reply_port ();
+  err = mach_port_insert_right (mach_task_self (), decoy_name, decoy_name,
+                                MACH_MSG_TYPE_MAKE_SEND);
+  assert_perror_backtrace (err);
+
+  for (i = 0; i < 2; i++)
+    {
+      memset (msg, 0, sizeof *msg);
+      msg->header.msgh_bits = MACH_MSGH_BITS (0, MACH_MSG_TYPE_PORT_SEND)
+                              | MACH_MSGH_BITS_COMPLEX;
+      msg->header.msgh_size = sizeof *msg;
+      msg->header.msgh_local_port = local;
+      msg->header.msgh_id = 2036;
+      msg->data_type.msgtl_header.msgt_inline = 1;
+      msg->data_type.msgtl_header.msgt_longform = 1;
+      msg->data_type.msgtl_name = MACH_MSG_TYPE_BYTE;
+      msg->data_type.msgtl_size = 8;
+      msg->data_type.msgtl_number = LARGE_INLINE;
+      msg->port_type.msgt_name = MACH_MSG_TYPE_PORT_SEND;
+      msg->port_type.msgt_size = 8 * sizeof (mach_port_t);
+      msg->port_type.msgt_number = 1;
+      msg->port_type.msgt_inline = 1;
+      msg->port = mach_reply_port ();
+      err = mach_port_insert_right (mach_task_self (), msg->port,
+                                    msg->port, MACH_MSG_TYPE_MAKE_SEND);
+      assert_perror_backtrace (err);
+
+      /* Just what the port descriptor looks like.  */
+      memcpy ((char *) msg + offset, &msg->port_type,
+              sizeof msg->port_type);
+      decoy = (mach_port_t *) ((char *) msg + offset
+                               + sizeof msg->port_type);
+      *decoy = decoy_name;
+
+      err = portproxy_translate_msg (&msg->header, translator);
+      if (err || msg->port != destination || *decoy != decoy_name)
+        error (1, err, "message over 64 KiB mistranslated (round %d)", i);
+    }
+
+  free (msg);
+}
+
+struct split_msg
+{
+  mach_msg_header_t header;
+  mach_msg_type_t first_type;
+  mach_port_t first;
+  mach_msg_type_long_t data_type;
+  vm_offset_t data;
+  mach_msg_type_t second_type;
+  mach_port_t second;
+};
+
+static mach_port_t
+make_send (void)
+{
+  error_t err;
+  mach_port_t port = mach_reply_port ();
+
+  err = mach_port_insert_right (mach_task_self (), port, port,
+                                MACH_MSG_TYPE_MAKE_SEND);
+  assert_perror_backtrace (err);
+  return port;
+}
+
+/* Translate three messages of the same layout with TRANSLATOR, which
+   caches layouts, as if received on LOCAL, the second port array of
+   the first and the last of which can't be; so that the first is
+   walked, and the last goes by the layout the second leaves behind.
+   Fail unless the ones that can't be translated are left with no
+   rights at all, so that destroying them doesn't drop any twice.  */
+static void
+check_failed_translation (const struct portproxy_translator *translator,
+                          mach_port_t local)
+{
+  error_t err;
+  struct split_msg msg;
+  static char data[64];
+  int i, fail;
+
+  for (i = 0; i < 3; i++)
+    {
+      memset (&msg, 0, sizeof msg);
+      msg.header.msgh_bits = MACH_MSGH_BITS (MACH_MSG_TYPE_PORT_SEND,
+                                             MACH_MSG_TYPE_PORT_SEND)
+                             | MACH_MSGH_BITS_COMPLEX;
+      msg.header.msgh_size = sizeof msg;
+      msg.header.msgh_local_port = local;
+      msg.header.msgh_remote_port = make_send ();
+      msg.header.msgh_id = 2037;
+      msg.first_type.msgt_name = MACH_MSG_TYPE_PORT_SEND;
+      msg.first_type.msgt_size = 8 * sizeof (mach_port_t);
+      msg.first_type.msgt_number = 1;
+      msg.first_type.msgt_inline = 1;
+      msg.first = make_send ();
+      msg.data_type.msgtl_header.msgt_longform = 1;
+      msg.data_type.msgtl_name = MACH_MSG_TYPE_BYTE;
+      msg.data_type.msgtl_size = 8;
+      msg.data_type.msgtl_number = sizeof data;
+      msg.data = (vm_offset_t) data;
+      msg.second_type = msg.first_type;
+      msg.second = make_send ();
+
+      fail = i != 1;
+      refused = fail ? msg.second : MACH_PORT_NULL;
+      err = portproxy_translate_msg (&msg.header, translator);
+      refused = MACH_PORT_NULL;
+
+      if (fail ? err != EIO
+                 || msg.header.msgh_local_port != MACH_PORT_NULL
+                 || msg.header.msgh_remote_port != MACH_PORT_NULL
+                 || msg.first != MACH_PORT_NULL
+                 || msg.second != MACH_PORT_NULL
+               : err || msg.second != destination)
+        error (1, err, "message failing to translate left with rights "
+               "(round %d)", i);
+    }
+}
+
+/* Send proxies held for check_mixed_array (), and the next of them to
+   hand out.  */
+static struct portproxy *held[3];
+static int next_held;
+
+/* Forward the local port, and give the send rights of HELD back in
+   turn for the others.  */
+static error_t
+held_translate (void *proxy,
+                mach_port_right_t type,
+                mach_port_t *right,
+                mach_msg_type_name_t *conversion,
+                void *hook)
+{
+  error_t err;
+  struct portproxy *p, *created;
+
+  if (((struct portproxy *) proxy)->type != PORTPROXY_TYPE_SEND)
+    return forward_translate (proxy, type, right, conversion, hook);
+
+  p = held[next_held++ % 3];
+  portproxy_rdlock (p);
+  err = portproxy_copyout (p, MACH_PORT_RIGHT_SEND, class, bucket,
+                           sizeof (struct portproxy),
+                           right, conversion, &created);
+  portproxy_unlock (p);
+  return err;
+}
+
+struct array_msg
+{
+  mach_msg_header_t header;
+  mach_msg_type_t type;
+  mach_port_t rights[3];
+};
+
+/* Translate a message received on LOCAL with an array of three send
+   rights into the rights of HELD, the first of which holds a spare
+   reference, so that it could hand out a moved one.  Fail unless the
+   array comes out copied as a whole, which takes no trap per right.  */
+static void
+check_mixed_array (mach_port_t local)
+{
+  error_t err;
+  struct array_msg msg;
+  struct portproxy_translator translator = { 0 };
+  struct portproxy *existing, *created;
+  mach_port_t right;
+  int i;
+
+  translator.port_class = class;
+  translator.bucket = bucket;
+  translator.size = sizeof (struct portproxy);
+  translator.translate = held_translate;
+
+  for (i = 0; i < 3; i++)
+    {
+      right = make_send ();
+      err = portproxy_copyin (right, MACH_PORT_RIGHT_SEND, class, bucket,
+                              sizeof (struct portproxy), &existing,
+                              &created);
+      assert_backtrace (!err && created);
+      portproxy_unlock (created);
+      held[i] = created;
+    }
+
+  right = held[0]->port;
+  err = mach_port_mod_refs (mach_task_self (), right,
+                            MACH_PORT_RIGHT_SEND, 1);
+  assert_perror_backtrace (err);
+  err = portproxy_copyin (right, MACH_PORT_RIGHT_SEND, class, bucket,
+                          sizeof (struct portproxy), &existing, &created);
+  assert_backtrace (!err && existing == held[0]);
+  portproxy_unlock (existing);
+  portproxy_deref (existing);
+
+  memset (&msg, 0, sizeof msg);
+  msg.header.msgh_bits = MACH_MSGH_BITS (0, MACH_MSG_TYPE_PORT_SEND)
+                         | MACH_MSGH_BITS_COMPLEX;
+  msg.header.msgh_size = sizeof msg;
+  msg.header.msgh_local_port = local;
+  msg.header.msgh_id = 2038;
+  msg.type.msgt_name = MACH_MSG_TYPE_PORT_SEND;
+  msg.type.msgt_size = 8 * sizeof (mach_port_t);
+  msg.type.msgt_number = 3;
+  msg.type.msgt_inline = 1;
+  for (i = 0; i < 3; i++)
+    msg.rights[i] = make_send ();
+
+  next_held = 0;
+  err = portproxy_translate_msg (&msg.header, &translator);
+  if (err || msg.type.msgt_name != MACH_MSG_TYPE_COPY_SEND)
+    error (1, err, "array of send rights not copied out alike");
+  for (i = 0; i < 3; i++)
+    if (msg.rights[i] != held[i]->port)
+      error (1, 0, "array of send rights copied out wrong");
+
+  for (i = 0; i < 3; i++)
+    portproxy_deref (held[i]);
+}
+
+int
+main (int argc, char **argv)
+{
+  error_t err;
+  struct portproxy *receive;
+  struct portproxy_translator translator = { 0 };
+  struct ool_msg msg;
+  mach_port_t local;
+  mach_msg_type_name_t conversion;
+  vm_address_t data;
+  vm_size_t size, max_size = 16384 * 1024;
+  unsigned long i, n = 20000;
+  uint64_t start, translate_ns, copy_ns;
+  char *copy;
+
+  if (argc > 1)
+    max_size = strtoul (argv[1], NULL, 0) * 1024;
+  if (argc > 2)
+    n = strtoul (argv[2], NULL, 0);
+
+  bucket = ports_create_bucket ();
+  class = ports_create_class (portproxy_clean, NULL);
+  translator.port_class = class;
+  translator.bucket = bucket;
+  translator.size = sizeof (struct portproxy);
+  translator.translate = forward_translate;
+  translator.layout_cache = portproxy_layout_cache_create ();
+
+  err = portproxy_copyout (NULL, MACH_PORT_RIGHT_SEND, class, bucket,
+                           sizeof (struct portproxy), &local, &conversion,
+                           &receive);
+  assert_backtrace (!err && receive);
+  portproxy_unlock (receive);
+  destination = mach_reply_port ();
+
+  check_large_layout (&translator, local);
+  check_failed_translation (&translator, local);
+  check_mixed_array (local);
+
+  err = vm_allocate (mach_task_self (), &data, max_size, 1);
+  assert_perror_backtrace (err);
+  memset ((void *) data, 0x5a, max_size);
+  copy = malloc (max_size);
+  assert_backtrace (copy);
+
+  printf ("%10s %12s %14s %12s %14s\n", "size/KiB", "forward/ns",
+          "forward MB/s", "copy/ns", "copy MB/s");
+
+  for (size = 4096; size <= max_size; size *= 4)
+    {
+      translate_ns = 0;
+      for (i = 0; i < n; i++)
+        {
+          make_msg (&msg, local, data, size);
+          start = now ();
+          err = portproxy_translate_msg (&msg.header, &translator);
+          translate_ns += now () - start;
+          assert_backtrace (!err && msg.data == data
+                            && msg.type.msgtl_header.msgt_deallocate);
+        }
+
+      /* Copying is slow enough not to need as many rounds.  */
+      start = now ();
+      for (i = 0; i < n / 16 + 1; i++)
+        {
+          memcpy (copy, (void *) data, size);
+          __asm__ volatile ("" : : "r" (copy) : "memory");
+        }
+      copy_ns = (now () - start) / (n / 16 + 1);
+
+      printf ("%10lu %12.1f %14.0f %12lu %14.0f\n",
+              (unsigned long) size / 1024, (double) translate_ns / n,
+              (double) size * n / translate_ns * 1000,
+              (unsigned long) copy_ns,
+              (double) size / copy_ns * 1000);
+    }
+
+  return 0;
+}
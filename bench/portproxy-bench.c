@@ -0,0 +1,738 @@
+/* Microbenchmarks for the copyin, copyout and clean paths.
+
+   Each scenario runs rounds of operations on every thread, timing each
+   operation on its own; whatever an operation needs (fresh rights,
+   user references to consume) is prepared between rounds, outside of
+   the timed part.  For each scenario and thread count, prints the
+   throughput (the sum over the threads of the operations each did per
+   second spent in timed operations) and percentiles of the latency of
+   one operation.  With the stand-in, also prints the number of
+   kernel traps per operation made in the timed part, and the number
+   made elsewhere (by the deallocation reaper, or flushing it) per
+   operation.
+
+   Usage: portproxy-bench [-t max-threads] [-n ops-per-thread]
+                          [-c trap-cost-ns] [-d max-pending[,max-delay-ms]]
+                          [-C] [-S check-interval-ms] [-H] [scenario...]  */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../portproxy.h"
+
+#define ROUND 256
+#define NSHARED 64
+#define NHOT 4
+
+#ifdef PORTPROXY_STANDIN
+#define TRAPS() standin_trap_count ()
+#define THREAD_TRAPS() standin_thread_trap_count ()
+#else
+#define TRAPS() 0UL
+#define THREAD_TRAPS() 0UL
+#endif
+
+static struct port_class *class;
+static struct port_bucket *bucket;
+
+/* Send rights with long-lived send proxies, shared by all threads.  */
+static mach_port_t shared_rights[NSHARED];
+static struct portproxy *shared_proxies[NSHARED];
+
+/* Our receive proxies, shared by all threads.  */
+static mach_port_t receive_rights[NSHARED];
+static struct portproxy *receive_proxies[NSHARED];
+
+struct thread
+{
+  unsigned int id;
+  mach_port_t rights[ROUND];
+  mach_port_t port;
+  struct portproxy *proxy;
+  uint64_t *samples;
+  unsigned long nr_samples;
+  uint64_t busy;                /* Time spent in timed rounds.  */
+  unsigned long op_traps;       /* Traps made in timed operations.  */
+  unsigned long traps;          /* All traps made by the thread.  */
+};
+
+struct scenario
+{
+  const char *name;
+  const char *description;
+  void (*setup) (struct thread *);
+  void (*prepare) (struct thread *);
+  void (*op) (struct thread *, unsigned int);
+  void (*finish) (struct thread *);
+  void (*teardown) (struct thread *);
+};
+
+static inline uint64_t
+now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static mach_port_t
+make_send_right (void)
+{
+  error_t err;
+  mach_port_t right;
+
+  /* Our own receive rights stand in for some other task's,
+     since they're not in the bucket.  */
+  err = mach_port_allocate (mach_task_self (),
+                            MACH_PORT_RIGHT_RECEIVE, &right);
+  assert_perror_backtrace (err);
+  err = mach_port_insert_right (mach_task_self (), right, right,
+                                MACH_MSG_TYPE_MAKE_SEND);
+  assert_perror_backtrace (err);
+  return right;
+}
+
+static void
+drop_receive_rights (struct thread *t)
+{
+  unsigned int i;
+
+  for (i = 0; i < ROUND; i++)
+    mach_port_mod_refs (mach_task_self (), t->rights[i],
+                        MACH_PORT_RIGHT_RECEIVE, -1);
+}
+
+/* Copying in a send right that already has a send proxy.  */
+
+static void
+send_hit_prepare (struct thread *t)
+{
+  error_t err;
+  unsigned int i;
+
+  for (i = 0; i < NSHARED; i++)
+    {
+      err = mach_port_mod_refs (mach_task_self (), shared_rights[i],
+                                MACH_PORT_RIGHT_SEND, ROUND / NSHARED);
+      assert_perror_backtrace (err);
+    }
+}
+
+static void
+send_hit_op (struct thread *t, unsigned int i)
+{
+  error_t err;
+  struct portproxy *existing, *created;
+
+  err = portproxy_copyin (shared_rights[(i + t->id) % NSHARED],
+                          MACH_PORT_RIGHT_SEND, class, bucket,
+                          sizeof (struct portproxy), &existing, &created);
+  assert_backtrace (!err && existing && !created);
+  portproxy_unlock (existing);
+  portproxy_deref (existing);
+}
+
+/* The same, for the few rights a server sees all the time.  */
+
+static void
+send_hot_prepare (struct thread *t)
+{
+  error_t err;
+  unsigned int i;
+
+  for (i = 0; i < NHOT; i++)
+    {
+      err = mach_port_mod_refs (mach_task_self (), shared_rights[i],
+                                MACH_PORT_RIGHT_SEND, ROUND / NHOT);
+      assert_perror_backtrace (err);
+    }
+}
+
+static void
+send_hot_op (struct thread *t, unsigned int i)
+{
+  error_t err;
+  struct portproxy *existing, *created;
+
+  err = portproxy_copyin (shared_rights[(i + t->id) % NHOT],
+                          MACH_PORT_RIGHT_SEND, class, bucket,
+                          sizeof (struct portproxy), &existing, &created);
+  assert_backtrace (!err && existing && !created);
+  portproxy_unlock (existing);
+  portproxy_deref (existing);
+}
+
+/* Copying in a new send right, and cleaning its proxy up.  */
+
+static void
+send_miss_prepare (struct thread *t)
+{
+  unsigned int i;
+
+  for (i = 0; i < ROUND; i++)
+    t->rights[i] = make_send_right ();
+}
+
+static void
+send_miss_op (struct thread *t, unsigned int i)
+{
+  error_t err;
+  struct portproxy *existing, *created;
+
+  err = portproxy_copyin (t->rights[i], MACH_PORT_RIGHT_SEND,
+                          class, bucket, sizeof (struct portproxy),
+                          &existing, &created);
+  assert_backtrace (!err && !existing && created);
+  portproxy_unlock (created);
+  portproxy_deref (created);
+}
+
+/* Copying out a send proxy, which gives its send right back.  Moved
+   user references are kept in T->rights, to be dropped between rounds
+   as sending them would.  */
+
+static void
+send_copyout_op (struct thread *t, unsigned int i)
+{
+  error_t err;
+  struct portproxy *proxy, *created;
+  mach_port_t right;
+  mach_msg_type_name_t conversion;
+
+  proxy = shared_proxies[(i + t->id) % NSHARED];
+  portproxy_rdlock (proxy);
+  err = portproxy_copyout (proxy, MACH_PORT_RIGHT_SEND, class, bucket,
+                           sizeof (struct portproxy),
+                           &right, &conversion, &created);
+  assert_backtrace (!err && !created
+                    && (conversion == MACH_MSG_TYPE_COPY_SEND
+                        || conversion == MACH_MSG_TYPE_MOVE_SEND));
+  portproxy_unlock (proxy);
+
+  t->rights[i] = conversion == MACH_MSG_TYPE_MOVE_SEND
+                 ? right : MACH_PORT_NULL;
+}
+
+static void
+drop_moved_rights (struct thread *t)
+{
+  unsigned int i;
+
+  for (i = 0; i < ROUND; i++)
+    if (t->rights[i] != MACH_PORT_NULL)
+      mach_port_deallocate (mach_task_self (), t->rights[i]);
+}
+
+/* Forwarding a send right that has a send proxy: copying it in, and
+   copying the proxy out again.  */
+
+static void
+send_forward_op (struct thread *t, unsigned int i)
+{
+  error_t err;
+  struct portproxy *existing, *created;
+  mach_port_t right;
+  mach_msg_type_name_t conversion;
+
+  err = portproxy_copyin (shared_rights[(i + t->id) % NSHARED],
+                          MACH_PORT_RIGHT_SEND, class, bucket,
+                          sizeof (struct portproxy), &existing, &created);
+  assert_backtrace (!err && existing && !created);
+  err = portproxy_copyout (existing, MACH_PORT_RIGHT_SEND, class, bucket,
+                           sizeof (struct portproxy),
+                           &right, &conversion, &created);
+  assert_backtrace (!err && !created);
+  portproxy_unlock (existing);
+  portproxy_deref (existing);
+
+  t->rights[i] = conversion == MACH_MSG_TYPE_MOVE_SEND
+                 ? right : MACH_PORT_NULL;
+}
+
+/* The same, borrowing the proxy inside an epoch instead.  */
+
+static void
+borrow_forward_op (struct thread *t, unsigned int i)
+{
+  error_t err;
+  struct portproxy *proxy, *created;
+  mach_port_t right;
+  mach_msg_type_name_t conversion;
+
+  err = portproxy_epoch_enter ();
+  assert_perror_backtrace (err);
+  proxy = portproxy_borrow (shared_rights[(i + t->id) % NSHARED]);
+  assert_backtrace (proxy);
+  err = portproxy_copyout (proxy, MACH_PORT_RIGHT_SEND, class, bucket,
+                           sizeof (struct portproxy),
+                           &right, &conversion, &created);
+  assert_backtrace (!err && !created);
+  portproxy_epoch_exit ();
+
+  t->rights[i] = conversion == MACH_MSG_TYPE_MOVE_SEND
+                 ? right : MACH_PORT_NULL;
+}
+
+/* Copying in a send right to one of our receive proxies.  */
+
+static void
+receive_hit_prepare (struct thread *t)
+{
+  error_t err;
+  unsigned int i;
+
+  for (i = 0; i < ROUND; i++)
+    {
+      err = mach_port_insert_right (mach_task_self (),
+                                    receive_rights[i % NSHARED],
+                                    receive_rights[i % NSHARED],
+                                    MACH_MSG_TYPE_MAKE_SEND);
+      assert_perror_backtrace (err);
+    }
+}
+
+static void
+receive_hit_op (struct thread *t, unsigned int i)
+{
+  error_t err;
+  struct portproxy *existing, *created;
+
+  err = portproxy_copyin (receive_rights[i % NSHARED],
+                          MACH_PORT_RIGHT_SEND, class, bucket,
+                          sizeof (struct portproxy), &existing, &created);
+  assert_backtrace (!err && existing && !created);
+  portproxy_unlock (existing);
+  portproxy_deref (existing);
+}
+
+/* Copying out a send right for which there is no proxy yet, which
+   makes a new receive proxy, and cleaning it up.  */
+
+static void
+receive_miss_op (struct thread *t, unsigned int i)
+{
+  error_t err;
+  struct portproxy *created;
+  mach_port_t right;
+  mach_msg_type_name_t conversion;
+
+  err = portproxy_copyout (NULL, MACH_PORT_RIGHT_SEND, class, bucket,
+                           sizeof (struct portproxy),
+                           &right, &conversion, &created);
+  assert_backtrace (!err && created);
+  portproxy_unlock (created);
+  portproxy_deref (created);
+}
+
+/* Copying a send-once right in and out again.  */
+
+static void
+send_once_setup (struct thread *t)
+{
+  t->port = mach_reply_port ();
+}
+
+static void
+send_once_prepare (struct thread *t)
+{
+  error_t err;
+  mach_msg_type_name_t type;
+  unsigned int i;
+
+  for (i = 0; i < ROUND; i++)
+    {
+      err = mach_port_extract_right (mach_task_self (), t->port,
+                                     MACH_MSG_TYPE_MAKE_SEND_ONCE,
+                                     &t->rights[i], &type);
+      assert_perror_backtrace (err);
+    }
+}
+
+static void
+send_once_op (struct thread *t, unsigned int i)
+{
+  error_t err;
+  struct portproxy *existing, *created, *none;
+  mach_port_t right;
+  mach_msg_type_name_t conversion;
+
+  err = portproxy_copyin (t->rights[i], MACH_PORT_RIGHT_SEND_ONCE,
+                          class, bucket, sizeof (struct portproxy),
+                          &existing, &created);
+  assert_backtrace (!err && created);
+  err = portproxy_copyout (created, MACH_PORT_RIGHT_SEND_ONCE,
+                           class, bucket, sizeof (struct portproxy),
+                           &right, &conversion, &none);
+  assert_backtrace (!err && right == t->rights[i]);
+  portproxy_unlock (created);
+  portproxy_deref (created);
+}
+
+static void
+send_once_finish (struct thread *t)
+{
+  unsigned int i;
+
+  for (i = 0; i < ROUND; i++)
+    mach_port_deallocate (mach_task_self (), t->rights[i]);
+}
+
+static void
+send_once_teardown (struct thread *t)
+{
+  mach_port_mod_refs (mach_task_self (), t->port,
+                      MACH_PORT_RIGHT_RECEIVE, -1);
+}
+
+/* Copying in the receive right behind a send proxy, and copying it
+   out again, which migrates the proxy twice.  */
+
+static void
+migrate_setup (struct thread *t)
+{
+  error_t err;
+  struct portproxy *existing;
+
+  t->port = make_send_right ();
+  err = portproxy_copyin (t->port, MACH_PORT_RIGHT_SEND,
+                          class, bucket, sizeof (struct portproxy),
+                          &existing, &t->proxy);
+  assert_backtrace (!err && t->proxy);
+  portproxy_unlock (t->proxy);
+}
+
+static void
+migrate_op (struct thread *t, unsigned int i)
+{
+  error_t err;
+  struct portproxy *existing, *receive, *send;
+  mach_port_t right;
+  mach_msg_type_name_t conversion;
+
+  err = portproxy_copyin (t->port, MACH_PORT_RIGHT_RECEIVE,
+                          class, bucket, sizeof (struct portproxy),
+                          &existing, &receive);
+  assert_backtrace (!err && existing == t->proxy && receive);
+  portproxy_unlock (receive);
+  portproxy_unlock (existing);
+  portproxy_deref (existing);
+  portproxy_deref (t->proxy);
+
+  portproxy_rdlock (receive);
+  err = portproxy_copyout (receive, MACH_PORT_RIGHT_RECEIVE,
+                           class, bucket, sizeof (struct portproxy),
+                           &right, &conversion, &send);
+  assert_backtrace (!err && send && right == t->port);
+  portproxy_unlock (send);
+  portproxy_unlock (receive);
+  portproxy_deref (receive);
+
+  t->proxy = send;
+}
+
+static void
+migrate_teardown (struct thread *t)
+{
+  portproxy_deref (t->proxy);
+  mach_port_mod_refs (mach_task_self (), t->port,
+                      MACH_PORT_RIGHT_RECEIVE, -1);
+}
+
+static const struct scenario scenarios[] =
+{
+  { "send-hit", "copyin of a send right with a proxy",
+    NULL, send_hit_prepare, send_hit_op, NULL, NULL },
+  { "send-hot", "copyin of one of a few send rights with a send proxy",
+    NULL, send_hot_prepare, send_hot_op, NULL, NULL },
+  { "send-miss", "copyin of a new send right, and clean",
+    NULL, send_miss_prepare, send_miss_op, drop_receive_rights, NULL },
+  { "send-copyout", "copyout of a send proxy",
+    NULL, NULL, send_copyout_op, drop_moved_rights, NULL },
+  { "send-forward", "copyin of a send right with a proxy, and copyout",
+    NULL, send_hit_prepare, send_forward_op, drop_moved_rights, NULL },
+  { "borrow-forward", "the same, borrowing the proxy",
+    NULL, send_hit_prepare, borrow_forward_op, drop_moved_rights, NULL },
+  { "receive-hit", "copyin of a send right to a receive proxy",
+    NULL, receive_hit_prepare, receive_hit_op, NULL, NULL },
+  { "receive-miss", "copyout making a receive proxy, and clean",
+    NULL, NULL, receive_miss_op, NULL, NULL },
+  { "send-once", "copyin and copyout of a send-once right, and clean",
+    send_once_setup, send_once_prepare, send_once_op, send_once_finish,
+    send_once_teardown },
+  { "migrate", "receive right copied in and out through its proxies",
+    migrate_setup, NULL, migrate_op, NULL, migrate_teardown },
+};
+
+#define NR_SCENARIOS (sizeof scenarios / sizeof scenarios[0])
+
+struct run
+{
+  const struct scenario *scenario;
+  struct thread thread;
+  pthread_barrier_t *barrier;
+  unsigned long ops;
+};
+
+static void *
+worker (void *arg)
+{
+  struct run *run = arg;
+  const struct scenario *s = run->scenario;
+  struct thread *t = &run->thread;
+  unsigned long done;
+  unsigned int i;
+  uint64_t start, end;
+  unsigned long traps, op_traps;
+
+  traps = THREAD_TRAPS ();
+
+  if (s->setup)
+    (*s->setup) (t);
+
+  pthread_barrier_wait (run->barrier);
+
+  for (done = 0; done < run->ops; done += ROUND)
+    {
+      if (s->prepare)
+        (*s->prepare) (t);
+
+      for (i = 0; i < ROUND; i++)
+        {
+          op_traps = THREAD_TRAPS ();
+          start = now ();
+          (*s->op) (t, i);
+          end = now ();
+          t->op_traps += THREAD_TRAPS () - op_traps;
+          t->samples[t->nr_samples++] = end - start;
+          t->busy += end - start;
+        }
+
+      if (s->finish)
+        (*s->finish) (t);
+    }
+
+  pthread_barrier_wait (run->barrier);
+
+  if (s->teardown)
+    (*s->teardown) (t);
+
+  t->traps = THREAD_TRAPS () - traps;
+  return NULL;
+}
+
+static int
+compare_samples (const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+static void
+measure (const struct scenario *s, unsigned int nthreads,
+         unsigned long ops)
+{
+  pthread_t threads[nthreads];
+  struct run runs[nthreads];
+  pthread_barrier_t barrier;
+  uint64_t *samples;
+  unsigned long nr_samples = 0;
+  double throughput = 0;
+  unsigned long traps, op_traps = 0, thread_traps = 0;
+  unsigned int i;
+
+  ops = (ops + ROUND - 1) / ROUND * ROUND;
+  samples = malloc (nthreads * ops * sizeof *samples);
+  if (!samples)
+    error (1, errno, "malloc");
+
+  pthread_barrier_init (&barrier, NULL, nthreads);
+  traps = TRAPS ();
+
+  for (i = 0; i < nthreads; i++)
+    {
+      memset (&runs[i], 0, sizeof runs[i]);
+      runs[i].scenario = s;
+      runs[i].barrier = &barrier;
+      runs[i].ops = ops;
+      runs[i].thread.id = i;
+      runs[i].thread.samples = samples + i * ops;
+      pthread_create (&threads[i], NULL, worker, &runs[i]);
+    }
+
+  for (i = 0; i < nthreads; i++)
+    {
+      pthread_join (threads[i], NULL);
+      nr_samples += runs[i].thread.nr_samples;
+      throughput += runs[i].thread.nr_samples * 1e9 / runs[i].thread.busy;
+      op_traps += runs[i].thread.op_traps;
+      thread_traps += runs[i].thread.traps;
+    }
+
+  portproxy_dealloc_flush ();
+  traps = TRAPS () - traps - thread_traps;
+
+  pthread_barrier_destroy (&barrier);
+
+  qsort (samples, nr_samples, sizeof *samples, compare_samples);
+
+#define PERCENTILE(p) samples[(unsigned long) ((nr_samples - 1) * (p))]
+  printf ("%-14s %7u %14.0f %8lu %8lu %8lu %8lu",
+          s->name, nthreads, throughput,
+          PERCENTILE (0.50), PERCENTILE (0.90),
+          PERCENTILE (0.99), PERCENTILE (0.999));
+#undef PERCENTILE
+#ifdef PORTPROXY_STANDIN
+  printf (" %8.2f %8.2f", (double) op_traps / nr_samples,
+          (double) traps / nr_samples);
+#endif
+  printf ("\n");
+
+  free (samples);
+}
+
+static void
+usage (const char *name)
+{
+  unsigned int i;
+
+  fprintf (stderr, "Usage: %s [-t max-threads] [-n ops-per-thread] "
+           "[-c trap-cost-ns] [-d max-pending[,max-delay-ms]] [-C] "
+           "[-S check-interval-ms] [-H] [scenario...]\n\n"
+           "  -d  defer deallocating send rights\n"
+           "  -C  turn on the per-thread proxy cache\n"
+           "  -S  split the reference counts of hot send proxies, starting\n"
+           "      with the shared ones\n"
+           "  -H  dump latency and lock wait histograms at the end\n"
+           "\nScenarios:\n", name);
+  for (i = 0; i < NR_SCENARIOS; i++)
+    fprintf (stderr, "  %-14s %s\n", scenarios[i].name,
+             scenarios[i].description);
+  exit (2);
+}
+
+int
+main (int argc, char **argv)
+{
+  error_t err;
+  unsigned int max_threads = 4;
+  unsigned long ops = 100000;
+  struct portproxy *existing;
+  mach_port_t right;
+  mach_msg_type_name_t conversion;
+  unsigned int i, n;
+  int opt, j, dump_histograms = 0, split = 0;
+  unsigned int max_pending, max_delay;
+  char *end;
+
+  while ((opt = getopt (argc, argv, "t:n:c:d:CS:Hh")) != -1)
+    switch (opt)
+      {
+      case 't':
+        max_threads = atoi (optarg);
+        break;
+      case 'n':
+        ops = atol (optarg);
+        break;
+      case 'c':
+#ifdef PORTPROXY_STANDIN
+        standin_set_trap_cost (atol (optarg));
+        break;
+#else
+        fprintf (stderr, "%s: -c only works with the stand-in\n", argv[0]);
+        return 2;
+#endif
+      case 'd':
+        max_pending = strtoul (optarg, &end, 0);
+        max_delay = *end == ',' ? strtoul (end + 1, NULL, 0) : 0;
+        err = portproxy_deferred_dealloc (max_pending, max_delay);
+        assert_perror_backtrace (err);
+        break;
+      case 'C':
+        portproxy_thread_cache_enable (1);
+        break;
+      case 'S':
+        err = portproxy_split_refs (strtoul (optarg, NULL, 0));
+        assert_perror_backtrace (err);
+        split = 1;
+        break;
+      case 'H':
+        dump_histograms = 1;
+        break;
+      default:
+        usage (argv[0]);
+      }
+
+  for (j = optind; j < argc; j++)
+    {
+      for (i = 0; i < NR_SCENARIOS; i++)
+        if (!strcmp (argv[j], scenarios[i].name))
+          break;
+      if (i == NR_SCENARIOS)
+        usage (argv[0]);
+    }
+
+  if (dump_histograms)
+    {
+      err = portproxy_histograms_enable (1);
+      assert_perror_backtrace (err);
+    }
+
+  bucket = ports_create_bucket ();
+  class = ports_create_class (portproxy_clean, NULL);
+
+  for (i = 0; i < NSHARED; i++)
+    {
+      shared_rights[i] = make_send_right ();
+      err = portproxy_copyin (shared_rights[i], MACH_PORT_RIGHT_SEND,
+                              class, bucket, sizeof (struct portproxy),
+                              &existing, &shared_proxies[i]);
+      assert_backtrace (!err && shared_proxies[i]);
+      portproxy_unlock (shared_proxies[i]);
+      if (split)
+        portproxy_ref_split (shared_proxies[i]);
+
+      err = portproxy_copyout (NULL, MACH_PORT_RIGHT_SEND, class, bucket,
+                               sizeof (struct portproxy), &right,
+                               &conversion, &receive_proxies[i]);
+      assert_backtrace (!err && receive_proxies[i]);
+      portproxy_unlock (receive_proxies[i]);
+      receive_rights[i] = right;
+    }
+
+  printf ("%-14s %7s %14s %8s %8s %8s %8s", "scenario", "threads",
+          "ops/s", "p50/ns", "p90/ns", "p99/ns", "p99.9/ns");
+#ifdef PORTPROXY_STANDIN
+  printf (" %8s %8s", "traps/op", "reaped/op");
+#endif
+  printf ("\n");
+
+  for (i = 0; i < NR_SCENARIOS; i++)
+    {
+      if (optind < argc)
+        {
+          for (j = optind; j < argc; j++)
+            if (!strcmp (argv[j], scenarios[i].name))
+              break;
+          if (j == argc)
+            continue;
+        }
+
+      for (n = 1; n <= max_threads; n *= 2)
+        measure (&scenarios[i], n, ops);
+    }
+
+  if (dump_histograms)
+    {
+      printf ("\n");
+      portproxy_histograms_dump (stdout);
+    }
+
+  return 0;
+}
@@ -0,0 +1,187 @@
+/* Memory benchmark for send proxies.
+
+   Creates a number of send proxies carrying a small user payload (like
+   the peer pointer and id of examples/rpctrace1.c), and reports the
+   heap used per proxy, next to that of the previous layout, where every
+   proxy embedded a pthread_rwlock_t and lived in a hurd_ihash.  The
+   proxies themselves and the tables they are indexed in are counted
+   apart.  Tables are measured as they are once they hold that many
+   proxies, sized up front with portproxy_reserve (); while a table
+   grows, the one it replaces is kept until all of its proxies have
+   been moved over, which would make the number depend on how close
+   the count is to the last time the tables doubled.
+
+   Usage: proxy-memory [proxies [payload-bytes]]  */
+
+#include <malloc.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <hurd/ihash.h>
+
+#include "../portproxy.h"
+
+/* The previous layout, for comparison.  */
+struct legacy_portproxy
+{
+  union
+  {
+    struct port_info pi;
+    struct
+    {
+      refcount_t refcount;
+      mach_port_t port;
+      hurd_ihash_locp_t locp;
+      void (*clean_routine) (void *);
+    };
+  };
+  enum portproxy_type type;
+  pthread_rwlock_t lock;
+  struct portproxy *migrated;
+};
+
+/* Large tables are mapped rather than carved out of the heap.  */
+static size_t
+heap_in_use (void)
+{
+  struct mallinfo2 info = mallinfo2 ();
+
+  return info.uordblks + info.hblkhd;
+}
+
+/* Heap used per proxy, by the proxies themselves and by the tables
+   they are indexed in.  */
+struct usage
+{
+  double proxies;
+  double tables;
+};
+
+static struct usage
+measure_legacy (mach_port_t *rights, unsigned int n, size_t payload)
+{
+  error_t err;
+  struct hurd_ihash table = HURD_IHASH_INITIALIZER (HURD_IHASH_NO_LOCP);
+  struct legacy_portproxy **proxies;
+  struct usage usage;
+  size_t before, middle, after;
+  unsigned int i;
+
+  proxies = malloc (n * sizeof *proxies);
+  if (!proxies)
+    error (1, errno, "malloc");
+
+  before = heap_in_use ();
+  for (i = 0; i < n; i++)
+    {
+      proxies[i] = malloc (sizeof (struct legacy_portproxy) + payload);
+      if (!proxies[i])
+        error (1, errno, "malloc");
+      pthread_rwlock_init (&proxies[i]->lock, NULL);
+    }
+  middle = heap_in_use ();
+  for (i = 0; i < n; i++)
+    {
+      err = hurd_ihash_add (&table, rights[i], proxies[i]);
+      assert_perror_backtrace (err);
+    }
+  after = heap_in_use ();
+
+  hurd_ihash_destroy (&table);
+  for (i = 0; i < n; i++)
+    {
+      pthread_rwlock_destroy (&proxies[i]->lock);
+      free (proxies[i]);
+    }
+  free (proxies);
+
+  usage.proxies = (double) (middle - before) / n;
+  usage.tables = (double) (after - middle) / n;
+  return usage;
+}
+
+static struct usage
+measure_current (mach_port_t *rights, unsigned int n, size_t payload)
+{
+  error_t err;
+  struct port_class *class;
+  struct port_bucket *bucket;
+  struct portproxy *existing, **proxies;
+  struct usage usage;
+  size_t before, middle, after;
+  unsigned int i;
+
+  bucket = ports_create_bucket ();
+  class = ports_create_class (NULL, NULL);
+
+  proxies = malloc (n * sizeof *proxies);
+  if (!proxies)
+    error (1, errno, "malloc");
+
+  before = heap_in_use ();
+  err = portproxy_reserve (n);
+  assert_perror_backtrace (err);
+  middle = heap_in_use ();
+  for (i = 0; i < n; i++)
+    {
+      err = portproxy_copyin (rights[i], MACH_PORT_RIGHT_SEND,
+                              class, bucket,
+                              sizeof (struct portproxy) + payload,
+                              &existing, &proxies[i]);
+      assert_perror_backtrace (err);
+      portproxy_unlock (proxies[i]);
+    }
+  after = heap_in_use ();
+
+  for (i = 0; i < n; i++)
+    portproxy_deref (proxies[i]);
+  free (proxies);
+
+  usage.tables = (double) (middle - before) / n;
+  usage.proxies = (double) (after - middle) / n;
+  return usage;
+}
+
+int
+main (int argc, char **argv)
+{
+  error_t err;
+  unsigned int n = argc > 1 ? atoi (argv[1]) : 100000;
+  size_t payload = argc > 2 ? atoi (argv[2]) : 16;
+  mach_port_t *rights;
+  struct usage legacy, current;
+  unsigned int i;
+
+  rights = malloc (n * sizeof *rights);
+  if (!rights)
+    error (1, errno, "malloc");
+
+  for (i = 0; i < n; i++)
+    {
+      /* Our own receive rights stand in for some other task's,
+         since they're not in the bucket.  */
+      err = mach_port_allocate (mach_task_self (),
+                                MACH_PORT_RIGHT_RECEIVE, &rights[i]);
+      assert_perror_backtrace (err);
+      err = mach_port_insert_right (mach_task_self (), rights[i],
+                                    rights[i], MACH_MSG_TYPE_MAKE_SEND);
+      assert_perror_backtrace (err);
+    }
+
+  legacy = measure_legacy (rights, n, payload);
+
+  /* The proxies take over the send rights.  */
+  current = measure_current (rights, n, payload);
+
+  printf ("%u send proxies, %zu bytes of payload each\n", n, payload);
+  printf ("%10s %14s %14s %14s %14s\n", "layout", "sizeof/bytes",
+          "proxies/proxy", "tables/proxy", "heap/proxy");
+  printf ("%10s %14zu %14.1f %14.1f %14.1f\n", "previous",
+          sizeof (struct legacy_portproxy), legacy.proxies, legacy.tables,
+          legacy.proxies + legacy.tables);
+  printf ("%10s %14zu %14.1f %14.1f %14.1f\n", "current",
+          sizeof (struct portproxy), current.proxies, current.tables,
+          current.proxies + current.tables);
+
+  return 0;
+}
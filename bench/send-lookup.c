@@ -0,0 +1,209 @@
+/* Thread-scaling benchmark for looking up existing send proxies.
+
+   Every thread repeatedly copies in send rights that already have a
+   proxy, which is the common case for an interposing server, and
+   reports the throughput of portproxy_copyin () next to that of the
+   previous design, where each lookup took one of 16 global mutexes and
+   probed a hurd_ihash.
+
+   Usage: send-lookup [max-threads [seconds]]  */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <hurd/ihash.h>
+
+#include "../portproxy.h"
+
+#define NRIGHTS 64
+#define BATCH 256
+
+static struct port_class *class;
+static struct port_bucket *bucket;
+static mach_port_t rights[NRIGHTS];
+
+/* The previous design, for comparison.  */
+static struct hurd_ihash legacy_proxies[16] =
+{
+  [0 ... 15] = HURD_IHASH_INITIALIZER (HURD_IHASH_NO_LOCP),
+};
+static pthread_mutex_t legacy_lock[16] =
+{
+  [0 ... 15] = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static error_t
+legacy_copyin (mach_port_t right, void *p_existing)
+{
+  error_t err;
+  unsigned int key = right % 16;
+  struct portproxy *existing;
+
+  pthread_mutex_lock (&legacy_lock[key]);
+
+  existing = ports_lookup_port (bucket, right, class);
+  if (!existing)
+    {
+      existing = hurd_ihash_find (&legacy_proxies[key], right);
+      if (existing)
+        portproxy_ref (existing);
+    }
+
+  pthread_mutex_unlock (&legacy_lock[key]);
+
+  if (!existing)
+    return EINVAL;
+
+  err = mach_port_deallocate (mach_task_self (), right);
+  assert_perror_backtrace (err);
+
+  portproxy_rdlock (existing);
+  *(struct portproxy **) p_existing = portproxy_chase (existing);
+  return 0;
+}
+
+static error_t
+new_copyin (mach_port_t right, void *p_existing)
+{
+  error_t err;
+  struct portproxy *created;
+
+  err = portproxy_copyin (right, MACH_PORT_RIGHT_SEND,
+                          class, bucket, sizeof (struct portproxy),
+                          p_existing, &created);
+  assert_backtrace (err || !created);
+  return err;
+}
+
+struct run
+{
+  error_t (*copyin) (mach_port_t, void *);
+  pthread_barrier_t *barrier;
+  volatile int *stop;
+  unsigned long ops;
+  unsigned int id;
+};
+
+static void *
+worker (void *arg)
+{
+  error_t err;
+  struct run *run = arg;
+  struct portproxy *proxy;
+  unsigned int i, j;
+
+  pthread_barrier_wait (run->barrier);
+
+  while (!*run->stop)
+    {
+      /* Each lookup consumes a user reference.  */
+      for (i = 0; i < NRIGHTS; i++)
+        {
+          err = mach_port_mod_refs (mach_task_self (), rights[i],
+                                    MACH_PORT_RIGHT_SEND, BATCH);
+          assert_perror_backtrace (err);
+        }
+
+      for (j = 0; j < BATCH; j++)
+        for (i = 0; i < NRIGHTS; i++)
+          {
+            err = (*run->copyin) (rights[(i + run->id) % NRIGHTS], &proxy);
+            assert_perror_backtrace (err);
+            portproxy_unlock (proxy);
+            portproxy_deref (proxy);
+          }
+
+      run->ops += BATCH * NRIGHTS;
+    }
+
+  return NULL;
+}
+
+static double
+measure (error_t (*copyin) (mach_port_t, void *),
+         unsigned int nthreads, unsigned int seconds)
+{
+  pthread_t threads[nthreads];
+  struct run runs[nthreads];
+  pthread_barrier_t barrier;
+  volatile int stop = 0;
+  struct timespec start, end;
+  unsigned long ops = 0;
+  unsigned int i;
+
+  pthread_barrier_init (&barrier, NULL, nthreads + 1);
+
+  for (i = 0; i < nthreads; i++)
+    {
+      runs[i] = (struct run) { copyin, &barrier, &stop, 0, i };
+      pthread_create (&threads[i], NULL, worker, &runs[i]);
+    }
+
+  pthread_barrier_wait (&barrier);
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  sleep (seconds);
+  stop = 1;
+
+  for (i = 0; i < nthreads; i++)
+    {
+      pthread_join (threads[i], NULL);
+      ops += runs[i].ops;
+    }
+  clock_gettime (CLOCK_MONOTONIC, &end);
+
+  pthread_barrier_destroy (&barrier);
+
+  return ops / ((end.tv_sec - start.tv_sec)
+                + (end.tv_nsec - start.tv_nsec) / 1e9);
+}
+
+int
+main (int argc, char **argv)
+{
+  error_t err;
+  unsigned int max_threads = argc > 1 ? atoi (argv[1]) : 8;
+  unsigned int seconds = argc > 2 ? atoi (argv[2]) : 2;
+  struct portproxy *existing, *created;
+  unsigned int i, n;
+  double legacy, current;
+
+  bucket = ports_create_bucket ();
+  class = ports_create_class (NULL, NULL);
+
+  for (i = 0; i < NRIGHTS; i++)
+    {
+      /* Our own receive rights stand in for some other task's,
+         since they're not in the bucket.  */
+      err = mach_port_allocate (mach_task_self (),
+                                MACH_PORT_RIGHT_RECEIVE, &rights[i]);
+      assert_perror_backtrace (err);
+      err = mach_port_insert_right (mach_task_self (), rights[i],
+                                    rights[i], MACH_MSG_TYPE_MAKE_SEND);
+      assert_perror_backtrace (err);
+
+      err = portproxy_copyin (rights[i], MACH_PORT_RIGHT_SEND,
+                              class, bucket, sizeof (struct portproxy),
+                              &existing, &created);
+      assert_perror_backtrace (err);
+      portproxy_unlock (created);
+
+      /* Keep the proxy alive, and share it with the legacy table.  */
+      err = hurd_ihash_add (&legacy_proxies[rights[i] % 16],
+                            rights[i], created);
+      assert_perror_backtrace (err);
+    }
+
+  printf ("%8s %16s %16s %8s\n", "threads", "mutex+ihash/s", "lock-free/s",
+          "speedup");
+  for (n = 1; n <= max_threads; n *= 2)
+    {
+      legacy = measure (legacy_copyin, n, seconds);
+      current = measure (new_copyin, n, seconds);
+      printf ("%8u %16.0f %16.0f %7.2fx\n", n, legacy, current,
+              current / legacy);
+    }
+
+  return 0;
+}
@@ -0,0 +1,27 @@
+/* Userspace stand-in for the Hurd's <assert-backtrace.h>.  */
+
+#ifndef _STANDIN_ASSERT_BACKTRACE_H
+#define _STANDIN_ASSERT_BACKTRACE_H
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define assert_backtrace(expr) assert (expr)
+
+#define assert_perror_backtrace(errnum)                                 \
+  do                                                                    \
+    {                                                                   \
+      int __e = (errnum);                                               \
+      if (__e)                                                          \
+        {                                                               \
+          fprintf (stderr, "%s:%d: unexpected error %d\n",              \
+                   __FILE__, __LINE__, __e);                            \
+          abort ();                                                     \
+        }                                                               \
+    }                                                                   \
+  while (0)
+
+#endif
@@ -0,0 +1,56 @@
+/* Userspace stand-in for the Hurd's <hurd/ihash.h>.
+
+   Open addressing with linear probing, growing by a full rehash when
+   the load factor is exceeded, like the real libihash.  */
+
+#ifndef _STANDIN_HURD_IHASH_H
+#define _STANDIN_HURD_IHASH_H
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef void *hurd_ihash_value_t;
+typedef uintptr_t hurd_ihash_key_t;
+typedef hurd_ihash_value_t *hurd_ihash_locp_t;
+
+struct _hurd_ihash_item
+{
+  hurd_ihash_value_t value;
+  hurd_ihash_key_t key;
+};
+
+struct hurd_ihash
+{
+  size_t nr_items;
+  size_t size;
+  struct _hurd_ihash_item *items;
+  unsigned int max_load;
+  intptr_t locp_offset;
+};
+typedef struct hurd_ihash *hurd_ihash_t;
+
+#define HURD_IHASH_MAX_LOAD_DEFAULT 75
+#define HURD_IHASH_NO_LOCP INTPTR_MIN
+
+#define HURD_IHASH_INITIALIZER(locp_offs)                       \
+  { .nr_items = 0, .size = 0, .items = NULL,                    \
+    .max_load = HURD_IHASH_MAX_LOAD_DEFAULT,                    \
+    .locp_offset = (locp_offs) }
+
+extern void hurd_ihash_init (hurd_ihash_t ht, intptr_t locp_offs);
+extern void hurd_ihash_destroy (hurd_ihash_t ht);
+extern error_t hurd_ihash_add (hurd_ihash_t ht, hurd_ihash_key_t key,
+                               hurd_ihash_value_t item);
+extern hurd_ihash_value_t hurd_ihash_find (hurd_ihash_t ht,
+                                           hurd_ihash_key_t key);
+extern int hurd_ihash_remove (hurd_ihash_t ht, hurd_ihash_key_t key);
+extern void hurd_ihash_locp_remove (hurd_ihash_t ht, hurd_ihash_locp_t locp);
+
+static inline size_t
+hurd_ihash_get_load (hurd_ihash_t ht)
+{
+  return ht->size ? ht->nr_items * 100 / ht->size : 0;
+}
+
+#endif
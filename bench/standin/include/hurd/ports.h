@@ -0,0 +1,74 @@
+/* Userspace stand-in for the Hurd's <hurd/ports.h>.
+
+   Only the calls libportproxy makes are provided.  Ports never receive
+   messages and no-senders notifications are never generated, so a port
+   lives exactly as long as its hard references.  */
+
+#ifndef _STANDIN_HURD_PORTS_H
+#define _STANDIN_HURD_PORTS_H
+
+#include <mach.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <hurd/ihash.h>
+#include <refcount.h>
+#include <assert-backtrace.h>
+
+struct port_info
+{
+  struct port_class *class;
+  refcounts_t refcounts;
+  mach_port_mscount_t mscount;
+  mach_msg_seqno_t cancel_threshold;
+  int flags;
+  mach_port_t port_right;
+  struct rpc_info *current_rpcs;
+  struct port_bucket *bucket;
+  hurd_ihash_locp_t hentry;
+  hurd_ihash_locp_t ports_htable_entry;
+};
+typedef struct port_info *port_info_t;
+
+struct port_bucket
+{
+  mach_port_t portset;
+  struct hurd_ihash htable;
+  int rpcs;
+  int flags;
+  int count;
+};
+
+struct port_class
+{
+  int flags;
+  int rpcs;
+  struct port_info *ports;
+  int count;
+  void (*clean_routine) (void *);
+  void (*dropweak_routine) (void *);
+};
+
+#define PORT_HAS_SENDRIGHTS 0x02
+
+extern struct port_bucket *ports_create_bucket (void);
+extern struct port_class *ports_create_class (void (*clean_routine) (void *),
+                                              void (*dropweak_routine) (void *));
+extern error_t ports_create_port (struct port_class *class,
+                                  struct port_bucket *bucket,
+                                  size_t size, void *result);
+extern error_t ports_create_port_noinstall (struct port_class *class,
+                                            struct port_bucket *bucket,
+                                            size_t size, void *result);
+extern void *ports_lookup_port (struct port_bucket *bucket,
+                                mach_port_t port, struct port_class *class);
+extern void *ports_lookup_payload (struct port_bucket *bucket,
+                                   unsigned long payload,
+                                   struct port_class *class);
+extern mach_port_t ports_get_right (void *port);
+extern mach_port_t ports_claim_right (void *port);
+extern void ports_reallocate_from_external (void *port, mach_port_t receive);
+extern error_t ports_destroy_right (void *port);
+extern void ports_port_ref (void *port);
+extern void ports_port_deref (void *port);
+
+#endif
@@ -0,0 +1,272 @@
+/* Userspace stand-in for the parts of <mach.h> used by libportproxy.
+
+   This is not an implementation of Mach IPC.  It models a single task's
+   port name space closely enough to exercise the proxy tables: names are
+   allocated as (index << 8) | generation like GNU Mach does, and user
+   references are counted per right.  Messages are never sent.  */
+
+#ifndef _STANDIN_MACH_H
+#define _STANDIN_MACH_H
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef unsigned int natural_t;
+typedef int integer_t;
+typedef uintptr_t vm_offset_t;
+typedef uintptr_t vm_address_t;
+typedef uintptr_t vm_size_t;
+typedef int kern_return_t;
+typedef natural_t mach_port_t;
+typedef natural_t mach_port_name_t;
+typedef natural_t mach_port_right_t;
+typedef natural_t mach_port_urefs_t;
+typedef int mach_port_delta_t;
+typedef natural_t mach_port_mscount_t;
+typedef natural_t mach_port_seqno_t;
+typedef natural_t mach_msg_seqno_t;
+typedef natural_t mach_msg_type_name_t;
+typedef natural_t mach_msg_type_number_t;
+typedef natural_t mach_msg_bits_t;
+typedef natural_t mach_msg_size_t;
+typedef integer_t mach_msg_id_t;
+typedef natural_t mach_msg_timeout_t;
+typedef integer_t mach_msg_option_t;
+typedef kern_return_t mach_msg_return_t;
+typedef mach_port_t task_t;
+typedef mach_port_t thread_t;
+typedef mach_port_t processor_set_t;
+typedef uintptr_t rpc_uintptr_t;
+
+#define KERN_SUCCESS            0
+#define KERN_INVALID_ADDRESS    1
+#define KERN_PROTECTION_FAILURE 2
+#define KERN_NO_SPACE           3
+#define KERN_INVALID_ARGUMENT   4
+#define KERN_FAILURE            5
+#define KERN_RESOURCE_SHORTAGE  6
+#define KERN_INVALID_NAME       15
+#define KERN_INVALID_TASK       16
+#define KERN_INVALID_RIGHT      17
+#define KERN_INVALID_VALUE      18
+#define KERN_UREFS_OVERFLOW     19
+#define KERN_TIMEDOUT           27
+
+#define MIG_TYPE_ERROR          -300
+#define MIG_BAD_ID              -303
+
+#define MACH_PORT_NULL          ((mach_port_t) 0)
+#define MACH_PORT_DEAD          ((mach_port_t) ~0)
+#define MACH_PORT_VALID(name) \
+  (((name) != MACH_PORT_NULL) && ((name) != MACH_PORT_DEAD))
+
+#define MACH_PORT_INDEX(name)   ((name) >> 8)
+#define MACH_PORT_GEN(name)     ((name) & 0xff)
+#define MACH_PORT_MAKE(index, gen) (((index) << 8) | ((gen) & 0xff))
+
+#define MACH_PORT_RIGHT_SEND        ((mach_port_right_t) 0)
+#define MACH_PORT_RIGHT_RECEIVE     ((mach_port_right_t) 1)
+#define MACH_PORT_RIGHT_SEND_ONCE   ((mach_port_right_t) 2)
+#define MACH_PORT_RIGHT_PORT_SET    ((mach_port_right_t) 3)
+#define MACH_PORT_RIGHT_DEAD_NAME   ((mach_port_right_t) 4)
+#define MACH_PORT_RIGHT_NUMBER      ((mach_port_right_t) 5)
+
+#define MACH_PORT_UREFS_MAX     ((mach_port_urefs_t) ((1 << 16) - 1))
+
+#define MACH_MSG_TYPE_UNSTRUCTURED      0
+#define MACH_MSG_TYPE_BIT               0
+#define MACH_MSG_TYPE_BOOLEAN           0
+#define MACH_MSG_TYPE_INTEGER_16        1
+#define MACH_MSG_TYPE_INTEGER_32        2
+#define MACH_MSG_TYPE_CHAR              8
+#define MACH_MSG_TYPE_BYTE              9
+#define MACH_MSG_TYPE_INTEGER_8         9
+#define MACH_MSG_TYPE_INTEGER_64        11
+#define MACH_MSG_TYPE_STRING            12
+#define MACH_MSG_TYPE_STRING_C          12
+
+#define MACH_MSG_TYPE_MOVE_RECEIVE      16
+#define MACH_MSG_TYPE_MOVE_SEND         17
+#define MACH_MSG_TYPE_MOVE_SEND_ONCE    18
+#define MACH_MSG_TYPE_COPY_SEND         19
+#define MACH_MSG_TYPE_MAKE_SEND         20
+#define MACH_MSG_TYPE_MAKE_SEND_ONCE    21
+#define MACH_MSG_TYPE_PROTECTED_PAYLOAD 23
+
+#define MACH_MSG_TYPE_PORT_NAME         15
+#define MACH_MSG_TYPE_PORT_RECEIVE      MACH_MSG_TYPE_MOVE_RECEIVE
+#define MACH_MSG_TYPE_PORT_SEND         MACH_MSG_TYPE_MOVE_SEND
+#define MACH_MSG_TYPE_PORT_SEND_ONCE    MACH_MSG_TYPE_MOVE_SEND_ONCE
+
+#define MACH_MSG_TYPE_PORT_ANY(x) \
+  (((x) >= MACH_MSG_TYPE_MOVE_RECEIVE) \
+   && ((x) <= MACH_MSG_TYPE_MAKE_SEND_ONCE))
+#define MACH_MSG_TYPE_PORT_ANY_SEND(x) \
+  (((x) >= MACH_MSG_TYPE_MOVE_SEND) \
+   && ((x) <= MACH_MSG_TYPE_MAKE_SEND_ONCE))
+#define MACH_MSG_TYPE_PORT_ANY_RIGHT(x) \
+  (((x) >= MACH_MSG_TYPE_MOVE_RECEIVE) \
+   && ((x) <= MACH_MSG_TYPE_MOVE_SEND_ONCE))
+
+#define MACH_MSGH_BITS_ZERO             0x00000000
+#define MACH_MSGH_BITS_REMOTE_MASK      0x000000ff
+#define MACH_MSGH_BITS_LOCAL_MASK       0x0000ff00
+#define MACH_MSGH_BITS_COMPLEX          0x80000000U
+#define MACH_MSGH_BITS_PORTS_MASK \
+  (MACH_MSGH_BITS_REMOTE_MASK | MACH_MSGH_BITS_LOCAL_MASK)
+#define MACH_MSGH_BITS(remote, local)   ((remote) | ((local) << 8))
+#define MACH_MSGH_BITS_REMOTE(bits)     ((bits) & MACH_MSGH_BITS_REMOTE_MASK)
+#define MACH_MSGH_BITS_LOCAL(bits) \
+  (((bits) & MACH_MSGH_BITS_LOCAL_MASK) >> 8)
+#define MACH_MSGH_BITS_PORTS(bits)      ((bits) & MACH_MSGH_BITS_PORTS_MASK)
+#define MACH_MSGH_BITS_OTHER(bits)      ((bits) &~ MACH_MSGH_BITS_PORTS_MASK)
+
+typedef struct
+{
+  mach_msg_bits_t msgh_bits;
+  mach_msg_size_t msgh_size;
+  mach_port_t msgh_remote_port;
+  union
+  {
+    mach_port_t msgh_local_port;
+    rpc_uintptr_t msgh_protected_payload;
+  };
+  mach_port_seqno_t msgh_seqno;
+  mach_msg_id_t msgh_id;
+} mach_msg_header_t;
+
+typedef struct
+{
+  unsigned int msgt_name : 8,
+               msgt_size : 8,
+               msgt_number : 12,
+               msgt_inline : 1,
+               msgt_longform : 1,
+               msgt_deallocate : 1,
+               msgt_unused : 1;
+} __attribute__ ((aligned (__alignof__ (uintptr_t)))) mach_msg_type_t;
+
+typedef struct
+{
+  mach_msg_type_t msgtl_header;
+  unsigned short msgtl_name;
+  unsigned short msgtl_size;
+  natural_t msgtl_number;
+} __attribute__ ((aligned (__alignof__ (uintptr_t)))) mach_msg_type_long_t;
+
+#define MACH_MSG_SUCCESS        0x00000000
+#define MACH_MSG_OPTION_NONE    0x00000000
+#define MACH_SEND_MSG           0x00000001
+#define MACH_RCV_MSG            0x00000002
+#define MACH_SEND_TIMEOUT       0x00000010
+#define MACH_SEND_INTERRUPT     0x00000040
+#define MACH_RCV_TIMEOUT        0x00000100
+#define MACH_RCV_INTERRUPT      0x00000400
+#define MACH_RCV_LARGE          0x00000800
+#define MACH_MSG_TIMEOUT_NONE   ((mach_msg_timeout_t) 0)
+
+#define MACH_MSG_IPC_SPACE      0x00002000
+#define MACH_MSG_VM_SPACE       0x00001000
+#define MACH_MSG_IPC_KERNEL     0x00000800
+#define MACH_MSG_VM_KERNEL      0x00000400
+#define MACH_SEND_IN_PROGRESS   0x10000001
+#define MACH_SEND_INVALID_DATA  0x10000002
+#define MACH_SEND_INVALID_DEST  0x10000003
+#define MACH_SEND_TIMED_OUT     0x10000004
+#define MACH_SEND_INTERRUPTED   0x10000007
+#define MACH_SEND_MSG_TOO_SMALL 0x10000008
+#define MACH_SEND_INVALID_REPLY 0x10000009
+#define MACH_SEND_INVALID_RIGHT 0x1000000a
+#define MACH_SEND_INVALID_NOTIFY 0x1000000b
+#define MACH_SEND_INVALID_MEMORY 0x1000000c
+#define MACH_SEND_NO_BUFFER     0x1000000d
+#define MACH_SEND_INVALID_TYPE  0x1000000f
+#define MACH_SEND_INVALID_HEADER 0x10000010
+#define MACH_RCV_IN_PROGRESS    0x10004001
+#define MACH_RCV_INVALID_NAME   0x10004002
+#define MACH_RCV_TIMED_OUT      0x10004003
+#define MACH_RCV_TOO_LARGE      0x10004004
+#define MACH_RCV_INTERRUPTED    0x10004005
+#define MACH_RCV_PORT_CHANGED   0x10004006
+#define MACH_RCV_INVALID_NOTIFY 0x10004007
+#define MACH_RCV_INVALID_DATA   0x10004008
+#define MACH_RCV_PORT_DIED      0x10004009
+#define MACH_RCV_IN_SET         0x1000400a
+#define MACH_RCV_HEADER_ERROR   0x1000400b
+#define MACH_RCV_BODY_ERROR     0x1000400c
+
+#define GSYNC_SHARED    0x01
+#define GSYNC_QUAD      0x02
+#define GSYNC_TIMED     0x04
+#define GSYNC_BROADCAST 0x08
+#define GSYNC_MUTATE    0x10
+
+#define vm_page_size ((vm_size_t) 4096)
+
+extern mach_port_t mach_task_self (void);
+extern mach_port_t mach_thread_self (void);
+extern mach_port_t mach_reply_port (void);
+
+extern kern_return_t mach_port_allocate (task_t task,
+                                         mach_port_right_t right,
+                                         mach_port_t *name);
+extern kern_return_t mach_port_deallocate (task_t task, mach_port_t name);
+extern kern_return_t mach_port_destroy (task_t task, mach_port_t name);
+extern kern_return_t mach_port_mod_refs (task_t task, mach_port_t name,
+                                         mach_port_right_t right,
+                                         mach_port_delta_t delta);
+extern kern_return_t mach_port_get_refs (task_t task, mach_port_t name,
+                                         mach_port_right_t right,
+                                         mach_port_urefs_t *refs);
+extern kern_return_t mach_port_insert_right (task_t task, mach_port_t name,
+                                             mach_port_t poly,
+                                             mach_msg_type_name_t polyPoly);
+extern kern_return_t mach_port_extract_right (task_t task, mach_port_t name,
+                                              mach_msg_type_name_t desired,
+                                              mach_port_t *poly,
+                                              mach_msg_type_name_t *polyPoly);
+extern kern_return_t mach_port_set_protected_payload (task_t task,
+                                                      mach_port_t name,
+                                                      unsigned long payload);
+extern kern_return_t mach_port_clear_protected_payload (task_t task,
+                                                        mach_port_t name);
+
+extern kern_return_t vm_allocate (task_t task, vm_address_t *address,
+                                  vm_size_t size, int anywhere);
+extern kern_return_t vm_deallocate (task_t task, vm_address_t address,
+                                    vm_size_t size);
+
+extern kern_return_t thread_assign (thread_t thread, processor_set_t pset);
+
+extern kern_return_t gsync_wait (task_t task, vm_offset_t addr,
+                                 unsigned int val1, unsigned int val2,
+                                 natural_t msec, int flags);
+extern kern_return_t gsync_wake (task_t task, vm_offset_t addr,
+                                 unsigned int val, int flags);
+
+extern mach_msg_return_t mach_msg (mach_msg_header_t *msg,
+                                   mach_msg_option_t option,
+                                   mach_msg_size_t send_size,
+                                   mach_msg_size_t rcv_size,
+                                   mach_port_t rcv_name,
+                                   mach_msg_timeout_t timeout,
+                                   mach_port_t notify);
+extern void mach_msg_destroy (mach_msg_header_t *msg);
+
+/* Stand-in bookkeeping, not part of the Mach interface.  */
+
+/* Number of simulated kernel traps made so far.  */
+extern unsigned long standin_trap_count (void);
+
+/* Number of those made by the calling thread.  */
+extern unsigned long standin_thread_trap_count (void);
+
+/* Make every simulated trap spin for NS nanoseconds,
+   to approximate the cost of a real kernel entry.  */
+extern void standin_set_trap_cost (unsigned long ns);
+
+/* Number of live names in the simulated name space.  */
+extern unsigned long standin_live_names (void);
+
+#endif
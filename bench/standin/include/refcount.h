@@ -0,0 +1,134 @@
+/* Userspace stand-in for the Hurd's <refcount.h>.  */
+
+#ifndef _STANDIN_REFCOUNT_H
+#define _STANDIN_REFCOUNT_H
+
+#include <stdint.h>
+#include "assert-backtrace.h"
+
+typedef unsigned int refcount_t;
+
+static inline void
+refcount_init (refcount_t *ref, unsigned int references)
+{
+  *ref = references;
+}
+
+static inline unsigned int
+refcount_unsafe_ref (refcount_t *ref)
+{
+  return __atomic_add_fetch (ref, 1, __ATOMIC_RELAXED);
+}
+
+static inline unsigned int
+refcount_ref (refcount_t *ref)
+{
+  unsigned int r = refcount_unsafe_ref (ref);
+  assert_backtrace (r != 1 || !"refcount detected use-after-free!");
+  return r;
+}
+
+static inline unsigned int
+refcount_deref (refcount_t *ref)
+{
+  unsigned int r = __atomic_sub_fetch (ref, 1, __ATOMIC_RELAXED);
+  assert_backtrace (r != UINT32_MAX || !"refcount underflow!");
+  return r;
+}
+
+static inline unsigned int
+refcount_references (refcount_t *ref)
+{
+  return __atomic_load_n (ref, __ATOMIC_RELAXED);
+}
+
+struct references
+{
+  uint32_t hard;
+  uint32_t weak;
+};
+
+union _references
+{
+  struct references references;
+  uint64_t value;
+};
+
+typedef union _references refcounts_t;
+
+static inline void
+refcounts_init (refcounts_t *ref, uint32_t hard, uint32_t weak)
+{
+  ref->references = (struct references) { .hard = hard, .weak = weak };
+}
+
+static inline void
+refcounts_unsafe_ref (refcounts_t *ref, struct references *result)
+{
+  const union _references op = { .references = { .hard = 1 } };
+  union _references r;
+  r.value = __atomic_add_fetch (&ref->value, op.value, __ATOMIC_RELAXED);
+  if (result)
+    *result = r.references;
+}
+
+static inline void
+refcounts_ref (refcounts_t *ref, struct references *result)
+{
+  struct references r;
+  refcounts_unsafe_ref (ref, &r);
+  assert_backtrace (! (r.hard == 1 && r.weak == 0)
+                    || !"refcount detected use-after-free!");
+  if (result)
+    *result = r;
+}
+
+static inline void
+refcounts_deref (refcounts_t *ref, struct references *result)
+{
+  const union _references op = { .references = { .hard = 1 } };
+  union _references r;
+  r.value = __atomic_sub_fetch (&ref->value, op.value, __ATOMIC_RELAXED);
+  assert_backtrace (r.references.hard != UINT32_MAX
+                    || !"refcount underflow!");
+  if (result)
+    *result = r.references;
+}
+
+static inline void
+refcounts_ref_weak (refcounts_t *ref, struct references *result)
+{
+  const union _references op = { .references = { .weak = 1 } };
+  union _references r;
+  r.value = __atomic_add_fetch (&ref->value, op.value, __ATOMIC_RELAXED);
+  if (result)
+    *result = r.references;
+}
+
+static inline void
+refcounts_deref_weak (refcounts_t *ref, struct references *result)
+{
+  const union _references op = { .references = { .weak = 1 } };
+  union _references r;
+  r.value = __atomic_sub_fetch (&ref->value, op.value, __ATOMIC_RELAXED);
+  if (result)
+    *result = r.references;
+}
+
+static inline void
+refcounts_references (refcounts_t *ref, struct references *result)
+{
+  union _references r;
+  r.value = __atomic_load_n (&ref->value, __ATOMIC_RELAXED);
+  *result = r.references;
+}
+
+static inline uint32_t
+refcounts_hard_references (refcounts_t *ref)
+{
+  struct references result;
+  refcounts_references (ref, &result);
+  return result.hard;
+}
+
+#endif
@@ -0,0 +1,138 @@
+/* Userspace stand-in for the Hurd's libihash.  */
+
+#include <hurd/ihash.h>
+
+#include <stdlib.h>
+
+#define EMPTY ((hurd_ihash_value_t) 0)
+#define DELETED ((hurd_ihash_value_t) -1)
+#define MIN_SIZE 32
+
+static inline int
+index_valid (hurd_ihash_value_t value)
+{
+  return value != EMPTY && value != DELETED;
+}
+
+static inline size_t
+hash (hurd_ihash_key_t key)
+{
+  return key;
+}
+
+static inline void
+set_locp (hurd_ihash_t ht, hurd_ihash_value_t value,
+          hurd_ihash_locp_t locp)
+{
+  if (ht->locp_offset != HURD_IHASH_NO_LOCP)
+    *(hurd_ihash_locp_t *) ((char *) value + ht->locp_offset) = locp;
+}
+
+void
+hurd_ihash_init (hurd_ihash_t ht, intptr_t locp_offs)
+{
+  *ht = (struct hurd_ihash) HURD_IHASH_INITIALIZER (locp_offs);
+}
+
+void
+hurd_ihash_destroy (hurd_ihash_t ht)
+{
+  free (ht->items);
+  ht->items = NULL;
+  ht->size = 0;
+  ht->nr_items = 0;
+}
+
+/* Store without growing; the table must have a free slot.  */
+static void
+add_one (hurd_ihash_t ht, hurd_ihash_key_t key, hurd_ihash_value_t value)
+{
+  size_t mask = ht->size - 1;
+  size_t i = hash (key) & mask;
+
+  while (index_valid (ht->items[i].value))
+    i = (i + 1) & mask;
+
+  ht->items[i].value = value;
+  ht->items[i].key = key;
+  set_locp (ht, value, &ht->items[i].value);
+}
+
+error_t
+hurd_ihash_add (hurd_ihash_t ht, hurd_ihash_key_t key,
+                hurd_ihash_value_t item)
+{
+  struct hurd_ihash old = *ht;
+  size_t i;
+
+  hurd_ihash_remove (ht, key);
+
+  if (ht->size == 0
+      || (ht->nr_items + 1) * 100 > ht->size * ht->max_load)
+    {
+      /* Stop the world and rehash everything into a table twice
+         the size.  */
+      ht->size = old.size ? 2 * old.size : MIN_SIZE;
+      ht->items = calloc (ht->size, sizeof *ht->items);
+      if (!ht->items)
+        {
+          *ht = old;
+          return ENOMEM;
+        }
+      for (i = 0; i < old.size; i++)
+        if (index_valid (old.items[i].value))
+          add_one (ht, old.items[i].key, old.items[i].value);
+      free (old.items);
+    }
+
+  add_one (ht, key, item);
+  ht->nr_items++;
+  return 0;
+}
+
+static struct _hurd_ihash_item *
+find_item (hurd_ihash_t ht, hurd_ihash_key_t key)
+{
+  size_t mask, i, n;
+
+  if (ht->size == 0)
+    return NULL;
+
+  mask = ht->size - 1;
+  i = hash (key) & mask;
+  for (n = 0; n < ht->size; n++, i = (i + 1) & mask)
+    {
+      if (ht->items[i].value == EMPTY)
+        return NULL;
+      if (ht->items[i].value != DELETED && ht->items[i].key == key)
+        return &ht->items[i];
+    }
+  return NULL;
+}
+
+hurd_ihash_value_t
+hurd_ihash_find (hurd_ihash_t ht, hurd_ihash_key_t key)
+{
+  struct _hurd_ihash_item *item = find_item (ht, key);
+
+  return item ? item->value : NULL;
+}
+
+void
+hurd_ihash_locp_remove (hurd_ihash_t ht, hurd_ihash_locp_t locp)
+{
+  *locp = DELETED;
+  ht->nr_items--;
+}
+
+int
+hurd_ihash_remove (hurd_ihash_t ht, hurd_ihash_key_t key)
+{
+  struct _hurd_ihash_item *item = find_item (ht, key);
+
+  if (!item)
+    return 0;
+
+  hurd_ihash_locp_remove (ht, &item->value);
+  return 1;
+}
@@ -0,0 +1,526 @@
+/* Userspace stand-in for the Mach port name space of a single task.  */
+
+
+#include <mach.h>
+
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+struct entry
+{
+  unsigned int gen;
+  int in_use;
+  int receive;
+  mach_port_urefs_t send;
+  mach_port_urefs_t send_once;
+  mach_port_urefs_t dead;
+  unsigned long payload;
+};
+
+static pthread_mutex_t space_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct entry *entries;
+static size_t nr_entries;
+static size_t *free_indices;
+static size_t nr_free;
+static unsigned long live_names;
+
+static unsigned long trap_count;
+static __thread unsigned long thread_trap_count;
+static unsigned long trap_cost_ns;
+
+static unsigned long
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* Account for one kernel entry.  */
+static void
+trap (void)
+{
+  unsigned long cost = __atomic_load_n (&trap_cost_ns, __ATOMIC_RELAXED);
+  unsigned long start;
+
+  __atomic_add_fetch (&trap_count, 1, __ATOMIC_RELAXED);
+  thread_trap_count++;
+  if (cost)
+    {
+      start = now_ns ();
+      while (now_ns () - start < cost)
+        ;
+    }
+}
+
+unsigned long
+standin_trap_count (void)
+{
+  return __atomic_load_n (&trap_count, __ATOMIC_RELAXED);
+}
+
+unsigned long
+standin_thread_trap_count (void)
+{
+  return thread_trap_count;
+}
+
+void
+standin_set_trap_cost (unsigned long ns)
+{
+  __atomic_store_n (&trap_cost_ns, ns, __ATOMIC_RELAXED);
+}
+
+unsigned long
+standin_live_names (void)
+{
+  unsigned long n;
+
+  pthread_mutex_lock (&space_lock);
+  n = live_names;
+  pthread_mutex_unlock (&space_lock);
+  return n;
+}
+
+/* Look up NAME; called with space_lock held.  */
+static struct entry *
+lookup (mach_port_t name)
+{
+  size_t index = MACH_PORT_INDEX (name);
+  struct entry *e;
+
+  if (!MACH_PORT_VALID (name) || index == 0 || index >= nr_entries)
+    return NULL;
+
+  e = &entries[index];
+  if (!e->in_use || e->gen != MACH_PORT_GEN (name))
+    return NULL;
+  return e;
+}
+
+/* Allocate a fresh name; called with space_lock held.  */
+static mach_port_t
+allocate_name (struct entry **result)
+{
+  size_t index;
+  struct entry *e;
+
+  if (nr_free > 0)
+    index = free_indices[--nr_free];
+  else
+    {
+      if (nr_entries == 0)
+        nr_entries = 1;   /* Index 0 is never used.  */
+      if ((nr_entries & (nr_entries - 1)) == 0)
+        {
+          entries = realloc (entries, 2 * nr_entries * sizeof *entries);
+          free_indices = realloc (free_indices,
+                                  2 * nr_entries * sizeof *free_indices);
+          if (!entries || !free_indices)
+            abort ();
+        }
+      index = nr_entries++;
+      entries[index].gen = 0;
+    }
+
+  e = &entries[index];
+  /* Like GNU Mach, bump the generation each time an index is reused.  */
+  e->gen = (e->gen + 1) & 0xff;
+  if (MACH_PORT_MAKE (index, e->gen) == MACH_PORT_DEAD)
+    e->gen = (e->gen + 1) & 0xff;
+  e->in_use = 1;
+  e->receive = 0;
+  e->send = 0;
+  e->send_once = 0;
+  e->dead = 0;
+  e->payload = 0;
+  live_names++;
+
+  *result = e;
+  return MACH_PORT_MAKE (index, e->gen);
+}
+
+/* Release E's name if it holds no rights anymore.  */
+static void
+maybe_free (struct entry *e)
+{
+  if (e->receive || e->send || e->send_once || e->dead)
+    return;
+
+  e->in_use = 0;
+  free_indices[nr_free++] = e - entries;
+  live_names--;
+}
+
+mach_port_t
+mach_task_self (void)
+{
+  return 1;
+}
+
+mach_port_t
+mach_thread_self (void)
+{
+  return (mach_port_t) syscall (SYS_gettid);
+}
+
+mach_port_t
+mach_reply_port (void)
+{
+  mach_port_t name;
+  struct entry *e;
+
+  trap ();
+  pthread_mutex_lock (&space_lock);
+  name = allocate_name (&e);
+  e->receive = 1;
+  pthread_mutex_unlock (&space_lock);
+  return name;
+}
+
+kern_return_t
+mach_port_allocate (task_t task, mach_port_right_t right, mach_port_t *name)
+{
+  struct entry *e;
+
+  trap ();
+  if (right != MACH_PORT_RIGHT_RECEIVE && right != MACH_PORT_RIGHT_DEAD_NAME)
+    return KERN_INVALID_VALUE;
+
+  pthread_mutex_lock (&space_lock);
+  *name = allocate_name (&e);
+  if (right == MACH_PORT_RIGHT_RECEIVE)
+    e->receive = 1;
+  else
+    e->dead = 1;
+  pthread_mutex_unlock (&space_lock);
+  return KERN_SUCCESS;
+}
+
+/* Adjust one kind of user reference; called with space_lock held.  */
+static kern_return_t
+mod_refs (struct entry *e, mach_port_right_t right, mach_port_delta_t delta)
+{
+  mach_port_urefs_t *urefs;
+
+  switch (right)
+    {
+    case MACH_PORT_RIGHT_SEND:
+      urefs = &e->send;
+      break;
+    case MACH_PORT_RIGHT_SEND_ONCE:
+      urefs = &e->send_once;
+      break;
+    case MACH_PORT_RIGHT_DEAD_NAME:
+      urefs = &e->dead;
+      break;
+    case MACH_PORT_RIGHT_RECEIVE:
+      if (!e->receive)
+        return KERN_INVALID_RIGHT;
+      if (delta == 0)
+        return KERN_SUCCESS;
+      if (delta != -1)
+        return KERN_INVALID_VALUE;
+      e->receive = 0;
+      /* Our own send rights turn into a dead name.  */
+      e->dead += e->send + e->send_once;
+      e->send = 0;
+      e->send_once = 0;
+      e->payload = 0;
+      maybe_free (e);
+      return KERN_SUCCESS;
+    default:
+      return KERN_INVALID_VALUE;
+    }
+
+  if (*urefs == 0)
+    return KERN_INVALID_RIGHT;
+  if (delta < 0 && (mach_port_urefs_t) -delta > *urefs)
+    return KERN_INVALID_VALUE;
+  if (delta > 0 && *urefs + delta > MACH_PORT_UREFS_MAX)
+    return KERN_UREFS_OVERFLOW;
+
+  *urefs += delta;
+  maybe_free (e);
+  return KERN_SUCCESS;
+}
+
+kern_return_t
+mach_port_deallocate (task_t task, mach_port_t name)
+{
+  kern_return_t err;
+  struct entry *e;
+
+  trap ();
+  pthread_mutex_lock (&space_lock);
+  e = lookup (name);
+  if (!e)
+    err = KERN_INVALID_NAME;
+  else if (e->send)
+    err = mod_refs (e, MACH_PORT_RIGHT_SEND, -1);
+  else if (e->send_once)
+    err = mod_refs (e, MACH_PORT_RIGHT_SEND_ONCE, -1);
+  else if (e->dead)
+    err = mod_refs (e, MACH_PORT_RIGHT_DEAD_NAME, -1);
+  else
+    err = KERN_INVALID_RIGHT;
+  pthread_mutex_unlock (&space_lock);
+  return err;
+}
+
+kern_return_t
+mach_port_destroy (task_t task, mach_port_t name)
+{
+  struct entry *e;
+
+  trap ();
+  pthread_mutex_lock (&space_lock);
+  e = lookup (name);
+  if (e)
+    {
+      e->receive = 0;
+      e->send = 0;
+      e->send_once = 0;
+      e->dead = 0;
+      maybe_free (e);
+    }
+  pthread_mutex_unlock (&space_lock);
+  return e ? KERN_SUCCESS : KERN_INVALID_NAME;
+}
+
+kern_return_t
+mach_port_mod_refs (task_t task, mach_port_t name,
+                    mach_port_right_t right, mach_port_delta_t delta)
+{
+  kern_return_t err;
+  struct entry *e;
+
+  trap ();
+  pthread_mutex_lock (&space_lock);
+  e = lookup (name);
+  err = e ? mod_refs (e, right, delta) : KERN_INVALID_NAME;
+  pthread_mutex_unlock (&space_lock);
+  return err;
+}
+
+kern_return_t
+mach_port_get_refs (task_t task, mach_port_t name,
+                    mach_port_right_t right, mach_port_urefs_t *refs)
+{
+  kern_return_t err = KERN_SUCCESS;
+  struct entry *e;
+
+  trap ();
+  pthread_mutex_lock (&space_lock);
+  e = lookup (name);
+  if (!e)
+    err = KERN_INVALID_NAME;
+  else
+    switch (right)
+      {
+      case MACH_PORT_RIGHT_SEND:
+        *refs = e->send;
+        break;
+      case MACH_PORT_RIGHT_SEND_ONCE:
+        *refs = e->send_once;
+        break;
+      case MACH_PORT_RIGHT_DEAD_NAME:
+        *refs = e->dead;
+        break;
+      case MACH_PORT_RIGHT_RECEIVE:
+        *refs = e->receive;
+        break;
+      default:
+        err = KERN_INVALID_VALUE;
+      }
+  pthread_mutex_unlock (&space_lock);
+  return err;
+}
+
+kern_return_t
+mach_port_insert_right (task_t task, mach_port_t name,
+                        mach_port_t poly, mach_msg_type_name_t polyPoly)
+{
+  kern_return_t err = KERN_SUCCESS;
+  struct entry *e;
+
+  trap ();
+  pthread_mutex_lock (&space_lock);
+  e = lookup (name);
+  if (!e || name != poly)
+    err = KERN_INVALID_NAME;
+  else
+    switch (polyPoly)
+      {
+      case MACH_MSG_TYPE_MAKE_SEND:
+        if (!e->receive)
+          err = KERN_INVALID_RIGHT;
+        else if (e->send == MACH_PORT_UREFS_MAX)
+          err = KERN_UREFS_OVERFLOW;
+        else
+          e->send++;
+        break;
+      case MACH_MSG_TYPE_COPY_SEND:
+        if (!e->send)
+          err = KERN_INVALID_RIGHT;
+        else if (e->send == MACH_PORT_UREFS_MAX)
+          err = KERN_UREFS_OVERFLOW;
+        else
+          e->send++;
+        break;
+      default:
+        err = KERN_INVALID_VALUE;
+      }
+  pthread_mutex_unlock (&space_lock);
+  return err;
+}
+
+kern_return_t
+mach_port_extract_right (task_t task, mach_port_t name,
+                         mach_msg_type_name_t desired,
+                         mach_port_t *poly, mach_msg_type_name_t *polyPoly)
+{
+  kern_return_t err = KERN_SUCCESS;
+  struct entry *e, *n;
+
+  trap ();
+  pthread_mutex_lock (&space_lock);
+  e = lookup (name);
+  if (!e)
+    err = KERN_INVALID_NAME;
+  else
+    switch (desired)
+      {
+      case MACH_MSG_TYPE_MAKE_SEND_ONCE:
+        if (!e->receive)
+          {
+            err = KERN_INVALID_RIGHT;
+            break;
+          }
+        /* A send-once right always gets its own name.  */
+        *poly = allocate_name (&n);
+        n->send_once = 1;
+        *polyPoly = MACH_MSG_TYPE_PORT_SEND_ONCE;
+        break;
+      case MACH_MSG_TYPE_MAKE_SEND:
+      case MACH_MSG_TYPE_COPY_SEND:
+        if (desired == MACH_MSG_TYPE_MAKE_SEND ? !e->receive : !e->send)
+          err = KERN_INVALID_RIGHT;
+        else if (e->send == MACH_PORT_UREFS_MAX)
+          err = KERN_UREFS_OVERFLOW;
+        else
+          {
+            e->send++;
+            *poly = name;
+            *polyPoly = MACH_MSG_TYPE_PORT_SEND;
+          }
+        break;
+      default:
+        err = KERN_INVALID_VALUE;
+      }
+  pthread_mutex_unlock (&space_lock);
+  return err;
+}
+
+kern_return_t
+mach_port_set_protected_payload (task_t task, mach_port_t name,
+                                 unsigned long payload)
+{
+  kern_return_t err = KERN_SUCCESS;
+  struct entry *e;
+
+  trap ();
+  pthread_mutex_lock (&space_lock);
+  e = lookup (name);
+  if (!e)
+    err = KERN_INVALID_NAME;
+  else if (!e->receive)
+    err = KERN_INVALID_RIGHT;
+  else
+    e->payload = payload;
+  pthread_mutex_unlock (&space_lock);
+  return err;
+}
+
+kern_return_t
+mach_port_clear_protected_payload (task_t task, mach_port_t name)
+{
+  return mach_port_set_protected_payload (task, name, 0);
+}
+
+kern_return_t
+vm_allocate (task_t task, vm_address_t *address, vm_size_t size,
+             int anywhere)
+{
+  void *p;
+
+  trap ();
+  p = mmap (NULL, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    return KERN_NO_SPACE;
+  *address = (vm_address_t) p;
+  return KERN_SUCCESS;
+}
+
+kern_return_t
+vm_deallocate (task_t task, vm_address_t address, vm_size_t size)
+{
+  trap ();
+  if (size && munmap ((void *) address, size))
+    return KERN_INVALID_ADDRESS;
+  return KERN_SUCCESS;
+}
+
+kern_return_t
+thread_assign (thread_t thread, processor_set_t pset)
+{
+  trap ();
+  return KERN_SUCCESS;
+}
+
+kern_return_t
+gsync_wait (task_t task, vm_offset_t addr, unsigned int val1,
+            unsigned int val2, natural_t msec, int flags)
+{
+  trap ();
+  if (syscall (SYS_futex, (unsigned int *) addr, FUTEX_WAIT_PRIVATE,
+               val1, NULL, NULL, 0) && errno != EAGAIN && errno != EINTR)
+    return KERN_INVALID_ADDRESS;
+  return KERN_SUCCESS;
+}
+
+kern_return_t
+gsync_wake (task_t task, vm_offset_t addr, unsigned int val, int flags)
+{
+  trap ();
+  if (flags & GSYNC_MUTATE)
+    __atomic_store_n ((unsigned int *) addr, val, __ATOMIC_RELEASE);
+  syscall (SYS_futex, (unsigned int *) addr, FUTEX_WAKE_PRIVATE,
+           (flags & GSYNC_BROADCAST) ? INT32_MAX : 1, NULL, NULL, 0);
+  return KERN_SUCCESS;
+}
+
+mach_msg_return_t
+mach_msg (mach_msg_header_t *msg, mach_msg_option_t option,
+          mach_msg_size_t send_size, mach_msg_size_t rcv_size,
+          mach_port_t rcv_name, mach_msg_timeout_t timeout,
+          mach_port_t notify)
+{
+  /* There is no message passing in the stand-in.  */
+  trap ();
+  if (option & MACH_SEND_MSG)
+    return MACH_SEND_INVALID_DEST;
+  return MACH_RCV_INVALID_NAME;
+}
+
+void
+mach_msg_destroy (mach_msg_header_t *msg)
+{
+}
@@ -0,0 +1,274 @@
+/* Userspace stand-in for the Hurd's libports.  */
+
+#include <hurd/ports.h>
+
+#include <string.h>
+
+static pthread_rwlock_t htable_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct hurd_ihash htable =
+  HURD_IHASH_INITIALIZER (offsetof (struct port_info, ports_htable_entry));
+static pthread_mutex_t count_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct port_bucket *
+ports_create_bucket (void)
+{
+  struct port_bucket *bucket = calloc (1, sizeof *bucket);
+
+  if (!bucket)
+    return NULL;
+
+  hurd_ihash_init (&bucket->htable, offsetof (struct port_info, hentry));
+  bucket->portset = mach_reply_port ();
+  return bucket;
+}
+
+struct port_class *
+ports_create_class (void (*clean_routine) (void *),
+                    void (*dropweak_routine) (void *))
+{
+  struct port_class *class = calloc (1, sizeof *class);
+
+  if (!class)
+    return NULL;
+
+  class->clean_routine = clean_routine;
+  class->dropweak_routine = dropweak_routine;
+  return class;
+}
+
+static void
+install (struct port_info *pi)
+{
+  error_t err;
+
+  pthread_rwlock_wrlock (&htable_lock);
+  err = hurd_ihash_add (&htable, pi->port_right, pi);
+  assert_perror_backtrace (err);
+  err = hurd_ihash_add (&pi->bucket->htable, pi->port_right, pi);
+  assert_perror_backtrace (err);
+  pthread_rwlock_unlock (&htable_lock);
+}
+
+static void
+uninstall (struct port_info *pi)
+{
+  /* Ports created with ports_create_port_noinstall are not
+     in the tables yet.  */
+  pthread_rwlock_wrlock (&htable_lock);
+  if (pi->ports_htable_entry)
+    hurd_ihash_locp_remove (&htable, pi->ports_htable_entry);
+  if (pi->hentry)
+    hurd_ihash_locp_remove (&pi->bucket->htable, pi->hentry);
+  pi->ports_htable_entry = NULL;
+  pi->hentry = NULL;
+  pthread_rwlock_unlock (&htable_lock);
+}
+
+static error_t
+create_port (struct port_class *class, struct port_bucket *bucket,
+             size_t size, void *result, int install_it)
+{
+  struct port_info *pi;
+  mach_port_t port;
+
+  assert_backtrace (size >= sizeof (struct port_info));
+
+  pi = malloc (size);
+  if (!pi)
+    return ENOMEM;
+
+  port = mach_reply_port ();
+
+  pi->class = class;
+  refcounts_init (&pi->refcounts, 1, 0);
+  pi->mscount = 0;
+  pi->cancel_threshold = 0;
+  pi->flags = 0;
+  pi->port_right = port;
+  pi->current_rpcs = NULL;
+  pi->bucket = bucket;
+  pi->hentry = NULL;
+  pi->ports_htable_entry = NULL;
+
+  pthread_mutex_lock (&count_lock);
+  class->count++;
+  bucket->count++;
+  pthread_mutex_unlock (&count_lock);
+
+  if (install_it)
+    {
+      install (pi);
+      mach_port_set_protected_payload (mach_task_self (), port,
+                                       (unsigned long) pi);
+    }
+
+  *(struct port_info **) result = pi;
+  return 0;
+}
+
+error_t
+ports_create_port (struct port_class *class, struct port_bucket *bucket,
+                   size_t size, void *result)
+{
+  return create_port (class, bucket, size, result, 1);
+}
+
+error_t
+ports_create_port_noinstall (struct port_class *class,
+                             struct port_bucket *bucket,
+                             size_t size, void *result)
+{
+  return create_port (class, bucket, size, result, 0);
+}
+
+void *
+ports_lookup_port (struct port_bucket *bucket, mach_port_t port,
+                   struct port_class *class)
+{
+  struct port_info *pi;
+
+  pthread_rwlock_rdlock (&htable_lock);
+  if (bucket)
+    pi = hurd_ihash_find (&bucket->htable, port);
+  else
+    pi = hurd_ihash_find (&htable, port);
+
+  if (pi && class && pi->class != class)
+    pi = NULL;
+
+  if (pi)
+    refcounts_unsafe_ref (&pi->refcounts, NULL);
+  pthread_rwlock_unlock (&htable_lock);
+
+  return pi;
+}
+
+void *
+ports_lookup_payload (struct port_bucket *bucket, unsigned long payload,
+                      struct port_class *class)
+{
+  struct port_info *pi = (struct port_info *) payload;
+
+  if (pi && !MACH_PORT_VALID (pi->port_right))
+    pi = NULL;
+  if (pi && bucket && pi->bucket != bucket)
+    pi = NULL;
+  if (pi && class && pi->class != class)
+    pi = NULL;
+
+  if (pi)
+    refcounts_unsafe_ref (&pi->refcounts, NULL);
+  return pi;
+}
+
+mach_port_t
+ports_get_right (void *port)
+{
+  struct port_info *pi = port;
+
+  /* No messages are ever sent, so there is no need to track
+     make-send counts or request no-senders notifications.  */
+  return pi->port_right;
+}
+
+mach_port_t
+ports_claim_right (void *port)
+{
+  struct port_info *pi = port;
+  mach_port_t ret = pi->port_right;
+
+  if (!MACH_PORT_VALID (ret))
+    return ret;
+
+  uninstall (pi);
+  mach_port_clear_protected_payload (mach_task_self (), ret);
+  pi->port_right = MACH_PORT_NULL;
+  return ret;
+}
+
+void
+ports_reallocate_from_external (void *port, mach_port_t receive)
+{
+  struct port_info *pi = port;
+
+  if (MACH_PORT_VALID (pi->port_right))
+    {
+      uninstall (pi);
+      mach_port_mod_refs (mach_task_self (), pi->port_right,
+                          MACH_PORT_RIGHT_RECEIVE, -1);
+    }
+
+  pi->port_right = receive;
+  install (pi);
+  mach_port_set_protected_payload (mach_task_self (), receive,
+                                   (unsigned long) pi);
+}
+
+error_t
+ports_destroy_right (void *port)
+{
+  struct port_info *pi = port;
+
+  if (MACH_PORT_VALID (pi->port_right))
+    {
+      uninstall (pi);
+      mach_port_mod_refs (mach_task_self (), pi->port_right,
+                          MACH_PORT_RIGHT_RECEIVE, -1);
+      pi->port_right = MACH_PORT_NULL;
+    }
+  return 0;
+}
+
+void
+ports_port_ref (void *port)
+{
+  struct port_info *pi = port;
+
+  refcounts_ref (&pi->refcounts, NULL);
+}
+
+static void
+complete_deallocate (struct port_info *pi)
+{
+  struct references result;
+
+  if (MACH_PORT_VALID (pi->port_right))
+    {
+      pthread_rwlock_wrlock (&htable_lock);
+      refcounts_references (&pi->refcounts, &result);
+      if (result.hard > 0 || result.weak > 0)
+        {
+          /* A reference was reacquired through a hash table lookup.  */
+          pthread_rwlock_unlock (&htable_lock);
+          return;
+        }
+      hurd_ihash_locp_remove (&htable, pi->ports_htable_entry);
+      hurd_ihash_locp_remove (&pi->bucket->htable, pi->hentry);
+      pthread_rwlock_unlock (&htable_lock);
+
+      mach_port_mod_refs (mach_task_self (), pi->port_right,
+                          MACH_PORT_RIGHT_RECEIVE, -1);
+      pi->port_right = MACH_PORT_NULL;
+    }
+
+  pthread_mutex_lock (&count_lock);
+  pi->bucket->count--;
+  pi->class->count--;
+  pthread_mutex_unlock (&count_lock);
+
+  if (pi->class->clean_routine)
+    (*pi->class->clean_routine) (pi);
+
+  free (pi);
+}
+
+void
+ports_port_deref (void *port)
+{
+  struct port_info *pi = port;
+  struct references result;
+
+  refcounts_deref (&pi->refcounts, &result);
+  if (result.hard == 0 && result.weak == 0)
+    complete_deallocate (pi);
+}
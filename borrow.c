@@ -0,0 +1,73 @@
+#include "portproxy.h"
+#include "private.h"
+
+/* Whether P can be borrowed: somebody still holds a reference to it,
+   and nobody is setting it up or migrating it.  Seeing it unlocked
+   also makes whatever was written under the lock visible.  */
+static inline int
+borrowable (struct portproxy *p)
+{
+  if (__atomic_load_n (&p->lock, __ATOMIC_ACQUIRE) & PORTPROXY_LOCK_WRITER)
+    return 0;
+
+  switch (p->type)
+    {
+    case PORTPROXY_TYPE_RECEIVE:
+    case PORTPROXY_TYPE_RECEIVE_ONCE:
+      return refcounts_hard_references (&p->pi.refcounts) != 0;
+    default:
+      return refcount_references (&p->refcount) != 0;
+    }
+}
+
+void *
+portproxy_domain_borrow (struct portproxy_domain *domain, mach_port_t right)
+{
+  struct shard *shard = shard_for_port (domain ?: &default_domain, right);
+  struct portproxy *first, *p, *next;
+
+  first = proxy_table_find (&shard->table, right);
+  if (!first || is_receive_entry (first) || !borrowable (first))
+    return NULL;
+
+  for (p = first;
+       (next = __atomic_load_n (&p->migrated, __ATOMIC_ACQUIRE));
+       p = next)
+    if (!borrowable (next))
+      return NULL;
+
+  /* Our receive proxies can have their receive right claimed by whoever
+     holds them locked, so they aren't to be borrowed.  */
+  if (p->type != PORTPROXY_TYPE_SEND)
+    return NULL;
+
+  STAT_SHARD (shard, hits);
+
+  /* Clean routines of send proxies wait for a grace period before they
+     drop the user references, so this one can't get lost.  */
+  send_right_keep (first, right);
+  return p;
+}
+
+void *
+portproxy_borrow (mach_port_t right)
+{
+  return portproxy_domain_borrow (NULL, right);
+}
+
+/* Drop a reference to PROXY, as portproxy_deref () would, from an epoch
+   callback.  */
+static void
+deref_routine (void *proxy)
+{
+  portproxy_deref (proxy);
+}
+
+void
+portproxy_deref_deferred (void *proxy)
+{
+  if (epoch_borrowed ())
+    epoch_retire (proxy, deref_routine);
+  else
+    portproxy_deref (proxy);
+}
@@ -0,0 +1,74 @@
+#include "portproxy.h"
+#include "private.h"
+
+/* chase_lengths[I] counts the chases that took I + 1 hops; the last
+   one also counts all the longer ones.  */
+static unsigned long chase_lengths[CHASE_LENGTHS];
+
+void *
+portproxy_chase_slow (void *proxy)
+{
+  struct portproxy *first, *p, *next, *old;
+  unsigned int hops;
+
+  p = proxy;
+
+again:
+  first = p;
+  hops = 0;
+
+  /* Walk the chain, holding on to our reference on FIRST.  */
+  do
+    {
+      next = p->migrated;
+      portproxy_ref (next);
+      portproxy_unlock (p);
+      if (p != first)
+        portproxy_deref (p);
+      portproxy_rdlock (next);
+      p = next;
+      hops++;
+    }
+  while (p->migrated);
+
+  STAT_ADD (proxy_domain (p), chases, 1);
+  STAT_ADD (proxy_domain (p), chase_hops, hops);
+  __atomic_add_fetch (&chase_lengths[hops < CHASE_LENGTHS
+                                     ? hops - 1 : CHASE_LENGTHS - 1],
+                      1, __ATOMIC_RELAXED);
+
+  /* Point FIRST straight at P, so that the next chase starting from it
+     takes a single hop.  Don't bother waiting if it's busy.  */
+  old = NULL;
+  if (hops > 1 && portproxy_lock_trywrite (&first->lock))
+    {
+      old = first->migrated;
+      portproxy_ref (p);
+      __atomic_store_n (&first->migrated, p, __ATOMIC_RELEASE);
+      portproxy_lock_release (&first->lock);
+    }
+
+  /* Dropping references can run clean routines, which may want to
+     take proxy locks of their own; so don't hold any meanwhile.  */
+  portproxy_unlock (p);
+  if (old)
+    portproxy_deref_deferred (old);
+  portproxy_deref (first);
+  portproxy_rdlock (p);
+
+  if (p->migrated)
+    goto again;
+
+  return p;
+}
+
+unsigned int
+portproxy_chase_lengths (unsigned long *counts, unsigned int n)
+{
+  unsigned int i;
+
+  for (i = 0; i < n && i < CHASE_LENGTHS; i++)
+    counts[i] = __atomic_load_n (&chase_lengths[i], __ATOMIC_RELAXED);
+
+  return CHASE_LENGTHS;
+}
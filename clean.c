@@ -1,44 +1,87 @@
 #include "portproxy.h"
 #include "private.h"
 
+/* Drop the user references a send proxy holds, and free it.  */
+static void
+send_proxy_free (void *proxy)
+{
+  struct portproxy *p = proxy;
+
+  send_right_release (p->port, p->urefs);
+  pool_free (p);
+}
+
 void
 portproxy_clean (void *proxy)
 {
   error_t err;
   struct portproxy *p = proxy;
   struct portproxy *migrated;
-  unsigned int key;
+  struct portproxy_domain *domain = proxy_domain (p);
+  struct shard *shard;
 
-  pthread_rwlock_destroy (&p->lock);
   migrated = p->migrated;
 
+  STAT_ADD (domain, destroyed[p->type], 1);
+
   switch (p->type)
     {
     case PORTPROXY_TYPE_SEND:
-      key = p->port % 16;
+      shard = shard_for_port (domain, p->port);
 
-      pthread_mutex_lock (&send_proxies_lock[key]);
-      hurd_ihash_locp_remove (&send_proxies[key], p->locp);
-      pthread_mutex_unlock (&send_proxies_lock[key]);
+      shard_lock (shard);
+      proxy_table_remove (&shard->table, p->port, p);
+      shard_invalidate (shard);
+      pthread_mutex_unlock (&shard->lock);
 
       /* fallthrough */
 
     case PORTPROXY_TYPE_SEND_ONCE:
-      /* Deallocate the port, if it has not been taken out.  */
-      if (p->port != MACH_PORT_NULL)
+      STAT_ADD (domain, bytes_destroyed, p->pool->size);
+
+      /* Lock-free lookups may still be looking at a send proxy, and
+         borrowers may still be adding user references to it.  */
+      if (p->type == PORTPROXY_TYPE_SEND && epoch_borrowed ())
+        {
+          epoch_retire (proxy, send_proxy_free);
+          break;
+        }
+
+      /* Deallocate the port, if it has not been taken out.  Send-once
+         rights are never deferred, as somebody may be waiting for the
+         send-once notification.  */
+      if (p->type == PORTPROXY_TYPE_SEND)
+        send_right_release (p->port, p->urefs);
+      else if (p->port != MACH_PORT_NULL)
         {
           err = mach_port_deallocate (mach_task_self (), p->port);
           assert_perror_backtrace (err);
         }
 
-      free (proxy);
+      if (p->type == PORTPROXY_TYPE_SEND)
+        epoch_retire (proxy, pool_free);
+      else
+        pool_free (proxy);
+      break;
+
+    case PORTPROXY_TYPE_RECEIVE:
+      /* libports has already taken the receive right away, so go by
+         the name it was indexed under.  */
+      if (p->name != MACH_PORT_NULL)
+        {
+          shard = shard_for_port (domain, p->name);
+
+          shard_lock (shard);
+          proxy_table_remove (&shard->table, p->name, receive_entry (p));
+          pthread_mutex_unlock (&shard->lock);
+        }
       break;
 
     default:
       break;
     }
 
-  /* Tail recurse.  */
+  /* Tail recurse, unless borrowers may be on their way to it.  */
   if (migrated)
-    portproxy_deref (migrated);
+    portproxy_deref_deferred (migrated);
 }
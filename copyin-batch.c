@@ -0,0 +1,151 @@
+#include "portproxy.h"
+#include "private.h"
+
+/* How many send rights get sorted by shard at a time.  */
+#define BATCH_CHUNK 64
+
+/* Look up or create the send proxies in DOMAIN for the N entries whose
+   indices are in PENDING, taking each shard's lock once.  */
+static void
+copyin_send_locked (struct portproxy_domain *domain,
+                    struct portproxy_copyin_entry *entries,
+                    unsigned int *pending, unsigned int n,
+                    struct port_class *port_class,
+                    struct port_bucket *bucket,
+                    size_t size)
+{
+  struct portproxy_copyin_entry *entry;
+  struct shard *shards[BATCH_CHUNK];
+  unsigned int order[BATCH_CHUNK];
+  struct shard *shard = NULL;
+  unsigned int i;
+
+  for (i = 0; i < n; i++)
+    {
+      shards[i] = shard_for_port (domain, entries[pending[i]].right);
+      order[i] = i;
+    }
+  sort_by_shard (order, shards, n);
+
+  for (i = 0; i < n; i++)
+    {
+      entry = &entries[pending[order[i]]];
+
+      if (shards[order[i]] != shard)
+        {
+          if (shard)
+            pthread_mutex_unlock (&shard->lock);
+          shard = shards[order[i]];
+          shard_lock (shard);
+        }
+
+      entry->err = send_proxy_lookup (shard, entry->right,
+                                      port_class, bucket, size,
+                                      (struct portproxy **) &entry->existing,
+                                      (struct portproxy **) &entry->created);
+    }
+
+  if (shard)
+    pthread_mutex_unlock (&shard->lock);
+}
+
+error_t
+portproxy_copyin_batch (struct portproxy_copyin_entry *entries,
+                        size_t n,
+                        struct port_class *port_class,
+                        struct port_bucket *bucket,
+                        size_t size)
+{
+  error_t err = 0;
+  struct portproxy_domain *domain = domain_for_bucket (bucket);
+  struct portproxy_copyin_entry *entry;
+  struct epoch_record *record;
+  unsigned int pending[BATCH_CHUNK];
+  unsigned int nr_pending = 0;
+  size_t i;
+
+  assert_backtrace (size >= sizeof (struct portproxy));
+
+  record = epoch_enter ();
+
+  for (i = 0; i < n; i++)
+    {
+      entry = &entries[i];
+
+      assert_backtrace (MACH_PORT_VALID (entry->right));
+      entry->existing = NULL;
+      entry->created = NULL;
+      entry->err = 0;
+
+      switch (entry->type)
+        {
+        default:
+          /* Copying in a receive right write-locks the send proxy it
+             migrates, which may well be one we've just created and
+             are still holding locked.  */
+          entry->err = KERN_INVALID_RIGHT;
+          break;
+
+        case MACH_PORT_RIGHT_SEND_ONCE:
+          /* These don't go into a table.  Not portproxy_copyin (),
+             which may free what has been retired, and run clean
+             routines, from inside our epoch.  */
+          entry->err = copyin_right (entry->right, entry->type,
+                                     port_class, bucket, size,
+                                     &entry->existing, &entry->created);
+          break;
+
+        case MACH_PORT_RIGHT_SEND:
+          if (record)
+            {
+              entry->existing
+                = send_proxy_find (shard_for_port (domain, entry->right),
+                                   entry->right);
+              if (entry->existing)
+                break;
+            }
+
+          pending[nr_pending++] = i;
+          if (nr_pending == BATCH_CHUNK)
+            {
+              /* Creating proxies may retire a table, which
+                 can't be done from inside an epoch.  */
+              if (record)
+                epoch_exit (record);
+              copyin_send_locked (domain, entries, pending, nr_pending,
+                                  port_class, bucket, size);
+              nr_pending = 0;
+              record = epoch_enter ();
+            }
+          break;
+        }
+    }
+
+  if (record)
+    epoch_exit (record);
+
+  copyin_send_locked (domain, entries, pending, nr_pending,
+                      port_class, bucket, size);
+
+  /* Growing a table retires the old one under the shard lock.  */
+  epoch_poll_deferred ();
+
+  for (i = 0; i < n; i++)
+    {
+      entry = &entries[i];
+
+      if (entry->err)
+        {
+          if (!err)
+            err = entry->err;
+          continue;
+        }
+
+      /* We found an existing proxy, so we don't need another right
+         reference; but a send proxy can hand it out again.  */
+      if (entry->type == MACH_PORT_RIGHT_SEND && entry->existing)
+        send_right_keep (entry->existing, entry->right);
+    }
+
+  return err;
+}
@@ -1,18 +1,113 @@
 #include "portproxy.h"
 #include "private.h"
 
+/* Find the proxy for the send right RIGHT, or create a new one.
+   Must be called with SHARD's lock held.  On success, either *EXISTING
+   is set to a referenced but unlocked proxy, or *CREATED is set to a
+   new, write-locked proxy that is already in the table.  */
+__attribute__ ((visibility("hidden")))
 error_t
-portproxy_copyin (mach_port_t right,
-                  mach_port_right_t type,
-                  struct port_class *port_class,
-                  struct port_bucket *bucket,
-                  size_t size,
-                  void *p_existing,
-                  void *p_created)
+send_proxy_lookup (struct shard *shard,
+                   mach_port_t right,
+                   struct port_class *port_class,
+                   struct port_bucket *bucket,
+                   size_t size,
+                   struct portproxy **existing,
+                   struct portproxy **created)
 {
   error_t err;
-  unsigned int key = right % 16;
+  struct portproxy *p;
+  int install = 1;
+
+  *existing = NULL;
+  *created = NULL;
+
+  /* Is it a send right to one of our receive rights,
+     or a send right we're already tracking?  */
+  p = proxy_table_find (&shard->table, right);
+  if (p && is_receive_entry (p))
+    {
+      /* Its clean routine can't have run while it's in the table, so
+         it's safe to look at even without a reference.  */
+      if (receive_entry_stale (p, right))
+        /* Its receive right is gone.  */
+        proxy_table_remove (&shard->table, right, p);
+      else if (entry_proxy (p)->pi.bucket != bucket
+               || (port_class && entry_proxy (p)->pi.class != port_class))
+        /* A receive right of some other bucket or class is just
+           another port to proxy, but there can only be one proxy
+           under its name, so keep the new one out of the table.  */
+        install = 0;
+      else if (refcounts_ref_unless_zero (&entry_proxy (p)->pi.refcounts))
+        {
+          STAT_SHARD (shard, hits);
+          *existing = entry_proxy (p);
+          return 0;
+        }
+      else
+        /* It's on its way out, and its receive right with it.  */
+        proxy_table_remove (&shard->table, right, p);
+    }
+  else if (p)
+    {
+      if (proxy_ref_unless_zero (p))
+        {
+          STAT_SHARD (shard, hits);
+          *existing = p;
+          return 0;
+        }
+
+      /* It's on its way out; let its clean routine find
+         the new proxy in its place instead.  */
+      proxy_table_remove (&shard->table, right, p);
+    }
+
+  /* Create a new send proxy.  */
+  p = pool_alloc (shard->domain, port_class, size);
+  if (!p)
+    return errno;
+
+  refcount_init (&p->refcount, 1);
+  p->port = right;
+  p->clean_routine = port_class->clean_routine;
+  p->type = PORTPROXY_TYPE_SEND;
+  p->flags = 0;
+  p->lock = PORTPROXY_LOCK_WRITER;
+  p->migrated = NULL;
+  p->urefs = 1;
+
+  err = install ? proxy_table_add (&shard->table, right, p) : 0;
+  if (err)
+    {
+      portproxy_lock_release (&p->lock);
+      pool_free (p);
+      return err;
+    }
+
+  STAT_SHARD (shard, misses);
+  STAT_ADD (shard->domain, created[PORTPROXY_TYPE_SEND], 1);
+  STAT_ADD (shard->domain, bytes_created, size);
+  *created = p;
+  return 0;
+}
+
+/* portproxy_copyin () without histograms, and leaving what it may
+   have retired to the caller's epoch_poll_deferred ().  */
+__attribute__ ((visibility("hidden")))
+error_t
+copyin_right (mach_port_t right,
+              mach_port_right_t type,
+              struct port_class *port_class,
+              struct port_bucket *bucket,
+              size_t size,
+              void *p_existing,
+              void *p_created)
+{
+  error_t err;
+  struct portproxy_domain *domain = domain_for_bucket (bucket);
+  struct shard *shard = shard_for_port (domain, right);
   struct portproxy *existing, *created;
+  struct epoch_record *record;
 
   assert_backtrace (MACH_PORT_VALID (right));
   assert_backtrace (size >= sizeof (struct portproxy));
@@ -27,112 +122,112 @@ portproxy_copyin (mach_port_t right,
       return KERN_INVALID_RIGHT;
 
     case MACH_PORT_RIGHT_SEND:
-      pthread_mutex_lock (&send_proxies_lock[key]);
-
-      /* Is it a send right to one of our receive rights?  */
-      existing = ports_lookup_port (bucket, right,
-                                    port_class);
-      if (existing)
-        goto found_existing;
-
-      /* Is it a send right we're already tracking?  */
-      existing = hurd_ihash_find (&send_proxies[key], right);
-      if (existing)
+      /* Most of the time, this is a send right we're already tracking.
+         Try to find its proxy without taking the lock.  */
+      record = epoch_enter ();
+      if (record)
         {
-          portproxy_ref (existing);
-          goto found_existing;
-        }
+          existing = send_proxy_find (shard, right);
+          epoch_exit (record);
 
-      /* Create a new send proxy.  */
-      created = malloc (size);
-      if (!created)
-        {
-          pthread_mutex_unlock (&send_proxies_lock[key]);
-          return errno;
+          if (existing)
+            goto have_existing;
         }
 
-      refcount_init (&created->refcount, 1);
-      created->port = right;
-      created->clean_routine = port_class->clean_routine;
-      created->type = PORTPROXY_TYPE_SEND;
-      pthread_rwlock_init (&created->lock, NULL);
-      pthread_rwlock_wrlock (&created->lock);
-      created->migrated = NULL;
-
-      err = hurd_ihash_add (&send_proxies[key], right, created);
-      pthread_mutex_unlock (&send_proxies_lock[key]);
+      shard_lock (shard);
+      err = send_proxy_lookup (shard, right, port_class, bucket, size,
+                               &existing, &created);
+      pthread_mutex_unlock (&shard->lock);
 
       if (err)
+        return err;
+
+      if (created)
         {
-          pthread_rwlock_unlock (&created->lock);
-          pthread_rwlock_destroy (&created->lock);
-          free (created);
-          return err;
+          *(struct portproxy **) p_created = created;
+          return 0;
         }
 
-      *(struct portproxy **) p_created = created;
-      return 0;
-
- found_existing:
-      pthread_mutex_unlock (&send_proxies_lock[key]);
-
-      /* We found an existing proxy, so we don't need
-         another right reference.  */
-      err = mach_port_deallocate (mach_task_self (), right);
-      assert_perror_backtrace (err);
+ have_existing:
+      /* We found an existing proxy, so we don't need another right
+         reference; but a send proxy can hand it out again.  */
+      send_right_keep (existing, right);
 
-      pthread_rwlock_rdlock (&existing->lock);
+      portproxy_lock_read (&existing->lock);
       *(struct portproxy **) p_existing = portproxy_chase (existing);
       return 0;
 
     case MACH_PORT_RIGHT_RECEIVE:
+      shard_lock (shard);
+
+      /* Make sure indexing the new proxy can't fail once it has taken
+         the right, as there's no undoing that.  */
+      err = proxy_table_reserve (&shard->table);
+
       /* There's no ports_import_port_noinstall (), but we don't want
          to install the new port until we at least init its lock.  */
-      err = ports_create_port_noinstall (port_class, bucket,
-                                         size, &created);
+      if (!err)
+        err = ports_create_port_noinstall (port_class, bucket,
+                                           size, &created);
       if (err)
         {
-          pthread_mutex_unlock (&send_proxies_lock[key]);
+          pthread_mutex_unlock (&shard->lock);
           return err;
         }
 
       created->type = PORTPROXY_TYPE_RECEIVE;
-      pthread_rwlock_init (&created->lock, NULL);
-      pthread_rwlock_wrlock (&created->lock);
+      created->flags = 0;
+      created->lock = PORTPROXY_LOCK_WRITER;
       created->migrated = NULL;
+      created->name = right;
 
-      pthread_mutex_lock (&send_proxies_lock[key]);
-      /* Consumes the right and installs the port into its bucket.  */
+      /* Consumes the right and installs the port into its bucket, with
+         its protected payload pointing to it, for
+         portproxy_lookup_local ().  */
       ports_reallocate_from_external (created, right);
 
-      existing = hurd_ihash_find (&send_proxies[key], right);
-      if (existing)
+      /* With the receive right ours, whatever receive proxy was
+         indexed under its name has lost it.  */
+      existing = proxy_table_find (&shard->table, right);
+      if (existing && !is_receive_entry (existing))
         {
           assert_backtrace (existing->type == PORTPROXY_TYPE_SEND);
-          portproxy_ref (existing);
-          hurd_ihash_locp_remove (&send_proxies[key], existing->locp);
+          proxy_table_remove (&shard->table, right, existing);
+          shard_invalidate (shard);
+          /* If it's on its way out, there's nothing to migrate.  */
+          if (!proxy_ref_unless_zero (existing))
+            existing = NULL;
         }
+      else
+        existing = NULL;
+
+      err = proxy_table_add (&shard->table, right, receive_entry (created));
+      assert_perror_backtrace (err);
 
       /* Make sure to unlock the big lock
          before trying to lock existing.  */
-      pthread_mutex_unlock (&send_proxies_lock[key]);
+      pthread_mutex_unlock (&shard->lock);
 
       if (existing)
         {
-          pthread_rwlock_wrlock (&existing->lock);
+          portproxy_lock_write (&existing->lock);
           /* We have the receive right; nobody else can
              migrate the existing send right.  */
           assert_backtrace (existing->migrated == NULL);
           ports_port_ref (created);
-          existing->migrated = created;
+          created->flags = existing->flags;
+          __atomic_store_n (&existing->migrated, created, __ATOMIC_RELEASE);
+          STAT_ADD (domain, migrations, 1);
         }
 
+      STAT_ADD (domain, created[PORTPROXY_TYPE_RECEIVE], 1);
+
       *(struct portproxy **) p_existing = existing;
       *(struct portproxy **) p_created = created;
       return 0;
 
     case MACH_PORT_RIGHT_SEND_ONCE:
-      created = malloc (size);
+      created = pool_alloc (domain, port_class, size);
       if (!created)
         return errno;
 
@@ -140,11 +235,38 @@ portproxy_copyin (mach_port_t right,
       created->port = right;
       created->clean_routine = port_class->clean_routine;
       created->type = PORTPROXY_TYPE_SEND_ONCE;
-      pthread_rwlock_init (&created->lock, NULL);
-      pthread_rwlock_wrlock (&created->lock);
+      created->flags = 0;
       created->migrated = NULL;
 
+      STAT_ADD (domain, created[PORTPROXY_TYPE_SEND_ONCE], 1);
+      STAT_ADD (domain, bytes_created, size);
+
       *(struct portproxy **) p_created = created;
       return 0;
     }
 }
+
+error_t
+portproxy_copyin (mach_port_t right,
+                  mach_port_right_t type,
+                  struct port_class *port_class,
+                  struct port_bucket *bucket,
+                  size_t size,
+                  void *p_existing,
+                  void *p_created)
+{
+  error_t err;
+  struct histograms *h = histograms_get ();
+  uint64_t start = 0;
+
+  if (h)
+    start = hist_now ();
+  err = copyin_right (right, type, port_class, bucket, size,
+                      p_existing, p_created);
+  if (h)
+    hist_record (&h->copyin[hist_right (type)], start);
+
+  /* Growing a table retires the old one under the shard lock.  */
+  epoch_poll_deferred ();
+  return err;
+}
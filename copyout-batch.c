@@ -0,0 +1,184 @@
+#include <stdlib.h>
+
+#include "portproxy.h"
+#include "private.h"
+
+/* How many receive rights get sorted by shard at a time.  */
+#define BATCH_CHUNK 64
+
+/* An entry copying out a receive right, and the receive proxy it
+   claims the right of, if any.  */
+struct claim
+{
+  uintptr_t existing;
+  size_t index;
+};
+
+static int
+claim_compare (const void *a, const void *b)
+{
+  const struct claim *x = a, *y = b;
+
+  if (x->existing != y->existing)
+    return x->existing < y->existing ? -1 : 1;
+  return x->index < y->index ? -1 : x->index > y->index;
+}
+
+/* Copy out the N receive rights whose indices are in PENDING, putting
+   their new send proxies into the tables of DOMAIN one shard at a
+   time.  */
+static void
+copyout_receive_batch (struct portproxy_domain *domain,
+                       struct portproxy_copyout_entry *entries,
+                       unsigned int *pending, unsigned int n,
+                       struct port_class *port_class,
+                       size_t size)
+{
+  struct portproxy_copyout_entry *entry;
+  struct shard *shards[BATCH_CHUNK];
+  unsigned int order[BATCH_CHUNK];
+  struct shard *shard = NULL;
+  unsigned int i, j, nr_prepared = 0;
+
+  for (i = 0; i < n; i++)
+    {
+      entry = &entries[pending[i]];
+
+      /* The same receive right can only be claimed once;
+         copyout_receive_prepare () won't notice until we
+         finish the first claim.  */
+      for (j = 0; j < nr_prepared; j++)
+        if (entry->existing
+            && entries[pending[j]].existing == entry->existing)
+          break;
+      if (j < nr_prepared)
+        {
+          entry->err = copyout_rejected (domain);
+          continue;
+        }
+
+      entry->err = copyout_receive_prepare (domain, entry->existing,
+                                            port_class, size, &entry->right,
+                                            (struct portproxy **)
+                                            &entry->created);
+      if (entry->err)
+        continue;
+
+      pending[nr_prepared] = pending[i];
+      shards[nr_prepared] = shard_for_port (domain, entry->right);
+      order[nr_prepared] = nr_prepared;
+      nr_prepared++;
+    }
+
+  sort_by_shard (order, shards, nr_prepared);
+
+  for (i = 0; i < nr_prepared; i++)
+    {
+      entry = &entries[pending[order[i]]];
+
+      if (shards[order[i]] != shard)
+        {
+          if (shard)
+            pthread_mutex_unlock (&shard->lock);
+          shard = shards[order[i]];
+          shard_lock (shard);
+        }
+
+      entry->err = copyout_receive_add (shard, entry->existing,
+                                        entry->created);
+    }
+
+  if (shard)
+    pthread_mutex_unlock (&shard->lock);
+
+  for (i = 0; i < nr_prepared; i++)
+    {
+      entry = &entries[pending[i]];
+
+      entry->err = copyout_receive_finish (entry->existing, entry->created,
+                                           &entry->right, &entry->conversion,
+                                           entry->err);
+      if (entry->err)
+        entry->created = NULL;
+    }
+}
+
+error_t
+portproxy_copyout_batch (struct portproxy_copyout_entry *entries,
+                         size_t n,
+                         struct port_class *port_class,
+                         struct port_bucket *bucket,
+                         size_t size)
+{
+  error_t err = 0;
+  struct portproxy_domain *domain = domain_for_bucket (bucket);
+  struct portproxy_copyout_entry *entry;
+  struct claim *claims = NULL;
+  unsigned int pending[BATCH_CHUNK];
+  unsigned int nr_pending = 0;
+  size_t i, nr_claims = 0;
+
+  assert_backtrace (size >= sizeof (struct portproxy));
+
+  for (i = 0; i < n; i++)
+    {
+      entry = &entries[i];
+
+      if (entry->required_type != MACH_PORT_RIGHT_RECEIVE)
+        {
+          /* Only receive rights need a shard lock.  */
+          entry->err = portproxy_copyout (entry->existing,
+                                          entry->required_type,
+                                          port_class, bucket, size,
+                                          &entry->right,
+                                          &entry->conversion,
+                                          &entry->created);
+          continue;
+        }
+
+      entry->right = MACH_PORT_NULL;
+      entry->conversion = 0;
+      entry->created = NULL;
+      entry->err = 0;
+
+      if (!claims)
+        {
+          claims = malloc ((n - i) * sizeof *claims);
+          if (!claims)
+            {
+              entry->err = ENOMEM;
+              continue;
+            }
+        }
+      claims[nr_claims].existing = (uintptr_t) entry->existing;
+      claims[nr_claims].index = i;
+      nr_claims++;
+    }
+
+  /* The receive proxies whose rights are claimed stay write-locked
+     until the end, while more are being locked; so lock them in the
+     same order as other batches.  */
+  if (nr_claims)
+    qsort (claims, nr_claims, sizeof *claims, claim_compare);
+
+  for (i = 0; i < nr_claims; i++)
+    {
+      pending[nr_pending++] = claims[i].index;
+      if (nr_pending == BATCH_CHUNK)
+        {
+          copyout_receive_batch (domain, entries, pending, nr_pending,
+                                 port_class, size);
+          nr_pending = 0;
+        }
+    }
+
+  copyout_receive_batch (domain, entries, pending, nr_pending,
+                         port_class, size);
+  free (claims);
+
+  for (i = 0; i < n; i++)
+    if (entries[i].err && !err)
+      err = entries[i].err;
+
+  return err;
+}
@@ -1,18 +1,173 @@
 #include "portproxy.h"
 #include "private.h"
 
+__attribute__ ((visibility("hidden")))
+__thread int copyout_copy_send;
+
+/* Claim the receive right of EXISTING, or make up a new one, and set
+   up a send proxy for it in DOMAIN, without putting it into a table
+   yet.  */
+__attribute__ ((visibility("hidden")))
 error_t
-portproxy_copyout (void *p_existing,
-                   mach_port_right_t required_type,
-                   struct port_class *port_class,
-                   struct port_bucket *bucket,
-                   size_t size,
-                   mach_port_t *right,
-                   mach_msg_type_name_t *conversion,
-                   void *p_created)
+copyout_receive_prepare (struct portproxy_domain *domain,
+                         struct portproxy *existing,
+                         struct port_class *port_class,
+                         size_t size,
+                         mach_port_t *right,
+                         struct portproxy **p_created)
+{
+  error_t err;
+  struct portproxy *created;
+
+  if (existing && existing->type != PORTPROXY_TYPE_RECEIVE)
+    return copyout_rejected (domain);
+
+  /* Create a new send proxy.  */
+  created = pool_alloc (domain, port_class, size);
+  if (!created)
+    return errno;
+
+  if (existing)
+    {
+      /* Re-lock for writing.  */
+      portproxy_lock_release (&existing->lock);
+      portproxy_lock_write (&existing->lock);
+
+      /* Has somebody else claimed the receive right in the meantime?
+         Note: we could chase the migrations here looking for the new
+         receive right (if it's been migrated multiple times); but we
+         consider concurrent claims of the same receive right to be
+         just invalid, and return an error.  */
+      if (existing->migrated)
+        {
+          pool_free (created);
+          return copyout_rejected (domain);
+        }
+
+      *right = ports_claim_right (existing);
+    }
+  else
+    {
+      *right = mach_reply_port ();
+      if (*right == MACH_PORT_NULL)
+        {
+          pool_free (created);
+          return KERN_RESOURCE_SHORTAGE;
+        }
+    }
+
+  /* Give ourselves a send right, for created->port.  */
+  err = mach_port_insert_right (mach_task_self (),
+                                *right, *right,
+                                MACH_MSG_TYPE_MAKE_SEND);
+  assert_perror_backtrace (err);
+
+  refcount_init (&created->refcount, 1);
+  created->port = *right;
+  created->clean_routine = port_class->clean_routine;
+  created->type = PORTPROXY_TYPE_SEND;
+  created->flags = existing ? existing->flags : 0;
+  created->lock = PORTPROXY_LOCK_WRITER;
+  created->migrated = NULL;
+  created->urefs = 1;
+
+  *p_created = created;
+  return 0;
+}
+
+/* Put CREATED, the send proxy copyout_receive_prepare () made, into
+   SHARD's table, taking over the entry of the receive proxy EXISTING,
+   if any, whose receive right it now has.  Must be called with SHARD's
+   lock held.  */
+__attribute__ ((visibility("hidden")))
+error_t
+copyout_receive_add (struct shard *shard,
+                     struct portproxy *existing,
+                     struct portproxy *created)
+{
+  struct portproxy *p;
+
+  if (existing
+      && existing->name == created->port
+      && proxy_table_replace (&shard->table, created->port,
+                              receive_entry (existing), created))
+    {
+      existing->name = MACH_PORT_NULL;
+      return 0;
+    }
+
+  /* A send right to it may have been copied in after we claimed the
+     receive right, making the entry of EXISTING look stale, and
+     getting a send proxy of its own; there can only be one proxy
+     under the name, so keep CREATED out of the table.  */
+  p = proxy_table_find (&shard->table, created->port);
+  if (p && !is_receive_entry (p))
+    return 0;
+
+  return proxy_table_add (&shard->table, created->port, created);
+}
+
+/* Commit to copying out a receive right once CREATED is in its table,
+   or, if putting it there failed with ERR, undo what
+   copyout_receive_prepare () did.  */
+__attribute__ ((visibility("hidden")))
+error_t
+copyout_receive_finish (struct portproxy *existing,
+                        struct portproxy *created,
+                        mach_port_t *right,
+                        mach_msg_type_name_t *conversion,
+                        error_t err)
+{
+  if (err)
+    {
+      /* Undo our changes.  */
+      if (existing)
+        {
+          ports_reallocate_from_external (existing, *right);
+          /* Leave existing read-locked.  */
+          portproxy_lock_release (&existing->lock);
+          portproxy_lock_read (&existing->lock);
+        }
+      else
+        mach_port_mod_refs (mach_task_self (), *right,
+                            MACH_PORT_RIGHT_RECEIVE, -1);
+
+      mach_port_deallocate (mach_task_self (), *right);
+      *right = MACH_PORT_NULL;
+      portproxy_lock_release (&created->lock);
+      pool_free (created);
+      return err;
+    }
+
+  /* Nothing can go wrong anymore; commit to migration.  */
+  if (existing)
+    {
+      portproxy_ref (created);
+      __atomic_store_n (&existing->migrated, created, __ATOMIC_RELEASE);
+      STAT_ADD (created->pool->domain, migrations, 1);
+    }
+
+  STAT_ADD (created->pool->domain, created[PORTPROXY_TYPE_SEND], 1);
+  STAT_ADD (created->pool->domain, bytes_created, created->pool->size);
+
+  /* (*right) initialized above */
+  *conversion = MACH_MSG_TYPE_MOVE_RECEIVE;
+  return 0;
+}
+
+static error_t
+copyout_right (void *p_existing,
+               mach_port_right_t required_type,
+               struct port_class *port_class,
+               struct port_bucket *bucket,
+               size_t size,
+               mach_port_t *right,
+               mach_msg_type_name_t *conversion,
+               void *p_created)
 {
   error_t err;
-  unsigned int key;
+  struct portproxy_domain *domain = domain_for_bucket (bucket);
+  struct shard *shard;
   struct portproxy *existing = p_existing;
   struct portproxy *created;
 
@@ -26,7 +181,7 @@ portproxy_copyout (void *p_existing,
   switch (required_type)
     {
     default:
-      return KERN_INVALID_RIGHT;
+      return copyout_rejected (domain);
 
     case MACH_PORT_RIGHT_SEND:
       if (existing)
@@ -35,7 +190,10 @@ portproxy_copyout (void *p_existing,
             {
             case PORTPROXY_TYPE_SEND:
               *right = existing->port;
-              *conversion = MACH_MSG_TYPE_COPY_SEND;
+              if (!copyout_copy_send && send_proxy_take_uref (existing))
+                *conversion = MACH_MSG_TYPE_MOVE_SEND;
+              else
+                *conversion = MACH_MSG_TYPE_COPY_SEND;
               break;
 
             case PORTPROXY_TYPE_RECEIVE:
@@ -44,20 +202,48 @@ portproxy_copyout (void *p_existing,
               break;
 
             default:
-              return KERN_INVALID_RIGHT;
+              return copyout_rejected (domain);
             }
           return 0;
         }
 
-      err = ports_create_port (port_class, bucket,
-                               size, &created);
+      /* Rather than ports_create_port (), make up the right first, so
+         that we know which shard to reserve room in for indexing the
+         port before we set it up.  */
+      *right = mach_reply_port ();
+      if (*right == MACH_PORT_NULL)
+        return KERN_RESOURCE_SHORTAGE;
+      shard = shard_for_port (domain, *right);
+
+      shard_lock (shard);
+      err = proxy_table_reserve (&shard->table);
+      if (!err)
+        err = ports_create_port_noinstall (port_class, bucket,
+                                           size, &created);
       if (err)
-        return err;
+        {
+          pthread_mutex_unlock (&shard->lock);
+          mach_port_mod_refs (mach_task_self (), *right,
+                              MACH_PORT_RIGHT_RECEIVE, -1);
+          *right = MACH_PORT_NULL;
+          return err;
+        }
 
       created->type = PORTPROXY_TYPE_RECEIVE;
-      pthread_rwlock_init (&created->lock, NULL);
-      pthread_rwlock_wrlock (&created->lock);
+      created->flags = 0;
+      created->lock = PORTPROXY_LOCK_WRITER;
       created->migrated = NULL;
+      created->name = *right;
+
+      /* Nobody has a send right to the port yet, so nobody can look
+         for it before it is installed.  */
+      err = proxy_table_add (&shard->table, *right, receive_entry (created));
+      assert_perror_backtrace (err);
+      pthread_mutex_unlock (&shard->lock);
+
+      /* This also points its protected payload to it.  */
+      ports_reallocate_from_external (created, *right);
+      STAT_ADD (domain, created[PORTPROXY_TYPE_RECEIVE], 1);
 
       *(struct portproxy **) p_created = created;
       *right = ports_get_right (created);
@@ -65,122 +251,87 @@ portproxy_copyout (void *p_existing,
       return 0;
 
     case MACH_PORT_RIGHT_RECEIVE:
-      if (existing && existing->type != PORTPROXY_TYPE_RECEIVE)
-        return KERN_INVALID_RIGHT;
-
-      /* Create a new send proxy.  */
-      created = malloc (size);
-      if (!created)
-        return errno;
-
-      if (existing)
-        {
-          /* Re-lock for writing.  */
-          pthread_rwlock_unlock (&existing->lock);
-          pthread_rwlock_wrlock (&existing->lock);
-
-          /* Has somebody else claimed the receive right in the meantime?
-             Note: we could chase the migrations here looking for the new
-             receive right (if it's been migrated multiple times); but we
-             consider concurrent claims of the same receive right to be
-             just invalid, and return an error.  */
-          if (existing->migrated)
-            {
-              free (created);
-              return KERN_INVALID_RIGHT;
-            }
-
-          *right = ports_claim_right (existing);
-        }
-      else
-        *right = mach_reply_port ();
-
-      /* Give ourselves a send right, for created->port.  */
-      err = mach_port_insert_right (mach_task_self (),
-                                    *right, *right,
-                                    MACH_MSG_TYPE_MAKE_SEND);
-      assert_perror_backtrace (err);
-
-      refcount_init (&created->refcount, 1);
-      created->port = *right;
-      created->clean_routine = port_class->clean_routine;
-      created->type = PORTPROXY_TYPE_SEND;
-      pthread_rwlock_init (&created->lock, NULL);
-      pthread_rwlock_wrlock (&created->lock);
-      created->migrated = NULL;
+      err = copyout_receive_prepare (domain, existing, port_class, size,
+                                     right, &created);
+      if (err)
+        return err;
 
-      key = *right % 16;
+      shard = shard_for_port (domain, *right);
 
-      pthread_mutex_lock (&send_proxies_lock[key]);
-      err = hurd_ihash_add (&send_proxies[key], *right, created);
-      pthread_mutex_unlock (&send_proxies_lock[key]);
+      shard_lock (shard);
+      err = copyout_receive_add (shard, existing, created);
+      pthread_mutex_unlock (&shard->lock);
 
+      err = copyout_receive_finish (existing, created, right,
+                                    conversion, err);
       if (err)
-        {
-          /* Undo our changes.  */
-          if (existing)
-            {
-              ports_reallocate_from_external (existing, *right);
-              /* Leave existing read-locked.  */
-              pthread_rwlock_unlock (&existing->lock);
-              pthread_rwlock_rdlock (&existing->lock);
-            }
-          else
-            mach_port_mod_refs (mach_task_self (), *right,
-                                MACH_PORT_RIGHT_RECEIVE, -1);
-
-          mach_port_deallocate (mach_task_self (), *right);
-          *right = MACH_PORT_NULL;
-          pthread_rwlock_unlock (&created->lock);
-          pthread_rwlock_destroy (&created->lock);
-          free (created);
-          return err;
-        }
-
-      /* Nothing can go wrong anymore; commit to migration.  */
-      if (existing)
-        {
-          portproxy_ref (created);
-          existing->migrated = created;
-        }
+        return err;
 
       *(struct portproxy **) p_created = created;
-      /* (*right) initialized above */
-      *conversion = MACH_MSG_TYPE_MOVE_RECEIVE;
       return 0;
 
     case MACH_PORT_RIGHT_SEND_ONCE:
       if (existing)
         {
           if (existing->type != PORTPROXY_TYPE_SEND_ONCE)
-            return KERN_INVALID_RIGHT;
+            return copyout_rejected (domain);
 
           /* Take the right.  */
-          *right = existing->port;
+          *right = __atomic_exchange_n (&existing->port, MACH_PORT_NULL,
+                                        __ATOMIC_ACQ_REL);
           if (*right == MACH_PORT_NULL)
-            return KERN_INVALID_RIGHT;  /* taken multiple times? */
-          existing->port = MACH_PORT_NULL;
+            return copyout_rejected (domain);  /* taken multiple times? */
 
           *conversion = MACH_MSG_TYPE_MOVE_SEND_ONCE;
           return 0;
         }
 
+      /* Sets its protected payload, like ports_reallocate_from_external
+         () does for receive proxies.  */
       err = ports_create_port (port_class, bucket,
                                size, &created);
       if (err)
 	return err;
 
       created->type = PORTPROXY_TYPE_RECEIVE_ONCE;
-      pthread_rwlock_init (&created->lock, NULL);
-      pthread_rwlock_wrlock (&created->lock);
+      created->flags = 0;
+      created->lock = PORTPROXY_LOCK_WRITER;
       created->migrated = NULL;
 
       /* Extra reference for the send-once right being alive.  */
       ports_port_ref (created);
 
+      STAT_ADD (domain, created[PORTPROXY_TYPE_RECEIVE_ONCE], 1);
+
       *(struct portproxy **) p_created = created;
       *right = created->pi.port_right;
       *conversion = MACH_MSG_TYPE_MAKE_SEND_ONCE;
       return 0;
     }
 }
+
+error_t
+portproxy_copyout (void *p_existing,
+                   mach_port_right_t required_type,
+                   struct port_class *port_class,
+                   struct port_bucket *bucket,
+                   size_t size,
+                   mach_port_t *right,
+                   mach_msg_type_name_t *conversion,
+                   void *p_created)
+{
+  error_t err;
+  struct histograms *h = histograms_get ();
+  uint64_t start = 0;
+
+  if (h)
+    start = hist_now ();
+  err = copyout_right (p_existing, required_type, port_class, bucket,
+                       size, right, conversion, p_created);
+  if (h)
+    hist_record (&h->copyout[hist_right (required_type)], start);
+
+  /* Growing a table retires the old one under the shard lock.  */
+  epoch_poll_deferred ();
+  return err;
+}
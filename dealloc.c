@@ -0,0 +1,302 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "portproxy.h"
+#include "private.h"
+
+/* Pending deallocations of one thread, with the user references to the
+   same name added up.  The thread adds to its own queue; the reaper
+   and portproxy_dealloc_flush () take them away.  */
+struct dealloc_queue
+{
+  struct dealloc_queue *next;
+  int in_use;
+  pthread_mutex_t lock;
+  unsigned int nr_names;
+  int reaper_woken;
+  struct
+  {
+    mach_port_t name;
+    unsigned int refs;
+  } slots[4 * DEALLOC_MAX_PENDING];
+};
+
+__attribute__ ((visibility("hidden")))
+unsigned int dealloc_max_pending;
+
+static unsigned int dealloc_max_delay;
+
+/* Queues are never freed; the queue of a thread that has exited is
+   reused by the next thread that needs one.  */
+static struct dealloc_queue *queues;
+
+static __thread struct dealloc_queue *self;
+static pthread_key_t self_key;
+static pthread_once_t self_key_once = PTHREAD_ONCE_INIT;
+static error_t self_key_error;
+
+/* Protects starting the reaper, and wakes it up.  */
+static pthread_mutex_t reaper_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reaper_wakeup = PTHREAD_COND_INITIALIZER;
+static int reaper_running;
+
+/* Drop REFS user references to the send right NAME, which may have
+   turned into a dead name in the meantime.  */
+__attribute__ ((visibility("hidden")))
+void
+dealloc_refs (mach_port_t name, unsigned int refs)
+{
+  error_t err;
+
+  if (refs == 1)
+    err = mach_port_deallocate (mach_task_self (), name);
+  else
+    {
+      err = mach_port_mod_refs (mach_task_self (), name,
+                                MACH_PORT_RIGHT_SEND, -refs);
+      if (err == KERN_INVALID_RIGHT)
+        err = mach_port_mod_refs (mach_task_self (), name,
+                                  MACH_PORT_RIGHT_DEAD_NAME, -refs);
+    }
+  assert_perror_backtrace (err);
+}
+
+/* Empty QUEUE, and drop everything that was in it.  The traps are made
+   without the lock held, so that the owner doesn't have to wait.  */
+static void
+dealloc_drain (struct dealloc_queue *queue)
+{
+  typeof (queue->slots[0]) pending[2 * DEALLOC_MAX_PENDING];
+  unsigned int i, n = 0;
+
+  pthread_mutex_lock (&queue->lock);
+  if (queue->nr_names)
+    for (i = 0; i < 4 * DEALLOC_MAX_PENDING; i++)
+      if (queue->slots[i].refs)
+        {
+          pending[n++] = queue->slots[i];
+          queue->slots[i].refs = 0;
+          queue->slots[i].name = MACH_PORT_NULL;
+        }
+  queue->nr_names = 0;
+  queue->reaper_woken = 0;
+  pthread_mutex_unlock (&queue->lock);
+
+  for (i = 0; i < n; i++)
+    dealloc_refs (pending[i].name, pending[i].refs);
+}
+
+static void
+release_queue (void *arg)
+{
+  struct dealloc_queue *queue = arg;
+
+  dealloc_drain (queue);
+  __atomic_store_n (&queue->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void
+create_self_key (void)
+{
+  self_key_error = pthread_key_create (&self_key, release_queue);
+}
+
+static struct dealloc_queue *
+get_queue (void)
+{
+  struct dealloc_queue *queue;
+  int in_use;
+
+  pthread_once (&self_key_once, create_self_key);
+  if (self_key_error)
+    return NULL;
+
+  for (queue = __atomic_load_n (&queues, __ATOMIC_ACQUIRE);
+       queue;
+       queue = queue->next)
+    {
+      in_use = 0;
+      if (__atomic_compare_exchange_n (&queue->in_use, &in_use, 1, 0,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        break;
+    }
+
+  if (!queue)
+    {
+      queue = calloc (1, sizeof *queue);
+      if (!queue)
+        return NULL;
+
+      pthread_mutex_init (&queue->lock, NULL);
+      queue->in_use = 1;
+      queue->next = __atomic_load_n (&queues, __ATOMIC_RELAXED);
+      while (!__atomic_compare_exchange_n (&queues, &queue->next, queue,
+                                           1, __ATOMIC_RELEASE,
+                                           __ATOMIC_RELAXED))
+        ;
+    }
+
+  if (pthread_setspecific (self_key, queue))
+    {
+      release_queue (queue);
+      return NULL;
+    }
+
+  self = queue;
+  return queue;
+}
+
+/* Queue up dropping REFS user references to the send right NAME.  */
+__attribute__ ((visibility("hidden")))
+void
+dealloc_defer (mach_port_t name, unsigned int refs)
+{
+  struct dealloc_queue *queue = self;
+  unsigned int i, nr_names;
+  int wake = 0, drain = 0;
+
+  if (!queue)
+    {
+      queue = get_queue ();
+      if (!queue)
+        {
+          dealloc_refs (name, refs);
+          return;
+        }
+    }
+
+  pthread_mutex_lock (&queue->lock);
+
+  for (i = port_name_hash (name) & (4 * DEALLOC_MAX_PENDING - 1);
+       queue->slots[i].refs && queue->slots[i].name != name;
+       i = (i + 1) & (4 * DEALLOC_MAX_PENDING - 1))
+    ;
+
+  if (queue->slots[i].refs == 0)
+    {
+      queue->slots[i].name = name;
+      queue->nr_names++;
+    }
+  queue->slots[i].refs += refs;
+  nr_names = queue->nr_names;
+
+  if (nr_names >= __atomic_load_n (&dealloc_max_pending, __ATOMIC_RELAXED))
+    {
+      if (!__atomic_load_n (&reaper_running, __ATOMIC_ACQUIRE))
+        drain = 1;
+      else if (!queue->reaper_woken)
+        queue->reaper_woken = wake = 1;
+    }
+
+  /* Don't let the reaper fall too far behind, nor the user references
+     we hold on to get anywhere near overflowing.  */
+  if (nr_names >= 2 * DEALLOC_MAX_PENDING
+      || queue->slots[i].refs >= DEALLOC_MAX_REFS)
+    drain = 1;
+
+  pthread_mutex_unlock (&queue->lock);
+
+  if (drain)
+    dealloc_drain (queue);
+  else if (wake)
+    pthread_cond_signal (&reaper_wakeup);
+}
+
+/* Drop all but one of the user references the send proxy P holds.  */
+__attribute__ ((visibility("hidden")))
+void
+send_proxy_trim_urefs (struct portproxy *p)
+{
+  unsigned int urefs = __atomic_load_n (&p->urefs, __ATOMIC_RELAXED);
+
+  /* Others may be taking some, or trimming them too.  */
+  do
+    if (urefs <= 1)
+      return;
+  while (!__atomic_compare_exchange_n (&p->urefs, &urefs, 1, 1,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+  send_right_release (p->port, urefs - 1);
+}
+
+void
+portproxy_dealloc_flush (void)
+{
+  struct dealloc_queue *queue;
+
+  for (queue = __atomic_load_n (&queues, __ATOMIC_ACQUIRE);
+       queue;
+       queue = queue->next)
+    dealloc_drain (queue);
+}
+
+static void *
+reaper (void *arg)
+{
+  struct timespec deadline;
+  unsigned int delay;
+
+  pthread_mutex_lock (&reaper_lock);
+  while (1)
+    {
+      delay = dealloc_max_delay;
+      if (delay)
+        {
+          clock_gettime (CLOCK_REALTIME, &deadline);
+          deadline.tv_sec += delay / 1000;
+          deadline.tv_nsec += (delay % 1000) * 1000000;
+          if (deadline.tv_nsec >= 1000000000)
+            {
+              deadline.tv_sec++;
+              deadline.tv_nsec -= 1000000000;
+            }
+          pthread_cond_timedwait (&reaper_wakeup, &reaper_lock, &deadline);
+        }
+      else
+        pthread_cond_wait (&reaper_wakeup, &reaper_lock);
+
+      pthread_mutex_unlock (&reaper_lock);
+      portproxy_dealloc_flush ();
+      pthread_mutex_lock (&reaper_lock);
+    }
+
+  return NULL;
+}
+
+error_t
+portproxy_deferred_dealloc (unsigned int max_pending,
+                            unsigned int max_delay)
+{
+  error_t err = 0;
+  pthread_t thread;
+
+  if (max_pending > DEALLOC_MAX_PENDING)
+    max_pending = DEALLOC_MAX_PENDING;
+
+  pthread_mutex_lock (&reaper_lock);
+
+  dealloc_max_delay = max_delay;
+  if (max_pending && max_delay && !reaper_running)
+    {
+      err = pthread_create (&thread, NULL, reaper, NULL);
+      if (!err)
+        {
+          pthread_detach (thread);
+          __atomic_store_n (&reaper_running, 1, __ATOMIC_RELEASE);
+        }
+    }
+
+  if (!err)
+    __atomic_store_n (&dealloc_max_pending, max_pending, __ATOMIC_RELAXED);
+
+  /* Let the reaper pick up the new delay.  */
+  pthread_cond_signal (&reaper_wakeup);
+  pthread_mutex_unlock (&reaper_lock);
+
+  /* Deallocations are no longer deferred; drop whatever still is.  */
+  if (!max_pending)
+    portproxy_dealloc_flush ();
+
+  return err;
+}
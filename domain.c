@@ -0,0 +1,123 @@
+#include <stdlib.h>
+
+#include "portproxy.h"
+#include "private.h"
+
+/* Serializes creating domains and giving them buckets.  */
+static pthread_mutex_t domains_lock = PTHREAD_MUTEX_INITIALIZER;
+
+error_t
+portproxy_domain_create (unsigned int shards,
+                         struct portproxy_domain **domain)
+{
+  error_t err;
+  struct portproxy_domain *d;
+
+  d = calloc (1, sizeof *d);
+  if (!d)
+    return ENOMEM;
+
+  d->pset = MACH_PORT_NULL;
+  pthread_mutex_init (&d->pools_lock, NULL);
+
+  err = domain_shards_setup (d, shards);
+  if (err)
+    {
+      free (d);
+      return err;
+    }
+
+  pthread_mutex_lock (&domains_lock);
+  if (nr_domains == DOMAIN_MAX)
+    err = ENOSPC;
+  else
+    {
+      d->id = nr_domains;
+      domains[nr_domains] = d;
+      __atomic_store_n (&nr_domains, nr_domains + 1, __ATOMIC_RELEASE);
+    }
+  pthread_mutex_unlock (&domains_lock);
+
+  if (err)
+    {
+      free (d->shards);
+      free (d);
+      return err;
+    }
+
+  *domain = d;
+  return 0;
+}
+
+error_t
+portproxy_domain_add_bucket (struct portproxy_domain *domain,
+                             struct port_bucket *bucket)
+{
+  error_t err = 0;
+  struct portproxy_domain *current;
+
+  pthread_mutex_lock (&domains_lock);
+
+  current = domain_for_bucket (bucket);
+  if (current == domain)
+    ;
+  else if (current != &default_domain)
+    err = EEXIST;
+  else if (nr_domain_buckets == DOMAIN_BUCKETS_MAX)
+    err = ENOSPC;
+  else
+    {
+      domain_buckets[nr_domain_buckets].bucket = bucket;
+      domain_buckets[nr_domain_buckets].domain = domain;
+      __atomic_store_n (&nr_domain_buckets, nr_domain_buckets + 1,
+                        __ATOMIC_RELEASE);
+    }
+
+  pthread_mutex_unlock (&domains_lock);
+  return err;
+}
+
+/* Search the first N entries of domain_buckets for the domain of
+   BUCKET, and remember it for domain_for_bucket ().  */
+__attribute__ ((visibility("hidden")))
+struct portproxy_domain *
+domain_lookup_bucket (struct port_bucket *bucket, unsigned int n)
+{
+  struct portproxy_domain *domain = &default_domain;
+  unsigned int i;
+
+  for (i = 0; i < n; i++)
+    if (domain_buckets[i].bucket == bucket)
+      {
+        domain = domain_buckets[i].domain;
+        break;
+      }
+
+  domain_cache.bucket = bucket;
+  domain_cache.domain = domain;
+  domain_cache.nr_buckets = n;
+  return domain;
+}
+
+void
+portproxy_domain_pin (struct portproxy_domain *domain, processor_set_t pset)
+{
+  __atomic_store_n (&domain->pset, pset, __ATOMIC_RELAXED);
+}
+
+/* Move the calling thread over to the processors DOMAIN is pinned to,
+   if it is.  This is only a hint, so failing to is not an error.  */
+__attribute__ ((visibility("hidden")))
+void
+domain_pin_self (struct portproxy_domain *domain)
+{
+  processor_set_t pset = __atomic_load_n (&domain->pset, __ATOMIC_RELAXED);
+  mach_port_t thread;
+
+  if (pset == MACH_PORT_NULL)
+    return;
+
+  thread = mach_thread_self ();
+  thread_assign (thread, pset);
+  mach_port_deallocate (mach_task_self (), thread);
+}
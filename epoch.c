@@ -0,0 +1,310 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+
+#include "portproxy.h"
+#include "private.h"
+
+struct epoch_record
+{
+  /* (epoch << 1) | 1 while the thread is inside an epoch, 0 otherwise.  */
+  unsigned long state;
+  unsigned int nesting;
+  int in_use;
+  struct epoch_record *next;
+};
+
+/* Something retired, waiting for its grace period to pass.  */
+struct limbo
+{
+  struct limbo *next;
+  unsigned long epoch;
+  void *ptr;
+  void (*free_routine) (void *);
+};
+
+static unsigned long global_epoch = 1;
+
+/* Set once proxies have been borrowed; until then, nothing needs to
+   wait for borrowers.  */
+__attribute__ ((visibility("hidden")))
+int epoch_borrowers;
+
+/* Records are never freed; a record released by an exiting thread
+   is reused by the next thread that needs one.  */
+static struct epoch_record *records;
+
+static __thread struct epoch_record *self;
+
+/* Set when this thread has left something that is due in limbo, with
+   epoch_retire_locked (), for epoch_poll_deferred () to free.  */
+__attribute__ ((visibility("hidden")))
+__thread int epoch_deferred;
+static pthread_key_t self_key;
+static pthread_once_t self_key_once = PTHREAD_ONCE_INIT;
+static error_t self_key_error;
+
+/* Protects limbo, and serializes advancing global_epoch.  */
+static pthread_mutex_t limbo_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Newest first, so sorted by decreasing epoch.  */
+static struct limbo *limbo;
+
+static void
+release_record (void *arg)
+{
+  struct epoch_record *record = arg;
+
+  __atomic_store_n (&record->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void
+create_self_key (void)
+{
+  self_key_error = pthread_key_create (&self_key, release_record);
+}
+
+static struct epoch_record *
+get_record (void)
+{
+  struct epoch_record *record;
+  int in_use;
+
+  pthread_once (&self_key_once, create_self_key);
+  if (self_key_error)
+    return NULL;
+
+  for (record = __atomic_load_n (&records, __ATOMIC_ACQUIRE);
+       record;
+       record = record->next)
+    {
+      in_use = 0;
+      if (__atomic_compare_exchange_n (&record->in_use, &in_use, 1, 0,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        break;
+    }
+
+  if (!record)
+    {
+      record = calloc (1, sizeof *record);
+      if (!record)
+        return NULL;
+
+      record->in_use = 1;
+      record->next = __atomic_load_n (&records, __ATOMIC_RELAXED);
+      while (!__atomic_compare_exchange_n (&records, &record->next, record,
+                                           1, __ATOMIC_RELEASE,
+                                           __ATOMIC_RELAXED))
+        ;
+    }
+
+  if (pthread_setspecific (self_key, record))
+    {
+      release_record (record);
+      return NULL;
+    }
+
+  self = record;
+  return record;
+}
+
+/* Enter an epoch.  Returns NULL if this thread could not be registered,
+   in which case the caller must fall back to taking locks.  */
+__attribute__ ((visibility("hidden")))
+struct epoch_record *
+epoch_enter (void)
+{
+  struct epoch_record *record = self;
+  unsigned long epoch;
+
+  if (!record)
+    {
+      record = get_record ();
+      if (!record)
+        return NULL;
+    }
+
+  if (record->nesting++ == 0)
+    {
+      epoch = __atomic_load_n (&global_epoch, __ATOMIC_RELAXED);
+      __atomic_store_n (&record->state, (epoch << 1) | 1, __ATOMIC_RELAXED);
+      /* Make our state visible before we look at anything shared.  */
+      __atomic_thread_fence (__ATOMIC_SEQ_CST);
+    }
+
+  return record;
+}
+
+__attribute__ ((visibility("hidden")))
+void
+epoch_exit (struct epoch_record *record)
+{
+  if (--record->nesting == 0)
+    __atomic_store_n (&record->state, 0, __ATOMIC_RELEASE);
+}
+
+/* Advance the global epoch, unless a thread is still inside an older
+   one.  Must be called with limbo_lock held.  */
+static void
+epoch_try_advance (void)
+{
+  struct epoch_record *record;
+  unsigned long epoch = global_epoch;
+  unsigned long state;
+
+  __atomic_thread_fence (__ATOMIC_SEQ_CST);
+
+  for (record = __atomic_load_n (&records, __ATOMIC_ACQUIRE);
+       record;
+       record = record->next)
+    {
+      state = __atomic_load_n (&record->state, __ATOMIC_RELAXED);
+      if ((state & 1) && (state >> 1) != epoch)
+        return;
+    }
+
+  __atomic_store_n (&global_epoch, epoch + 1, __ATOMIC_RELEASE);
+}
+
+/* Detach everything whose grace period has passed.
+   Must be called with limbo_lock held.  */
+static struct limbo *
+epoch_collect (void)
+{
+  struct limbo **lp, *done;
+
+  for (lp = &limbo; *lp; lp = &(*lp)->next)
+    if ((*lp)->epoch + 2 <= global_epoch)
+      break;
+
+  done = *lp;
+  *lp = NULL;
+  return done;
+}
+
+/* Put PTR into limbo, to be freed with FREE_ROUTINE, and if COLLECT,
+   take out and return what can be freed now.  */
+static struct limbo *
+epoch_limbo (void *ptr, void (*free_routine) (void *), int collect)
+{
+  struct limbo *l, *done;
+  unsigned long epoch;
+
+  l = malloc (sizeof *l);
+
+  pthread_mutex_lock (&limbo_lock);
+
+  if (l)
+    {
+      l->ptr = ptr;
+      l->free_routine = free_routine;
+      l->epoch = global_epoch;
+      l->next = limbo;
+      limbo = l;
+    }
+  else
+    {
+      /* Out of memory; wait for the grace period right here.  */
+      assert_backtrace (!self || self->nesting == 0);
+      epoch = global_epoch;
+      while (epoch_try_advance (), global_epoch < epoch + 2)
+        {
+          pthread_mutex_unlock (&limbo_lock);
+          sched_yield ();
+          pthread_mutex_lock (&limbo_lock);
+        }
+    }
+
+  /* With nobody inside an epoch, everything can go at once; otherwise,
+     retiring things keeps the epochs moving along.  */
+  epoch_try_advance ();
+  epoch_try_advance ();
+  done = collect ? epoch_collect () : NULL;
+
+  pthread_mutex_unlock (&limbo_lock);
+
+  if (!l)
+    (*free_routine) (ptr);
+
+  return done;
+}
+
+static void
+epoch_free (struct limbo *done)
+{
+  struct limbo *l;
+
+  while (done)
+    {
+      l = done;
+      done = l->next;
+      (*l->free_routine) (l->ptr);
+      free (l);
+    }
+}
+
+/* Free PTR with FREE_ROUTINE once no thread can be looking at it anymore.
+   PTR must already be unreachable for threads entering an epoch from now
+   on.  Should not be called from inside an epoch, as it has to wait for
+   a grace period if it runs out of memory.  This also frees whatever
+   else is due, which can run clean routines.  */
+__attribute__ ((visibility("hidden")))
+void
+epoch_retire (void *ptr, void (*free_routine) (void *))
+{
+  epoch_free (epoch_limbo (ptr, free_routine, 1));
+}
+
+/* Like epoch_retire (), but for callers holding locks that clean
+   routines may take: whatever else is due is left for the caller to
+   free with epoch_poll_deferred () once it has dropped them.
+   FREE_ROUTINE itself must not take any.  */
+__attribute__ ((visibility("hidden")))
+void
+epoch_retire_locked (void *ptr, void (*free_routine) (void *))
+{
+  epoch_limbo (ptr, free_routine, 0);
+  epoch_deferred = 1;
+}
+
+/* Free whatever has been waiting long enough, like epoch_retire ()
+   does, unless somebody else is at it.  */
+__attribute__ ((visibility("hidden")))
+void
+epoch_poll (void)
+{
+  struct limbo *done;
+
+  if (!__atomic_load_n (&limbo, __ATOMIC_RELAXED)
+      || pthread_mutex_trylock (&limbo_lock))
+    return;
+
+  epoch_try_advance ();
+  epoch_try_advance ();
+  done = epoch_collect ();
+
+  pthread_mutex_unlock (&limbo_lock);
+
+  epoch_free (done);
+}
+
+error_t
+portproxy_epoch_enter (void)
+{
+  if (!__atomic_load_n (&epoch_borrowers, __ATOMIC_RELAXED))
+    __atomic_store_n (&epoch_borrowers, 1, __ATOMIC_SEQ_CST);
+
+  return epoch_enter () ? 0 : ENOMEM;
+}
+
+void
+portproxy_epoch_exit (void)
+{
+  struct epoch_record *record = self;
+
+  epoch_exit (record);
+
+  /* Borrowers hold up what gets retired, so they help get it freed;
+     otherwise, it would wait for the next thing to be retired.  */
+  if (record->nesting == 0)
+    epoch_poll ();
+}
@@ -1,5 +1,6 @@
 #include <stdatomic.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <hurd.h>
 #include <hurd/ports.h>
 #include <hurd/fd.h>
@@ -10,6 +11,12 @@ struct port_bucket *traced_bucket;
 
 static atomic_int next_id = 1;
 
+/* The msgh_ids to trace, if not all of them, and whether the message
+   this thread is translating isn't among them.  Messages that aren't
+   are still forwarded, so this can't be the server's filter.  */
+static struct portproxy_filter *traced_ids;
+static __thread int untraced;
+
 struct traced_proxy
 {
   struct portproxy portproxy;
@@ -39,6 +46,37 @@ traced_clean (void *arg)
   portproxy_clean (proxy);
 }
 
+static void
+traced_init (void *p_created, void *p_existing, void *hook)
+{
+  struct traced_proxy *created = p_created;
+  struct traced_proxy *existing = p_existing;
+
+  if (existing)
+    {
+      /* Migrate our data over.  */
+      if (existing->peer)
+        {
+          created->peer = existing->peer;
+          created->peer->peer = created;
+          existing->peer = NULL;
+          if (existing->portproxy.type == PORTPROXY_TYPE_SEND)
+            {
+              assert_backtrace (created->portproxy.type == PORTPROXY_TYPE_RECEIVE);
+              portproxy_deref (existing);
+            }
+        }
+      else
+        created->peer = NULL;
+      created->id = existing->id;
+    }
+  else
+    {
+      created->peer = NULL;
+      created->id = next_id++;
+    }
+}
+
 static error_t
 traced_copyin (mach_port_t right,
                mach_port_right_t type,
@@ -60,31 +98,13 @@ traced_copyin (mach_port_t right,
 
   if (created)
     {
+      traced_init (created, existing, NULL);
       if (existing)
         {
-          /* Migrate our data over and release existing.  */
-          if (existing->peer)
-            {
-              created->peer = existing->peer;
-              created->peer->peer = created;
-              existing->peer = NULL;
-              if (existing->portproxy.type == PORTPROXY_TYPE_SEND)
-                {
-                  assert_backtrace (created->portproxy.type == PORTPROXY_TYPE_RECEIVE);
-                  portproxy_deref (existing);
-                }
-            }
-          else
-            created->peer = NULL;
-          created->id = existing->id;
+          /* Release existing.  */
           portproxy_unlock (existing);
           portproxy_deref (existing);
         }
-      else
-        {
-          created->peer = NULL;
-          created->id = next_id++;
-        }
 
       *proxy = created;
     }
@@ -148,12 +168,14 @@ traced_copyout (struct traced_proxy **proxy,
 }
 
 static error_t
-traced_copyout_peer (struct traced_proxy *proxy,
-                     mach_port_right_t required_type,
-                     mach_port_t *right,
-                     mach_msg_type_name_t *conversion)
+traced_translate (void *p_proxy,
+                  mach_port_right_t required_type,
+                  mach_port_t *right,
+                  mach_msg_type_name_t *conversion,
+                  void *hook)
 {
   error_t err;
+  struct traced_proxy *proxy = p_proxy;
   struct traced_proxy *peer = proxy->peer;
 
   if (peer)
@@ -164,6 +186,9 @@ traced_copyout_peer (struct traced_proxy *proxy,
 
   err = traced_copyout (&peer, required_type,
                         right, conversion);
+  if (!err && !untraced)
+    portproxy_trace (PORTPROXY_TRACE_RIGHT, 0, proxy->id, *right,
+                     required_type, *conversion);
 
   if (!err && peer && !proxy->peer)
     {
@@ -184,100 +209,32 @@ traced_copyout_peer (struct traced_proxy *proxy,
   portproxy_unlock (peer);
   portproxy_deref (peer);
 
-  portproxy_unlock (proxy);
-  portproxy_deref (proxy);
-
   return err;
 }
 
-static void
-foo (mach_msg_header_t *inp)
+static error_t
+traced_copyout_peer (struct traced_proxy *proxy,
+                     mach_port_right_t required_type,
+                     mach_port_t *right,
+                     mach_msg_type_name_t *conversion)
 {
-  error_t err = 0;
-  void *ptr;
-  mach_msg_type_name_t local_bits, remote_bits;
-  struct traced_proxy *local_port, *remote_port;
-
-  local_bits = MACH_MSGH_BITS_LOCAL (inp->msgh_bits);
-  remote_bits = MACH_MSGH_BITS_REMOTE (inp->msgh_bits);
-
-  if (local_bits == MACH_MSG_TYPE_PROTECTED_PAYLOAD)
-    {
-      local_port = ports_lookup_payload (traced_bucket,
-                                         inp->msgh_protected_payload,
-                                         traced_class);
-      local_bits = local_port->portproxy.type == PORTPROXY_TYPE_RECEIVE
-                     ? MACH_MSG_TYPE_MOVE_SEND
-                     : MACH_MSG_TYPE_MOVE_SEND_ONCE;
-    }
-  else
-    local_port = ports_lookup_port (traced_bucket,
-                                    inp->msgh_local_port,
-                                    traced_class);
-
-  err = portproxy_copyin_request_port (local_port);
-  assert_perror_backtrace (err);
-
-  printf ("local_port %p %d\n", local_port, local_port->id);
-
-  err = traced_copyout_peer (local_port,
-                             portproxy_conversion_to_type (local_bits),
-                             &inp->msgh_local_port, &local_bits);
-  assert_perror_backtrace (err);
-
-  if (MACH_PORT_VALID (inp->msgh_remote_port))
-    {
-      err = traced_copyin (inp->msgh_remote_port,
-                           portproxy_conversion_to_type (remote_bits),
-                           &remote_port);
-      assert_perror_backtrace (err);
-
-      printf ("remote_port %p %d\n", remote_port, remote_port->id);
-
-      err = traced_copyout_peer (remote_port,
-                                 portproxy_conversion_to_type (remote_bits),
-                                 &inp->msgh_remote_port, &remote_bits);
-      assert_perror_backtrace (err);
-    }
+  error_t err;
 
-  inp->msgh_bits = MACH_MSGH_BITS (remote_bits, local_bits);
+  err = traced_translate (proxy, required_type,
+                          right, conversion, NULL);
 
-  ptr = inp + 1;
+  portproxy_unlock (proxy);
+  portproxy_deref (proxy);
 
-  while ((unsigned char *) ptr < (unsigned char *) inp + inp->msgh_size)
-    {
-       mach_msg_type_t *const type = ptr;
-       mach_msg_type_name_t name;
-       mach_port_right_t port_type;
-       mach_port_t *right;
-       struct traced_proxy *proxy;
-
-       name = type->msgt_name;
-       right = (mach_port_t *) (type + 1);
-       ptr = right + 1;
-
-       if (!MACH_MSG_TYPE_PORT_ANY_RIGHT (name))
-         continue;
-
-       if (!MACH_PORT_VALID (*right))
-         {
-           printf ("invalid\n");
-           continue;
-         }
-
-       port_type = portproxy_conversion_to_type (name);
-
-       err = traced_copyin (*right, port_type, &proxy);
-       assert_perror_backtrace (err);
-       printf ("port %p %d\n", proxy, proxy->id);
-
-       err = traced_copyout_peer (proxy, port_type,
-                                  right, &name);
-       assert_perror_backtrace (err);
-       type->msgt_name = name;
-    }
+  return err;
 }
 
+static struct portproxy_translator traced_translator =
+{
+  .size = sizeof (struct traced_proxy),
+  .init = traced_init,
+  .translate = traced_translate,
+};
 
 static void *
 send_something (void *unused)
@@ -309,45 +266,61 @@ send_something (void *unused)
   fprintf (f, "Hello!\n");
 }
 
+static error_t
+traced_received (mach_msg_header_t *msg, void *hook)
+{
+  untraced = traced_ids
+             && !portproxy_filter_msg (traced_ids, msg, &traced_translator);
+  if (!untraced)
+    portproxy_trace (PORTPROXY_TRACE_MSG, msg->msgh_id, 0,
+                     msg->msgh_local_port, 0, msg->msgh_size);
+  return 0;
+}
+
+static struct portproxy_server_hooks traced_hooks =
+{
+  .received = traced_received,
+};
+
 int
-main ()
+main (int argc, char **argv)
 {
   error_t err;
   pthread_t thread;
-  struct
-  {
-    mach_msg_header_t header;
-    unsigned char body[1024];
-  } msg;
-  mach_msg_type_name_t local_bits, remote_bits;
-  mach_port_t tmp;
+  mach_msg_id_t id;
+  int i;
 
   traced_bucket = ports_create_bucket ();
   traced_class = ports_create_class (&traced_clean, NULL);
+  traced_translator.port_class = traced_class;
+  traced_translator.bucket = traced_bucket;
+  traced_translator.layout_cache = portproxy_layout_cache_create ();
 
-  pthread_create (&thread, NULL, send_something, NULL);
-
-  while (1)
+  /* Only trace the msgh_ids given after the trace file, if any, and
+     their replies.  */
+  if (argc > 2)
     {
-      err = mach_msg (&msg.header, MACH_RCV_MSG, 0, sizeof msg,
-                      traced_bucket->portset, 0, MACH_PORT_NULL);
-      assert_perror_backtrace (err);
-
-      printf ("\nrecv'd message of size %d, id %d\n",
-              msg.header.msgh_size, msg.header.msgh_id);
-      foo ((mach_msg_header_t *) &msg);
-
-      local_bits = MACH_MSGH_BITS_LOCAL (msg.header.msgh_bits);
-      remote_bits = MACH_MSGH_BITS_REMOTE (msg.header.msgh_bits);
-
-      msg.header.msgh_bits = MACH_MSGH_BITS (local_bits, remote_bits)
-        | MACH_MSGH_BITS_COMPLEX;
-      tmp = msg.header.msgh_local_port;
-      msg.header.msgh_local_port = msg.header.msgh_remote_port;
-      msg.header.msgh_remote_port = tmp;
-
-      err = mach_msg (&msg.header, MACH_SEND_MSG, msg.header.msgh_size,
-                      0, MACH_PORT_NULL, 0, MACH_PORT_NULL);
-      assert_perror_backtrace (err);
+      traced_ids = portproxy_filter_create ();
+      assert_backtrace (traced_ids);
+      for (i = 2; i < argc; i++)
+        {
+          id = strtol (argv[i], NULL, 0);
+          err = portproxy_filter_add (traced_ids, id, id);
+          if (!err)
+            err = portproxy_filter_add (traced_ids, id + 100, id + 100);
+          assert_perror_backtrace (err);
+        }
     }
+
+  /* Decode with examples/trace-decode.  */
+  err = portproxy_trace_start (argc > 1 ? argv[1] : "rpctrace1.trace", 100);
+  assert_perror_backtrace (err);
+
+  pthread_create (&thread, NULL, send_something, NULL);
+
+  err = portproxy_server (&traced_translator, &traced_hooks, 0, 2 * 60 * 1000);
+  assert_perror_backtrace (err);
+
+  err = portproxy_trace_stop ();
+  assert_perror_backtrace (err);
 }
@@ -0,0 +1,91 @@
+/* Turn a trace written by portproxy_trace_start () into text.
+
+   Usage: trace-decode [trace-file]  */
+
+#include <stdio.h>
+#include <string.h>
+#include "portproxy.h"
+
+static const char *
+kind_name (unsigned int kind)
+{
+  switch (kind)
+    {
+    case PORTPROXY_TRACE_MSG:
+      return "msg";
+    case PORTPROXY_TRACE_RIGHT:
+      return "right";
+    case PORTPROXY_TRACE_DROPPED:
+      return "dropped";
+    default:
+      return "?";
+    }
+}
+
+int
+main (int argc, char **argv)
+{
+  FILE *f = stdin;
+  struct portproxy_trace_header header;
+  struct portproxy_trace_record record;
+  unsigned long records = 0, dropped = 0;
+  uint64_t start = 0;
+
+  if (argc > 1)
+    {
+      f = fopen (argv[1], "r");
+      if (!f)
+        error (1, errno, "%s", argv[1]);
+    }
+
+  if (fread (&header, sizeof header, 1, f) != 1
+      || memcmp (header.magic, PORTPROXY_TRACE_MAGIC,
+                 sizeof PORTPROXY_TRACE_MAGIC))
+    error (1, 0, "not a trace");
+  if (header.version != PORTPROXY_TRACE_VERSION
+      || header.record_size != sizeof record)
+    error (1, 0, "unsupported trace version %u", header.version);
+
+  while (fread (&record, sizeof record, 1, f) == 1)
+    {
+      if (!start)
+        start = record.time;
+
+      /* Rings are drained one after the other, so records are only in
+         order within a thread.  */
+      printf ("%12.3f %4u %-7s ",
+              (double) (int64_t) (record.time - start) / 1000,
+              record.thread, kind_name (record.kind));
+
+      switch (record.kind)
+        {
+        case PORTPROXY_TRACE_MSG:
+          records++;
+          printf ("id %d on %u, size %u\n",
+                  record.id, record.right, record.arg);
+          break;
+
+        case PORTPROXY_TRACE_RIGHT:
+          records++;
+          printf ("proxy %u, type %u -> %u as %u\n",
+                  record.proxy, record.disposition, record.right,
+                  record.arg);
+          break;
+
+        case PORTPROXY_TRACE_DROPPED:
+          printf ("%u records\n", record.arg);
+          dropped += record.arg;
+          break;
+
+        default:
+          printf ("kind %u\n", record.kind);
+          break;
+        }
+    }
+
+  if (ferror (f))
+    error (1, errno, "reading trace");
+
+  printf ("%lu records, %lu dropped\n", records, dropped);
+  return 0;
+}
@@ -0,0 +1,266 @@
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "portproxy.h"
+#include "private.h"
+
+/* Each page covers this many ids, as a bitmap of 64-bit words.  */
+#define FILTER_PAGE_SHIFT 12
+#define FILTER_PAGE_IDS (1U << FILTER_PAGE_SHIFT)
+#define FILTER_PAGE_WORDS (FILTER_PAGE_IDS / 64)
+
+/* Pages are found by open addressing, and never taken out again before
+   the filter is destroyed; the table is kept at most half full.  */
+#define FILTER_TABLE_SIZE 256
+#define FILTER_MAX_PAGES (FILTER_TABLE_SIZE / 2)
+
+struct filter_page
+{
+  uint32_t key;                 /* The ids it covers, shifted down.  */
+  uint64_t bits[FILTER_PAGE_WORDS];
+};
+
+struct portproxy_filter
+{
+  struct filter_page *pages[FILTER_TABLE_SIZE];
+  unsigned int nr_pages;
+  pthread_mutex_t lock;         /* Serializes changes.  */
+};
+
+/* Whether any proxy has ever had its flags set; until then, there is
+   no point in looking proxies up to check them.  */
+static int proxy_flags_used;
+
+/* Find the slot in FILTER's table for the page with KEY: the one it
+   is in, or else the empty one where it would go.  */
+static struct filter_page **
+filter_slot (const struct portproxy_filter *filter, uint32_t key)
+{
+  struct filter_page *const *slot;
+  struct filter_page *page;
+  unsigned int i;
+
+  for (i = port_name_hash (key) & (FILTER_TABLE_SIZE - 1);
+       ;
+       i = (i + 1) & (FILTER_TABLE_SIZE - 1))
+    {
+      slot = &filter->pages[i];
+      page = __atomic_load_n (slot, __ATOMIC_ACQUIRE);
+      if (!page || page->key == key)
+        return (struct filter_page **) slot;
+    }
+}
+
+struct portproxy_filter *
+portproxy_filter_create (void)
+{
+  struct portproxy_filter *filter;
+
+  filter = calloc (1, sizeof *filter);
+  if (filter)
+    pthread_mutex_init (&filter->lock, NULL);
+  return filter;
+}
+
+void
+portproxy_filter_destroy (struct portproxy_filter *filter)
+{
+  unsigned int i;
+
+  for (i = 0; i < FILTER_TABLE_SIZE; i++)
+    free (filter->pages[i]);
+  pthread_mutex_destroy (&filter->lock);
+  free (filter);
+}
+
+/* Set the bits for the ids from FIRST to LAST, which are in the same
+   page, in PAGE, or clear them unless SET.  */
+static void
+filter_page_update (struct filter_page *page, uint32_t first, uint32_t last,
+                    int set)
+{
+  uint32_t i, end;
+  uint64_t mask;
+
+  first &= FILTER_PAGE_IDS - 1;
+  last &= FILTER_PAGE_IDS - 1;
+
+  for (i = first; i <= last; i = end + 1)
+    {
+      end = i | 63;
+      if (end > last)
+        end = last;
+      mask = (~0ULL >> (63 - (end - i))) << (i & 63);
+
+      if (set)
+        __atomic_fetch_or (&page->bits[i / 64], mask, __ATOMIC_RELAXED);
+      else
+        __atomic_fetch_and (&page->bits[i / 64], ~mask, __ATOMIC_RELAXED);
+    }
+}
+
+/* Add the ids from FIRST to LAST, taken as unsigned, to FILTER, or
+   remove them unless SET.  Must be called with FILTER's lock held.  */
+static error_t
+filter_update_range (struct portproxy_filter *filter, uint32_t first,
+                     uint32_t last, int set)
+{
+  struct filter_page **slot, *page;
+  uint32_t end;
+
+  while (1)
+    {
+      end = first | (FILTER_PAGE_IDS - 1);
+      if (end > last)
+        end = last;
+
+      slot = filter_slot (filter, first >> FILTER_PAGE_SHIFT);
+      page = *slot;
+      if (!page && set)
+        {
+          if (filter->nr_pages >= FILTER_MAX_PAGES)
+            return ENOSPC;
+
+          page = calloc (1, sizeof *page);
+          if (!page)
+            return ENOMEM;
+          page->key = first >> FILTER_PAGE_SHIFT;
+          __atomic_store_n (slot, page, __ATOMIC_RELEASE);
+          filter->nr_pages++;
+        }
+
+      if (page)
+        filter_page_update (page, first, end, set);
+
+      if (end == last)
+        return 0;
+      first = end + 1;
+    }
+}
+
+/* Return how many pages FILTER lacks for the ids from FIRST to LAST,
+   or any number over LIMIT if that many.  Must be called with FILTER's
+   lock held.  */
+static unsigned int
+filter_missing (const struct portproxy_filter *filter, mach_msg_id_t first,
+                mach_msg_id_t last, unsigned int limit)
+{
+  int32_t page;
+  unsigned int n = 0;
+
+  for (page = first >> FILTER_PAGE_SHIFT;
+       n <= limit && page <= last >> FILTER_PAGE_SHIFT;
+       page++)
+    if (!*filter_slot (filter, (uint32_t) page & (UINT32_MAX
+                                                  >> FILTER_PAGE_SHIFT)))
+      n++;
+
+  return n;
+}
+
+static error_t
+filter_update (struct portproxy_filter *filter, mach_msg_id_t first,
+               mach_msg_id_t last, int set)
+{
+  error_t err = 0;
+  unsigned int room;
+
+  if (first > last)
+    return EINVAL;
+
+  pthread_mutex_lock (&filter->lock);
+
+  /* Add all of them or none.  */
+  room = FILTER_MAX_PAGES - filter->nr_pages;
+  if (set && filter_missing (filter, first, last, room) > room)
+    {
+      pthread_mutex_unlock (&filter->lock);
+      return ENOSPC;
+    }
+
+  /* As unsigned, the negative ids come after the others.  */
+  if (first < 0 && last >= 0)
+    {
+      err = filter_update_range (filter, first, -1, set);
+      first = 0;
+    }
+  if (!err)
+    err = filter_update_range (filter, first, last, set);
+
+  pthread_mutex_unlock (&filter->lock);
+  return err;
+}
+
+error_t
+portproxy_filter_add (struct portproxy_filter *filter,
+                      mach_msg_id_t first, mach_msg_id_t last)
+{
+  return filter_update (filter, first, last, 1);
+}
+
+void
+portproxy_filter_remove (struct portproxy_filter *filter,
+                         mach_msg_id_t first, mach_msg_id_t last)
+{
+  filter_update (filter, first, last, 0);
+}
+
+int
+portproxy_filter_match (const struct portproxy_filter *filter,
+                        mach_msg_id_t id)
+{
+  uint32_t i = id;
+  const struct filter_page *page;
+
+  page = *filter_slot (filter, i >> FILTER_PAGE_SHIFT);
+  if (!page)
+    return 0;
+
+  i &= FILTER_PAGE_IDS - 1;
+  return (__atomic_load_n (&page->bits[i / 64], __ATOMIC_RELAXED)
+          >> (i & 63)) & 1;
+}
+
+void
+portproxy_set_flags (void *proxy, unsigned int set, unsigned int clear)
+{
+  struct portproxy *p = proxy;
+  unsigned char flags = __atomic_load_n (&p->flags, __ATOMIC_RELAXED);
+
+  if (set)
+    __atomic_store_n (&proxy_flags_used, 1, __ATOMIC_RELAXED);
+
+  while (!__atomic_compare_exchange_n (&p->flags, &flags,
+                                       (flags | set) & ~clear, 1,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+int
+portproxy_filter_msg (const struct portproxy_filter *filter,
+                      const mach_msg_header_t *msg,
+                      const struct portproxy_translator *translator)
+{
+  struct portproxy *proxy;
+  unsigned int flags;
+  int match;
+
+  match = portproxy_filter_match (filter, msg->msgh_id);
+
+  if (!__atomic_load_n (&proxy_flags_used, __ATOMIC_RELAXED))
+    return match;
+
+  proxy = portproxy_lookup_local (msg, translator->bucket,
+                                 translator->port_class);
+  if (!proxy)
+    return match;
+
+  flags = __atomic_load_n (&proxy->flags, __ATOMIC_RELAXED);
+  ports_port_deref (proxy);
+
+  if (flags & PORTPROXY_FLAG_TRACE)
+    return 1;
+  if (flags & PORTPROXY_FLAG_QUIET)
+    return 0;
+  return match;
+}
@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "portproxy.h"
+#include "private.h"
+
+__attribute__ ((visibility("hidden")))
+struct histograms *histograms;
+
+/* What gets allocated on first enable, and kept around afterwards.  */
+static struct histograms *allocated;
+static size_t allocated_size;
+static pthread_mutex_t histograms_lock = PTHREAD_MUTEX_INITIALIZER;
+
+__attribute__ ((visibility("hidden")))
+void
+shard_lock_timed (struct histograms *h, struct shard *shard)
+{
+  uint64_t start;
+
+  if (pthread_mutex_trylock (&shard->lock) == 0)
+    return;
+
+  start = hist_now ();
+  pthread_mutex_lock (&shard->lock);
+
+  /* Only the shards of the default domain have histograms.  */
+  if (shard->domain == &default_domain)
+    hist_record (&h->shard_wait[shard - default_domain.shards], start);
+}
+
+error_t
+portproxy_histograms_enable (int enable)
+{
+  error_t err = 0;
+
+  if (!__atomic_load_n (&default_domain.shards, __ATOMIC_ACQUIRE))
+    shards_init ();
+
+  pthread_mutex_lock (&histograms_lock);
+
+  if (!enable)
+    __atomic_store_n (&histograms, NULL, __ATOMIC_RELAXED);
+  else if (!histograms)
+    {
+      if (!allocated)
+        {
+          allocated_size = sizeof *allocated
+                           + default_domain.nr_shards * sizeof (struct hist);
+          allocated = malloc (allocated_size);
+        }
+
+      if (allocated)
+        {
+          /* Threads still holding on to the pointer from last time may
+             count a few more into the fresh histograms.  */
+          memset (allocated, 0, allocated_size);
+          __atomic_store_n (&histograms, allocated, __ATOMIC_RELEASE);
+        }
+      else
+        err = ENOMEM;
+    }
+
+  pthread_mutex_unlock (&histograms_lock);
+  return err;
+}
+
+/* Print HIST, called NAME, to STREAM, if it counted anything.  */
+static void
+hist_dump (FILE *stream, const char *name, const struct hist *hist)
+{
+  unsigned long counts[HIST_BUCKETS], total = 0;
+  unsigned int i;
+
+  for (i = 0; i < HIST_BUCKETS; i++)
+    {
+      counts[i] = __atomic_load_n (&hist->counts[i], __ATOMIC_RELAXED);
+      total += counts[i];
+    }
+
+  if (!total)
+    return;
+
+  fprintf (stream, "%s: %lu\n", name, total);
+  for (i = 0; i < HIST_BUCKETS; i++)
+    if (counts[i])
+      fprintf (stream, "  %12llu ns  %10lu\n",
+               i ? 1ULL << i : 0ULL, counts[i]);
+}
+
+void
+portproxy_histograms_dump (FILE *stream)
+{
+  static const char *const rights[4] =
+    { "send", "receive", "send-once", "other" };
+  struct histograms *h = histograms_get ();
+  char name[64];
+  unsigned int i;
+
+  if (!h)
+    return;
+
+  for (i = 0; i < 4; i++)
+    {
+      snprintf (name, sizeof name, "copyin %s latency", rights[i]);
+      hist_dump (stream, name, &h->copyin[i]);
+    }
+  for (i = 0; i < 4; i++)
+    {
+      snprintf (name, sizeof name, "copyout %s latency", rights[i]);
+      hist_dump (stream, name, &h->copyout[i]);
+    }
+
+  hist_dump (stream, "proxy read lock wait", &h->proxy_wait[0]);
+  hist_dump (stream, "proxy write lock wait", &h->proxy_wait[1]);
+
+  for (i = 0; i < default_domain.nr_shards; i++)
+    {
+      snprintf (name, sizeof name, "shard %u lock wait", i);
+      hist_dump (stream, name, &h->shard_wait[i]);
+    }
+}
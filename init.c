@@ -0,0 +1,79 @@
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "portproxy.h"
+#include "private.h"
+
+static pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* What the default domain falls back to if we can't allocate its
+   shards.  */
+static struct shard fallback_shards[16];
+
+/* Give DOMAIN N shards, or the default number if N is zero.  */
+__attribute__ ((visibility("hidden")))
+error_t
+domain_shards_setup (struct portproxy_domain *domain, unsigned int n)
+{
+  struct shard *shards;
+  unsigned int i;
+  long ncpus;
+
+  if (n == 0)
+    {
+      /* Four shards per processor, but never fewer
+         than the 16 we've always had.  */
+      ncpus = sysconf (_SC_NPROCESSORS_ONLN);
+      n = 16;
+      while (n < 4 * ncpus && n < 4096)
+        n *= 2;
+    }
+
+  if (posix_memalign ((void **) &shards, __alignof__ (struct shard),
+                      n * sizeof *shards))
+    {
+      if (domain != &default_domain)
+        return ENOMEM;
+      shards = fallback_shards;
+      n = sizeof fallback_shards / sizeof fallback_shards[0];
+    }
+
+  for (i = 0; i < n; i++)
+    {
+      pthread_mutex_init (&shards[i].lock, NULL);
+      shards[i].table = NULL;
+      shards[i].generation = 0;
+      shards[i].domain = domain;
+    }
+
+  domain->nr_shards = n;
+  __atomic_store_n (&domain->shards, shards, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/* Set up the shards of the default domain with the default settings,
+   unless somebody has already done so.  */
+__attribute__ ((visibility("hidden")))
+void
+shards_init (void)
+{
+  pthread_mutex_lock (&init_lock);
+  if (!default_domain.shards)
+    domain_shards_setup (&default_domain, 0);
+  pthread_mutex_unlock (&init_lock);
+}
+
+error_t
+portproxy_init (unsigned int shards)
+{
+  error_t err = 0;
+
+  pthread_mutex_lock (&init_lock);
+  if (default_domain.shards)
+    err = EBUSY;
+  else
+    domain_shards_setup (&default_domain, shards);
+  pthread_mutex_unlock (&init_lock);
+
+  return err;
+}
@@ -0,0 +1,96 @@
+#include <stdlib.h>
+
+#include "portproxy.h"
+#include "private.h"
+
+static inline struct layout *
+layout_entry (struct portproxy_layout_cache *cache, mach_msg_id_t id)
+{
+  uint32_t hash = (uint32_t) id * 0x9e3779b1U;
+
+  return &cache->entries[hash >> 24];
+}
+
+struct portproxy_layout_cache *
+portproxy_layout_cache_create (void)
+{
+  return calloc (1, sizeof (struct portproxy_layout_cache));
+}
+
+void
+portproxy_layout_cache_destroy (struct portproxy_layout_cache *cache)
+{
+  free (cache);
+}
+
+/* Look up the cached layout of MSG, and copy it into LAYOUT if MSG
+   matches it.  Returns whether it does.  */
+__attribute__ ((visibility("hidden")))
+int
+layout_lookup (struct portproxy_layout_cache *cache,
+               const mach_msg_header_t *msg,
+               struct layout *layout)
+{
+  struct layout *entry = layout_entry (cache, msg->msgh_id);
+  const unsigned char *base = (const unsigned char *) msg;
+  unsigned int seq, i;
+  uint32_t words[3];
+
+  seq = __atomic_load_n (&entry->seq, __ATOMIC_ACQUIRE);
+  if (seq & 1)
+    return 0;
+
+  layout->id = entry->id;
+  layout->size = entry->size;
+  layout->nr_descs = entry->nr_descs;
+  if (layout->id != msg->msgh_id
+      || layout->size != msg->msgh_size
+      || layout->nr_descs == 0
+      || layout->nr_descs > LAYOUT_MAX_DESCS)
+    return 0;
+
+  memcpy (layout->descs, entry->descs,
+          layout->nr_descs * sizeof layout->descs[0]);
+
+  __atomic_thread_fence (__ATOMIC_ACQUIRE);
+  if (__atomic_load_n (&entry->seq, __ATOMIC_RELAXED) != seq)
+    return 0;
+
+  /* Every type descriptor must say the same thing as before, or
+     the ones after it may have moved.  */
+  for (i = 0; i < layout->nr_descs; i++)
+    {
+      layout_desc_words (base + layout->descs[i].offset,
+                         layout->descs[i].longform, words);
+      if (memcmp (words, layout->descs[i].words, sizeof words))
+        return 0;
+    }
+
+  return 1;
+}
+
+/* Remember LAYOUT, unless somebody else is updating its entry.  */
+__attribute__ ((visibility("hidden")))
+void
+layout_store (struct portproxy_layout_cache *cache,
+              const struct layout *layout)
+{
+  struct layout *entry = layout_entry (cache, layout->id);
+  unsigned int seq;
+
+  seq = __atomic_load_n (&entry->seq, __ATOMIC_RELAXED);
+  if (seq & 1)
+    return;
+  if (!__atomic_compare_exchange_n (&entry->seq, &seq, seq + 1, 0,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    return;
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+
+  entry->id = layout->id;
+  entry->size = layout->size;
+  entry->nr_descs = layout->nr_descs;
+  memcpy (entry->descs, layout->descs,
+          layout->nr_descs * sizeof layout->descs[0]);
+
+  __atomic_store_n (&entry->seq, seq + 2, __ATOMIC_RELEASE);
+}
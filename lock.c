@@ -0,0 +1,65 @@
+#include "portproxy.h"
+#include "private.h"
+
+/* Take LOCK for reading, or for writing if WRITE, sleeping for as long
+   as it takes.  */
+static void
+lock_wait (unsigned int *lock, int write)
+{
+  unsigned int v;
+
+  while (1)
+    {
+      v = __atomic_load_n (lock, __ATOMIC_RELAXED);
+
+      if (write
+          ? (v & ~PORTPROXY_LOCK_SLEEPERS) == 0
+          : !(v & PORTPROXY_LOCK_WRITER))
+        {
+          if (__atomic_compare_exchange_n (lock, &v,
+                                           write
+                                           ? v | PORTPROXY_LOCK_WRITER
+                                           : v + 1,
+                                           1, __ATOMIC_ACQUIRE,
+                                           __ATOMIC_RELAXED))
+            return;
+          continue;
+        }
+
+      /* Let whoever releases the lock know that they have to wake
+         us up.  */
+      if (!(v & PORTPROXY_LOCK_SLEEPERS)
+          && !__atomic_compare_exchange_n (lock, &v,
+                                           v | PORTPROXY_LOCK_SLEEPERS,
+                                           1, __ATOMIC_RELAXED,
+                                           __ATOMIC_RELAXED))
+        continue;
+
+      gsync_wait (mach_task_self (), (vm_offset_t) lock,
+                  v | PORTPROXY_LOCK_SLEEPERS, 0, 0, 0);
+    }
+}
+
+void
+portproxy_lock_slow (unsigned int *lock, int write)
+{
+  struct histograms *h = histograms_get ();
+  uint64_t start;
+
+  if (!h)
+    {
+      lock_wait (lock, write);
+      return;
+    }
+
+  start = hist_now ();
+  lock_wait (lock, write);
+  hist_record (&h->proxy_wait[write], start);
+}
+
+/* Wake up everybody sleeping on LOCK, which has just been released.  */
+void
+portproxy_lock_wake (unsigned int *lock)
+{
+  gsync_wake (mach_task_self (), (vm_offset_t) lock, 0, GSYNC_BROADCAST);
+}
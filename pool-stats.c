@@ -0,0 +1,35 @@
+#include "portproxy.h"
+#include "private.h"
+
+unsigned int
+portproxy_pool_stats (struct portproxy_pool_stats *stats, unsigned int n)
+{
+  struct portproxy_domain *domain;
+  struct portproxy_pool *pool;
+  unsigned int d, i = 0;
+
+  for (d = 0; d < __atomic_load_n (&nr_domains, __ATOMIC_ACQUIRE); d++)
+    {
+      domain = domains[d];
+      pthread_mutex_lock (&domain->pools_lock);
+
+      for (pool = domain->pools; pool; pool = pool->next, i++)
+        {
+          if (i >= n)
+            continue;
+
+          pthread_mutex_lock (&pool->lock);
+          stats[i].port_class = pool->port_class;
+          stats[i].size = pool->size;
+          stats[i].allocated = pool->allocated;
+          stats[i].freed = pool->freed;
+          stats[i].malloced = pool->malloced;
+          stats[i].cached = pool->cached;
+          pthread_mutex_unlock (&pool->lock);
+        }
+
+      pthread_mutex_unlock (&domain->pools_lock);
+    }
+
+  return i;
+}
@@ -0,0 +1,50 @@
+#include <stdlib.h>
+
+#include "portproxy.h"
+#include "private.h"
+
+size_t
+portproxy_pool_trim (void)
+{
+  struct portproxy_domain *domain;
+  struct portproxy_pool *pool;
+  struct magazine *full, *empty, *mag;
+  size_t released = 0;
+  unsigned int d;
+
+  for (d = 0; d < __atomic_load_n (&nr_domains, __ATOMIC_ACQUIRE); d++)
+    {
+      domain = domains[d];
+      pthread_mutex_lock (&domain->pools_lock);
+
+      for (pool = domain->pools; pool; pool = pool->next)
+        {
+          pthread_mutex_lock (&pool->lock);
+          full = pool->full;
+          empty = pool->empty;
+          pool->full = NULL;
+          pool->empty = NULL;
+          pool->cached = 0;
+          pthread_mutex_unlock (&pool->lock);
+
+          while ((mag = full))
+            {
+              full = mag->next;
+              released += pool->size * mag->rounds;
+              while (mag->rounds)
+                free (mag->objs[--mag->rounds]);
+              free (mag);
+            }
+
+          while ((mag = empty))
+            {
+              empty = mag->next;
+              free (mag);
+            }
+        }
+
+      pthread_mutex_unlock (&domain->pools_lock);
+    }
+
+  return released;
+}
@@ -0,0 +1,368 @@
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "portproxy.h"
+#include "private.h"
+
+#define POOL_CACHE_SLOTS 4
+
+/* A thread's magazines for one pool.  */
+struct pool_cache
+{
+  struct portproxy_pool *pool;
+  struct magazine *loaded;
+  struct magazine *previous;
+  unsigned long allocated;
+  unsigned long freed;
+  unsigned long malloced;
+};
+
+static __thread struct pool_cache pool_caches[POOL_CACHE_SLOTS];
+static __thread int pool_caches_registered;
+/* Set once this thread's magazines have been handed back on its way
+   out; it can't have any again.  */
+static __thread int pool_caches_released;
+static pthread_key_t pool_caches_key;
+static pthread_once_t pool_caches_key_once = PTHREAD_ONCE_INIT;
+static error_t pool_caches_key_error;
+
+/* Fold CACHE's counts into its pool.
+   Must be called with the pool's lock held.  */
+static void
+pool_cache_fold (struct pool_cache *cache)
+{
+  cache->pool->allocated += cache->allocated;
+  cache->pool->freed += cache->freed;
+  cache->pool->malloced += cache->malloced;
+  cache->allocated = 0;
+  cache->freed = 0;
+  cache->malloced = 0;
+}
+
+/* Return a magazine to POOL's depot.
+   Must be called with the pool's lock held.  */
+static void
+depot_put (struct portproxy_pool *pool, struct magazine *mag)
+{
+  if (mag->rounds)
+    {
+      mag->next = pool->full;
+      pool->full = mag;
+      pool->cached += mag->rounds;
+    }
+  else
+    {
+      mag->next = pool->empty;
+      pool->empty = mag;
+    }
+}
+
+/* Hand CACHE's magazines back to the depot, and forget about its pool.  */
+static void
+pool_cache_flush (struct pool_cache *cache)
+{
+  struct portproxy_pool *pool = cache->pool;
+
+  if (!pool)
+    return;
+
+  pthread_mutex_lock (&pool->lock);
+  pool_cache_fold (cache);
+  if (cache->loaded)
+    depot_put (pool, cache->loaded);
+  if (cache->previous)
+    depot_put (pool, cache->previous);
+  pthread_mutex_unlock (&pool->lock);
+
+  cache->pool = NULL;
+  cache->loaded = NULL;
+  cache->previous = NULL;
+}
+
+/* Destructor of pool_caches_key.  Destructors of other keys may still
+   free proxies after this, and those go straight to the depot.  */
+static void
+pool_caches_release (void *arg)
+{
+  struct pool_cache *caches = arg;
+  int i;
+
+  pool_caches_released = 1;
+  for (i = 0; i < POOL_CACHE_SLOTS; i++)
+    pool_cache_flush (&caches[i]);
+}
+
+/* Put PROXY into a magazine of POOL's depot, for a thread that has no
+   magazines of its own.  Returns zero if there's no magazine for it
+   and none can be allocated.  */
+static int
+depot_free (struct portproxy_pool *pool, struct portproxy *proxy)
+{
+  struct magazine *mag;
+
+  pthread_mutex_lock (&pool->lock);
+  mag = pool->full;
+  if (!mag || mag->rounds == MAGAZINE_SIZE)
+    {
+      mag = pool->empty;
+      if (mag)
+        pool->empty = mag->next;
+      else
+        {
+          pthread_mutex_unlock (&pool->lock);
+          mag = malloc (sizeof *mag);
+          if (!mag)
+            return 0;
+          mag->rounds = 0;
+          pthread_mutex_lock (&pool->lock);
+        }
+      mag->next = pool->full;
+      pool->full = mag;
+    }
+
+  mag->objs[mag->rounds++] = proxy;
+  pool->cached++;
+  pool->freed++;
+  pthread_mutex_unlock (&pool->lock);
+  return 1;
+}
+
+static void
+create_pool_caches_key (void)
+{
+  pool_caches_key_error = pthread_key_create (&pool_caches_key,
+                                              pool_caches_release);
+}
+
+/* Find or create DOMAIN's pool for objects of SIZE bytes in
+   PORT_CLASS.  */
+static struct portproxy_pool *
+pool_get (struct portproxy_domain *domain,
+          struct port_class *port_class, size_t size)
+{
+  struct portproxy_pool *pool;
+
+  pthread_mutex_lock (&domain->pools_lock);
+
+  for (pool = domain->pools; pool; pool = pool->next)
+    if (pool->port_class == port_class && pool->size == size)
+      break;
+
+  if (!pool)
+    {
+      pool = calloc (1, sizeof *pool);
+      if (pool)
+        {
+          pool->domain = domain;
+          pool->port_class = port_class;
+          pool->size = size;
+          pthread_mutex_init (&pool->lock, NULL);
+          pool->next = domain->pools;
+          domain->pools = pool;
+        }
+    }
+
+  pthread_mutex_unlock (&domain->pools_lock);
+  return pool;
+}
+
+/* Get this thread's magazines for the pool of DOMAIN that matches
+   PORT_CLASS and SIZE, or for POOL if it's given.  Returns NULL if this
+   thread can't have any.  */
+static struct pool_cache *
+pool_cache_get (struct portproxy_domain *domain,
+                struct port_class *port_class, size_t size,
+                struct portproxy_pool *pool)
+{
+  struct pool_cache *cache;
+  int i;
+
+  if (pool_caches_released)
+    return NULL;
+
+  for (i = 0; i < POOL_CACHE_SLOTS; i++)
+    {
+      cache = &pool_caches[i];
+      if (pool ? cache->pool == pool
+          : (cache->pool && cache->pool->domain == domain
+             && cache->pool->port_class == port_class
+             && cache->pool->size == size))
+        return cache;
+    }
+
+  if (!pool_caches_registered)
+    {
+      /* Make sure our magazines get returned when this thread exits.  */
+      pthread_once (&pool_caches_key_once, create_pool_caches_key);
+      if (pool_caches_key_error
+          || pthread_setspecific (pool_caches_key, pool_caches))
+        return NULL;
+      pool_caches_registered = 1;
+    }
+
+  if (!pool)
+    pool = pool_get (domain, port_class, size);
+  if (!pool)
+    return NULL;
+
+  /* Take over a free slot, or evict one.  */
+  for (i = 0; i < POOL_CACHE_SLOTS; i++)
+    if (!pool_caches[i].pool)
+      break;
+  if (i == POOL_CACHE_SLOTS)
+    {
+      i = ((uintptr_t) pool / sizeof *pool) % POOL_CACHE_SLOTS;
+      pool_cache_flush (&pool_caches[i]);
+    }
+
+  cache = &pool_caches[i];
+  cache->pool = pool;
+  return cache;
+}
+
+/* Allocate a proxy of SIZE bytes for PORT_CLASS in DOMAIN.  */
+__attribute__ ((visibility("hidden")))
+void *
+pool_alloc (struct portproxy_domain *domain,
+            struct port_class *port_class, size_t size)
+{
+  struct pool_cache *cache;
+  struct portproxy_pool *pool;
+  struct magazine *mag;
+  struct portproxy *proxy;
+
+  cache = pool_cache_get (domain, port_class, size, NULL);
+  if (!cache)
+    {
+      /* Bypass the magazines, but still go by the pool, which proxies
+         find their domain through.  */
+      pool = pool_get (domain, port_class, size);
+      if (!pool)
+        {
+          errno = ENOMEM;
+          return NULL;
+        }
+
+      proxy = malloc (size);
+      if (!proxy)
+        return NULL;
+      proxy->pool = pool;
+
+      pthread_mutex_lock (&pool->lock);
+      pool->allocated++;
+      pool->malloced++;
+      pthread_mutex_unlock (&pool->lock);
+      return proxy;
+    }
+
+  pool = cache->pool;
+
+  if (!cache->loaded || cache->loaded->rounds == 0)
+    {
+      if (cache->previous && cache->previous->rounds > 0)
+        {
+          mag = cache->loaded;
+          cache->loaded = cache->previous;
+          cache->previous = mag;
+        }
+      else
+        {
+          pthread_mutex_lock (&pool->lock);
+          pool_cache_fold (cache);
+          mag = pool->full;
+          if (mag)
+            {
+              pool->full = mag->next;
+              pool->cached -= mag->rounds;
+              /* The previous magazine is empty, give it back.  */
+              if (cache->previous)
+                depot_put (pool, cache->previous);
+              cache->previous = cache->loaded;
+              cache->loaded = mag;
+            }
+          pthread_mutex_unlock (&pool->lock);
+
+          if (!mag)
+            {
+              /* The depot is empty too.  */
+              proxy = malloc (size);
+              if (!proxy)
+                return NULL;
+              cache->allocated++;
+              cache->malloced++;
+              proxy->pool = pool;
+              return proxy;
+            }
+        }
+    }
+
+  proxy = cache->loaded->objs[--cache->loaded->rounds];
+  cache->allocated++;
+  return proxy;
+}
+
+/* Give PROXY back to the pool it was allocated from.  */
+__attribute__ ((visibility("hidden")))
+void
+pool_free (void *arg)
+{
+  struct portproxy *proxy = arg;
+  struct portproxy_pool *pool = proxy->pool;
+  struct pool_cache *cache;
+  struct magazine *mag;
+
+  cache = pool_cache_get (NULL, NULL, 0, pool);
+  if (!cache)
+    {
+      if (pool_caches_released && depot_free (pool, proxy))
+        return;
+      goto unpooled;
+    }
+
+  if (!cache->loaded || cache->loaded->rounds == MAGAZINE_SIZE)
+    {
+      if (cache->previous && cache->previous->rounds < MAGAZINE_SIZE)
+        {
+          mag = cache->loaded;
+          cache->loaded = cache->previous;
+          cache->previous = mag;
+        }
+      else
+        {
+          pthread_mutex_lock (&pool->lock);
+          pool_cache_fold (cache);
+          mag = pool->empty;
+          if (mag)
+            pool->empty = mag->next;
+          pthread_mutex_unlock (&pool->lock);
+
+          if (!mag)
+            {
+              mag = malloc (sizeof *mag);
+              if (!mag)
+                goto unpooled;
+              mag->rounds = 0;
+            }
+
+          /* The previous magazine is full, give it back.  */
+          if (cache->previous)
+            {
+              pthread_mutex_lock (&pool->lock);
+              depot_put (pool, cache->previous);
+              pthread_mutex_unlock (&pool->lock);
+            }
+          cache->previous = cache->loaded;
+          cache->loaded = mag;
+        }
+    }
+
+  cache->loaded->objs[cache->loaded->rounds++] = proxy;
+  cache->freed++;
+  return;
+
+ unpooled:
+  pthread_mutex_lock (&pool->lock);
+  pool->freed++;
+  pthread_mutex_unlock (&pool->lock);
+  free (proxy);
+}
@@ -1,4 +1,6 @@
 #include <error.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <hurd/ports.h>
 #include <refcount.h>
 
@@ -19,15 +21,337 @@ struct portproxy
     {
       refcount_t refcount;
       mach_port_t port;
-      hurd_ihash_locp_t locp;
+      struct portproxy_pool *pool;
       void (*clean_routine) (void *);
     };
   };
-  enum portproxy_type type;
-  pthread_rwlock_t lock;
+  unsigned char type;           /* An enum portproxy_type.  */
+  unsigned char flags;          /* See portproxy_set_flags () below.  */
+  unsigned int lock;            /* See portproxy_rdlock () below.  */
   struct portproxy *migrated;
+  union
+  {
+    mach_port_t name;           /* Receive proxies: where it's indexed.  */
+    unsigned int urefs;         /* Send proxies: user references held.  */
+  };
+};
+
+/* There can be hundreds of thousands of proxies, and the user's data
+   comes right after this, so keep it down to what libports needs plus
+   the type and flags (which share a word) and the lock, the migrated
+   pointer, and one more word (which gets padded to a pointer on 64-bit
+   systems).  Receive proxies have to remember the name they are
+   indexed under, since libports forgets it before their clean routine
+   runs.  Send proxies instead count the user references to their send
+   right they hold, so that those copied in again can be handed back
+   out with MACH_MSG_TYPE_MOVE_SEND.  */
+_Static_assert (sizeof (struct portproxy)
+                <= sizeof (struct port_info)
+                   + 2 * sizeof (unsigned int) + 2 * sizeof (void *),
+                "struct portproxy is over its size budget");
+
+/* Set the number of shards send proxies of the default domain are
+   spread over; zero picks a default based on the number of processors.
+   If called at all, this must be called before any other function;
+   otherwise, returns EBUSY.  */
+error_t
+portproxy_init (unsigned int shards);
+
+/* Proxy domains.  A domain has its own tables for looking proxies up,
+   its own pools to allocate them from, and its own statistics, so that
+   independent proxies in the same task, such as those of different
+   translators, don't contend with each other.  The proxies of the ports
+   in a bucket, and the send and send-once proxies created by copying
+   rights in and out with that bucket, belong to the domain the bucket
+   was given to, if any, or else to the default domain; so the domain
+   comes along with the bucket passed to portproxy_copyin (),
+   portproxy_copyout () and the functions built on them.  The same send
+   right gets a proxy of its own in each domain it is copied into.
+   Domains are never destroyed.  */
+struct portproxy_domain;
+
+/* Create a domain with SHARDS shards for its send proxies, or as many as
+   portproxy_init () would pick if zero.  Returns ENOSPC if there are as
+   many domains as there can be (16, counting the default one).  */
+error_t
+portproxy_domain_create (unsigned int shards,
+                         struct portproxy_domain **domain);
+
+/* Give BUCKET to DOMAIN.  This must be done before any port is created
+   in BUCKET, or any right copied in or out with it.  Returns EEXIST if
+   BUCKET already belongs to another domain, and ENOSPC if 64 buckets
+   have already been given to domains.  */
+error_t
+portproxy_domain_add_bucket (struct portproxy_domain *domain,
+                             struct port_bucket *bucket);
+
+/* Have threads serving DOMAIN run on the processors of PSET (the
+   control port of a processor set, which the caller keeps), so that its
+   tables and proxies stay in their caches: portproxy_server () threads
+   for its buckets assign themselves to PSET when they start.  Threads
+   that are already running aren't moved.  MACH_PORT_NULL unpins it.  */
+void
+portproxy_domain_pin (struct portproxy_domain *domain, processor_set_t pset);
+
+/* Store the number of send proxies in each of the first N shards
+   of the default domain into COUNTS, and return the total number of
+   shards.  */
+unsigned int
+portproxy_shard_occupancy (size_t *counts, unsigned int n);
+
+/* Likewise for DOMAIN, or the default domain if NULL.  */
+unsigned int
+portproxy_domain_shard_occupancy (struct portproxy_domain *domain,
+                                  size_t *counts, unsigned int n);
+
+/* Make room in the tables send proxies of the default domain are
+   indexed in for N of them, so that they don't have to grow while that
+   many are being created.  Tables still grow as needed otherwise, but
+   without stopping everything to do it: the proxies of the old table
+   are moved over to the new one a few at a time, as more are added.  */
+error_t
+portproxy_reserve (size_t n);
+
+/* Likewise for DOMAIN, or the default domain if NULL.  */
+error_t
+portproxy_domain_reserve (struct portproxy_domain *domain, size_t n);
+
+struct portproxy_pool_stats
+{
+  struct port_class *port_class;
+  size_t size;
+  unsigned long allocated;      /* Proxies handed out.  */
+  unsigned long freed;          /* Proxies given back.  */
+  unsigned long malloced;       /* Allocations the pool couldn't serve.  */
+  size_t cached;                /* Free proxies held in the depot.  */
+};
+
+/* Store the counters of the first N proxy pools, those of all domains,
+   into STATS, and return the total number of pools.  Counts made by a
+   thread are only folded in when it exchanges magazines with the depot,
+   so they may lag a little behind.  */
+unsigned int
+portproxy_pool_stats (struct portproxy_pool_stats *stats, unsigned int n);
+
+/* Release the free proxies held in the pools' depots back to the system,
+   and return the number of bytes released.  */
+size_t
+portproxy_pool_trim (void);
+
+struct portproxy_stats
+{
+  unsigned long created[4];     /* By enum portproxy_type.  */
+  unsigned long destroyed[4];
+  unsigned long live;           /* Proxies created and not destroyed.  */
+  size_t live_bytes;            /* Of those, send and send-once ones.  */
+  unsigned long lookup_hits;    /* Send right copyins that found a proxy.  */
+  unsigned long lookup_misses;  /* Send right copyins that made one.  */
+  unsigned long migrations;
+  unsigned long chases;         /* portproxy_chase ()s that took a hop.  */
+  unsigned long chase_hops;
+  unsigned long copyout_rejected;  /* Copyouts with KERN_INVALID_RIGHT.  */
+  unsigned long thread_cache_hits;  /* Lookups the thread cache answered.  */
+  unsigned long thread_cache_misses;
+  unsigned long splits;         /* Reference counts split for being hot.  */
+  unsigned long split_collapses;  /* And put back together.  */
+};
+
+/* Add up the counters of all threads for the default domain into
+   SNAPSHOT, and store the lookup hits and misses of each of the first N
+   shards into HITS and MISSES, unless NULL.  Returns the total number of
+   shards.  This doesn't stop other threads, so the counters may be a
+   little out of step with each other.  If the library was built with
+   PORTPROXY_DISABLE_STATS, all counters read as zero.  */
+unsigned int
+portproxy_stats_snapshot (struct portproxy_stats *snapshot,
+                          unsigned long *hits, unsigned long *misses,
+                          unsigned int n);
+
+/* Likewise for DOMAIN, or the default domain if NULL.  */
+unsigned int
+portproxy_domain_stats_snapshot (struct portproxy_domain *domain,
+                                 struct portproxy_stats *snapshot,
+                                 unsigned long *hits, unsigned long *misses,
+                                 unsigned int n);
+
+/* Store the number of portproxy_chase () calls that took I + 1 hops
+   into COUNTS[I], for the first N lengths, and return the number of
+   lengths kept track of; the last one also counts any longer chains.  */
+unsigned int
+portproxy_chase_lengths (unsigned long *counts, unsigned int n);
+
+/* Start or stop recording histograms of how long portproxy_copyin ()
+   and portproxy_copyout () take, by right type, and of how long they
+   wait for shard locks (of the default domain) and proxy locks when
+   those are contended.  Enabling them starts over from zero.  While
+   they are disabled, all this costs is a branch.  */
+error_t
+portproxy_histograms_enable (int enable);
+
+/* Print the histograms recorded so far to STREAM; each line has the
+   lower bound of a bucket, which goes up to twice that, and its count.
+   Prints nothing if they are disabled.  */
+void
+portproxy_histograms_dump (FILE *stream);
+
+/* Turn the per-thread cache of recently looked up send proxies on or
+   off; it starts off.  With it on, each thread keeps the last few send
+   rights it copied in, by name, and finds their proxies again without
+   probing the shared tables.  Entries are invalidated whenever a proxy
+   in the same shard is destroyed or migrated, so this pays off when
+   the same few rights keep coming back.  The hit rate shows in
+   portproxy_stats_snapshot ().  */
+void
+portproxy_thread_cache_enable (int enable);
+
+/* Turn split reference counts on, checking every INTERVAL milliseconds
+   whether the send proxies that have them are still hot, or turn them
+   off with INTERVAL zero, the default.  With them on, a send proxy
+   whose reference count lookups keep contending on, such as the one
+   for a server almost every message goes to, gets a set of counters
+   spread over cache lines, which threads add to instead; it goes back
+   to its single count once it cools down.  portproxy_ref () and
+   portproxy_deref () work the same either way, except that the clean
+   routine of a proxy whose last reference is dropped while its count
+   is split is only called by the next check.  Proxies carry nothing
+   for this, whether on or off: the counters are only allocated while
+   split, about a kilobyte each, for at most 64 proxies at a time.  */
+error_t
+portproxy_split_refs (unsigned int interval);
+
+/* Split the reference count of the send proxy PROXY, which the caller
+   holds a reference to, as if it had been found to be hot.  Does
+   nothing unless split reference counts are on, or if it can't.  */
+void
+portproxy_ref_split (void *proxy);
+
+/* Tracing.  Each thread appends fixed-size binary records to a ring
+   buffer of its own, without taking any locks, and a writer thread
+   drains them into the trace file every so often; when a ring is full,
+   its records are dropped and counted instead of waiting for the
+   writer.  The file starts with a struct portproxy_trace_header, and
+   examples/trace-decode.c turns it into text.  */
+enum portproxy_trace_kind
+{
+  /* A message was received: id is its msgh_id, right its local port
+     and arg its size.  */
+  PORTPROXY_TRACE_MSG,
+
+  /* A right in the message last traced by the same thread was
+     translated: proxy identifies its proxy, disposition is the type
+     of right it was, right what it was translated to, and arg the
+     disposition it is sent on with.  */
+  PORTPROXY_TRACE_RIGHT,
+
+  /* Written by the writer: arg records of the thread were dropped.  */
+  PORTPROXY_TRACE_DROPPED,
+};
+
+struct portproxy_trace_record
+{
+  uint64_t time;                /* CLOCK_MONOTONIC, in nanoseconds.  */
+  uint32_t thread;              /* Numbered from zero, as threads trace.  */
+  uint16_t kind;                /* An enum portproxy_trace_kind.  */
+  uint16_t disposition;
+  int32_t id;
+  uint32_t proxy;
+  uint32_t right;
+  uint32_t arg;
 };
 
+#define PORTPROXY_TRACE_MAGIC "PPTRACE"
+#define PORTPROXY_TRACE_VERSION 1
+
+struct portproxy_trace_header
+{
+  char magic[8];                /* PORTPROXY_TRACE_MAGIC.  */
+  uint32_t version;             /* PORTPROXY_TRACE_VERSION.  */
+  uint32_t record_size;
+};
+
+/* Start tracing into a new file at PATH, with the writer draining the
+   rings every INTERVAL milliseconds, or as soon as one is half full.
+   Returns EBUSY if already tracing.  */
+error_t
+portproxy_trace_start (const char *path, unsigned int interval);
+
+/* Stop tracing, write out whatever has been traced, and close the
+   file.  Returns the first error writing to it, if any.  */
+error_t
+portproxy_trace_stop (void);
+
+/* Append a record of KIND with the given fields to this thread's ring,
+   if tracing.  */
+void
+portproxy_trace (enum portproxy_trace_kind kind, mach_msg_id_t id,
+                 unsigned int proxy, mach_port_t right,
+                 unsigned int disposition, unsigned int arg);
+
+/* Return how many records have been dropped since tracing started.  */
+unsigned long
+portproxy_trace_dropped (void);
+
+/* Defer dropping the send rights of proxies that are destroyed, and
+   the extra ones that portproxy_copyin () finds proxies for, and drop
+   them in batches instead, with the user references to the same name
+   added up into a single call.  Each thread keeps up to MAX_PENDING
+   names (at most 64) pending; once it has that many, they are dropped
+   by a reaper thread, which is started the first time MAX_DELAY is
+   non-zero, or else by the thread itself.  With MAX_DELAY non-zero,
+   the reaper also drops everything pending at least every MAX_DELAY
+   milliseconds.  MAX_PENDING zero, the default, drops rights right
+   away.  */
+error_t
+portproxy_deferred_dealloc (unsigned int max_pending,
+                            unsigned int max_delay);
+
+/* Drop all send rights whose deallocation is pending, for example
+   before going idle.  */
+void
+portproxy_dealloc_flush (void);
+
+/* Enter and leave an epoch, inside of which proxies can be borrowed
+   with portproxy_borrow (): used without a reference or a lock, which
+   saves writing to memory other threads working on the same proxies
+   keep reading.  Epochs nest, and should be short, like the time it
+   takes to translate a message: the memory of proxies destroyed while
+   a thread is inside one is only freed after it leaves.  The last
+   reference to a proxy should not be dropped inside one, and since
+   leaving one may drop references put off by portproxy_deref_deferred
+   (), no proxy locks should be held then.  portproxy_epoch_enter ()
+   returns ENOMEM if this thread could not be set up for it.  */
+error_t
+portproxy_epoch_enter (void);
+
+void
+portproxy_epoch_exit (void);
+
+/* Copy in the send right RIGHT, if it has a send proxy that isn't being
+   set up, migrated or destroyed, and whose migrations lead to another
+   send proxy, if any, and return that one, borrowed until
+   portproxy_epoch_exit (); otherwise, leave RIGHT alone and return
+   NULL, and let portproxy_copyin () deal with it.  Must be called
+   inside an epoch.  A borrowed proxy may be copied out as a send right,
+   but must not be unlocked or released, nor passed to anything
+   expecting it to be locked; its user data should only be read.  Since
+   borrowers may see a proxy as it was just before its last reference
+   went away, whatever its data points to must stay around until they
+   are done, for example by dropping references to other proxies with
+   portproxy_deref_deferred ().  */
+void *
+portproxy_borrow (mach_port_t right);
+
+/* Likewise, for a send proxy in DOMAIN, or in the default domain if
+   NULL.  */
+void *
+portproxy_domain_borrow (struct portproxy_domain *domain, mach_port_t right);
+
+/* Drop a reference to PROXY like portproxy_deref (), but once threads
+   that may have borrowed something leading to it have left their
+   epochs.  */
+void
+portproxy_deref_deferred (void *proxy);
+
 error_t
 portproxy_copyin_request_port (void *proxy);
 
@@ -40,6 +364,13 @@ portproxy_copyin (mach_port_t right,
                   void *existing,
                   void *created);
 
+/* When copying out a send right from a send proxy that holds more than
+   one user reference to it, *CONVERSION is MACH_MSG_TYPE_MOVE_SEND and
+   the reference is the caller's, to send or to deallocate; otherwise it
+   is MACH_MSG_TYPE_COPY_SEND.  It is always MACH_MSG_TYPE_COPY_SEND
+   from a translate hook of portproxy_translate_msg () called for a
+   port array of more than one right, so that the rights of the array
+   are all copied alike.  */
 error_t
 portproxy_copyout (void *existing,
                    mach_port_right_t required_type,
@@ -50,6 +381,245 @@ portproxy_copyout (void *existing,
                    mach_msg_type_name_t *conversion,
                    void *created);
 
+struct portproxy_copyin_entry
+{
+  mach_port_t right;
+  mach_port_right_t type;
+  void *existing;
+  void *created;
+  error_t err;
+};
+
+/* Copy in the N rights in ENTRIES as if by calling portproxy_copyin ()
+   on each, but look the send proxies up shard by shard, taking each
+   shard's lock at most once.  Only send and send-once rights can be
+   batched.  Created proxies are returned write-locked, as usual; but
+   since the same proxy can turn up more than once in a batch, existing
+   ones are returned referenced and unlocked, and must be locked with
+   portproxy_rdlock () and then portproxy_chase ()'d when it is their
+   turn.  Returns the first error, if any; the error for each entry is
+   in its err field.  */
+error_t
+portproxy_copyin_batch (struct portproxy_copyin_entry *entries,
+                        size_t n,
+                        struct port_class *port_class,
+                        struct port_bucket *bucket,
+                        size_t size);
+
+struct portproxy_copyout_entry
+{
+  void *existing;
+  mach_port_right_t required_type;
+  mach_port_t right;
+  mach_msg_type_name_t conversion;
+  void *created;
+  error_t err;
+};
+
+/* Copy out the N entries in ENTRIES as if by calling portproxy_copyout ()
+   on each, but put the send proxies created for receive rights into
+   their tables shard by shard.  The receive proxies whose rights are
+   claimed are write-locked in order of address, whatever their order
+   in ENTRIES.  Returns the first error, if any; the error for each
+   entry is in its err field.  */
+error_t
+portproxy_copyout_batch (struct portproxy_copyout_entry *entries,
+                         size_t n,
+                         struct port_class *port_class,
+                         struct port_bucket *bucket,
+                         size_t size);
+
+struct portproxy_translator
+{
+  struct port_class *port_class;
+  struct port_bucket *bucket;
+  size_t size;
+
+  /* Called on each proxy created while copying in a right, while it is
+     still write-locked, along with the proxy it replaces, if any (which
+     is released afterwards).  This is where user data gets set up or
+     migrated over.  May be NULL.  */
+  void (*init) (void *created, void *existing, void *hook);
+
+  /* Called on the locked and referenced proxy each port right in a
+     message has been copied into; should store the right to put into
+     the message in its place into *RIGHT, and how to send it into
+     *CONVERSION.  PROXY is unlocked and released afterwards, so
+     whatever keeps it alive must hold its own reference.  */
+  error_t (*translate) (void *proxy,
+                        mach_port_right_t type,
+                        mach_port_t *right,
+                        mach_msg_type_name_t *conversion,
+                        void *hook);
+
+  void *hook;
+
+  /* Where to remember message layouts; may be NULL.  */
+  struct portproxy_layout_cache *layout_cache;
+
+  /* If non-zero, send rights that already have a proxy are translated
+     with the proxy borrowed, inside an epoch, instead of locked and
+     referenced; see portproxy_borrow () for what translate may do with
+     it then.  */
+  int borrow;
+};
+
+/* A cache of where the port rights are in messages of each msgh_id, so
+   that translating a message doesn't need to decode all of its type
+   descriptors when it looks like the last one with the same id.  It can
+   be shared between threads.  */
+struct portproxy_layout_cache;
+
+struct portproxy_layout_cache *
+portproxy_layout_cache_create (void);
+
+void
+portproxy_layout_cache_destroy (struct portproxy_layout_cache *cache);
+
+/* Look up the receive proxy the message MSG was received on, in BUCKET
+   and of PORT_CLASS, and return it referenced, or NULL.  Receive
+   proxies are created with their protected payload pointing to them,
+   so with kernels that support it, this is found without any hash
+   table lookup or lock; otherwise, MSG has the name of the port,
+   which is looked up as usual.  */
+static inline void *
+portproxy_lookup_local (const mach_msg_header_t *msg,
+                        struct port_bucket *bucket,
+                        struct port_class *port_class)
+{
+  if (MACH_MSGH_BITS_LOCAL (msg->msgh_bits)
+      == MACH_MSG_TYPE_PROTECTED_PAYLOAD)
+    return ports_lookup_payload (bucket, msg->msgh_protected_payload,
+                                 port_class);
+
+  return ports_lookup_port (bucket, msg->msgh_local_port, port_class);
+}
+
+/* Rewrite the received message MSG in place for sending it on: copy
+   each port right in it (the header ports, as well as inline and
+   out-of-line port arrays) in with TRANSLATOR's port class and bucket,
+   and replace it with what TRANSLATOR's translate hook says.
+   Out-of-line memory is left as it is, and marked to be deallocated
+   when the message is sent, so that the kernel moves it along rather
+   than copying it.  The local port must be one of our receive
+   proxies.  On error, the rights translated so far, header ports
+   included, are dropped and cleared from MSG, as is a right that was
+   copied in but could not be translated; the others are left as they
+   were received, so that MSG can be destroyed with mach_msg_destroy ().
+   The header bits and the types of the port arrays that were
+   translated may have been rewritten by then.  */
+error_t
+portproxy_translate_msg (mach_msg_header_t *msg,
+                         const struct portproxy_translator *translator);
+
+/* Flags of a proxy, for filters to go by.  Those of a receive proxy
+   carry over to the send proxy it turns into, and back.  */
+#define PORTPROXY_FLAG_TRACE 0x01       /* Messages to it always pass.  */
+#define PORTPROXY_FLAG_QUIET 0x02       /* Messages to it never do.  */
+
+/* Set the flags SET of PROXY, and clear those in CLEAR.  Can be called
+   on a proxy in use.  */
+void
+portproxy_set_flags (void *proxy, unsigned int set, unsigned int clear);
+
+/* A message filter: a set of msgh_ids, kept as bitmaps covering 4096
+   ids each, so that looking one up takes a hash probe and a bit test.
+   Adding and removing ids can go on while other threads look them up.
+   A message passes a filter if its id is in it, unless the proxy it
+   was received on says otherwise with its flags.  */
+struct portproxy_filter;
+
+struct portproxy_filter *
+portproxy_filter_create (void);
+
+/* Nobody may be using FILTER anymore.  */
+void
+portproxy_filter_destroy (struct portproxy_filter *filter);
+
+/* Add the ids from FIRST to LAST, inclusive, to FILTER.  Returns ENOSPC
+   if they are spread too widely for it to keep track of.  */
+error_t
+portproxy_filter_add (struct portproxy_filter *filter,
+                      mach_msg_id_t first, mach_msg_id_t last);
+
+void
+portproxy_filter_remove (struct portproxy_filter *filter,
+                         mach_msg_id_t first, mach_msg_id_t last);
+
+int
+portproxy_filter_match (const struct portproxy_filter *filter,
+                        mach_msg_id_t id);
+
+/* Return whether the message MSG that was just received, before it is
+   translated, passes FILTER.  The proxy it was received on is only
+   looked up, in TRANSLATOR's bucket, once any proxy has had its flags
+   set.  */
+int
+portproxy_filter_msg (const struct portproxy_filter *filter,
+                      const mach_msg_header_t *msg,
+                      const struct portproxy_translator *translator);
+
+struct portproxy_server_hooks
+{
+  /* Called on each message received, before it is translated.  If it
+     returns non-zero, the message is dropped instead.  May be NULL.  */
+  error_t (*received) (mach_msg_header_t *msg, void *hook);
+
+  /* Translates each message; NULL means portproxy_translate_msg ().
+     Whatever it leaves in the local port of the message is where it is
+     forwarded to.  */
+  error_t (*translate) (mach_msg_header_t *msg,
+                        const struct portproxy_translator *translator,
+                        void *hook);
+
+  /* Called on each message after it has been translated, right before
+     it is forwarded.  May be NULL.  */
+  void (*forwarding) (mach_msg_header_t *msg, void *hook);
+
+  /* Called on each message that is dropped because a hook or
+     translating it failed with ERR, or forwarding it did, before it is
+     destroyed.  If forwarding failed with anything else than
+     MACH_SEND_INVALID_DEST or MACH_SEND_TIMED_OUT, the kernel has
+     already taken or destroyed its rights and out-of-line memory, and
+     it isn't destroyed again.  May be NULL.  */
+  void (*dropped) (mach_msg_header_t *msg, error_t err, void *hook);
+
+  void *hook;
+
+  /* If not NULL, messages that don't pass this filter are destroyed
+     as soon as they are received, before any right in them is copied
+     in and without any of the hooks above or of the translator being
+     called.  */
+  const struct portproxy_filter *filter;
+};
+
+/* Receive messages on the port set of TRANSLATOR's bucket, translate
+   them, and forward them to where their local port now points, with
+   HOOKS (which may be NULL) called along the way.  Like
+   ports_manage_port_operations_multithread (), this runs on the calling
+   thread, and starts another one whenever the last idle thread gets a
+   message, up to MAX_THREADS (zero for no limit); those other threads
+   exit once they have been idle for THREAD_TIMEOUT milliseconds (zero
+   for never).  Each thread receives into a buffer of its own, which
+   grows to fit larger messages, and forwards a message and waits for
+   the next one in a single call to mach_msg ().  Only returns if
+   receiving fails for good, or if the calling thread can't get a
+   buffer.  */
+error_t
+portproxy_server (const struct portproxy_translator *translator,
+                  const struct portproxy_server_hooks *hooks,
+                  unsigned int max_threads,
+                  unsigned int thread_timeout);
+
+/* While its reference count is split, a send proxy has this bit set in
+   its refcount, on top of a bias that keeps it from dropping to zero;
+   references are then counted by portproxy_split_ref_add () instead.  */
+#define PORTPROXY_REF_SPLIT 0x80000000U
+#define PORTPROXY_REF_BIAS 0x40000000U
+
+void
+portproxy_split_ref_add (void *proxy, int delta);
+
 void
 portproxy_clean (void *proxy);
 
@@ -65,7 +635,11 @@ portproxy_ref (void *proxy)
       ports_port_ref (&p->pi);
       break;
     default:
-      refcount_ref (&p->refcount);
+      if (__builtin_expect (__atomic_load_n (&p->refcount, __ATOMIC_RELAXED)
+                            & PORTPROXY_REF_SPLIT, 0))
+        portproxy_split_ref_add (proxy, 1);
+      else
+        refcount_ref (&p->refcount);
       break;
     }
 }
@@ -81,8 +655,23 @@ portproxy_deref (void *proxy)
     case PORTPROXY_TYPE_RECEIVE_ONCE:
       ports_port_deref (&p->pi);
       break;
+    case PORTPROXY_TYPE_SEND_ONCE:
+      /* A send-once proxy nearly always has a single owner, who
+         doesn't need to synchronize with anybody to drop it.  */
+      if (__atomic_load_n (&p->refcount, __ATOMIC_ACQUIRE) == 1
+          || refcount_deref (&p->refcount) == 0)
+        {
+          if (p->clean_routine)
+            (*p->clean_routine) (proxy);
+          else
+            portproxy_clean (proxy);
+        }
+      break;
     default:
-      if (refcount_deref (&p->refcount) == 0)
+      if (__builtin_expect (__atomic_load_n (&p->refcount, __ATOMIC_RELAXED)
+                            & PORTPROXY_REF_SPLIT, 0))
+        portproxy_split_ref_add (proxy, -1);
+      else if (refcount_deref (&p->refcount) == 0)
         {
           if (p->clean_routine)
             (*p->clean_routine) (proxy);
@@ -93,12 +682,91 @@ portproxy_deref (void *proxy)
     }
 }
 
+/* Proxies are locked with a word-sized reader-writer lock, which
+   sleeps with gsync_wait ().  The lock word counts the readers holding
+   it, and has flags for a writer holding it and for threads sleeping
+   on it.  Like the default pthread_rwlock_t, it prefers readers.  */
+#define PORTPROXY_LOCK_WRITER   0x80000000U
+#define PORTPROXY_LOCK_SLEEPERS 0x40000000U
+#define PORTPROXY_LOCK_READERS  0x3fffffffU
+
+void
+portproxy_lock_slow (unsigned int *lock, int write);
+
+void
+portproxy_lock_wake (unsigned int *lock);
+
+static inline void
+portproxy_lock_read (unsigned int *lock)
+{
+  unsigned int v = __atomic_load_n (lock, __ATOMIC_RELAXED);
+
+  if (__builtin_expect (!(v & PORTPROXY_LOCK_WRITER), 1)
+      && __atomic_compare_exchange_n (lock, &v, v + 1, 1,
+                                      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    return;
+
+  portproxy_lock_slow (lock, 0);
+}
+
+static inline void
+portproxy_lock_write (unsigned int *lock)
+{
+  unsigned int v = 0;
+
+  if (__builtin_expect (__atomic_compare_exchange_n
+                          (lock, &v, PORTPROXY_LOCK_WRITER, 0,
+                           __ATOMIC_ACQUIRE, __ATOMIC_RELAXED), 1))
+    return;
+
+  portproxy_lock_slow (lock, 1);
+}
+
+/* Take LOCK for writing if nobody holds it, and return whether we did.  */
+static inline int
+portproxy_lock_trywrite (unsigned int *lock)
+{
+  unsigned int v = __atomic_load_n (lock, __ATOMIC_RELAXED);
+
+  if (v & ~PORTPROXY_LOCK_SLEEPERS)
+    return 0;
+
+  return __atomic_compare_exchange_n (lock, &v, v | PORTPROXY_LOCK_WRITER,
+                                      0, __ATOMIC_ACQUIRE,
+                                      __ATOMIC_RELAXED);
+}
+
+static inline void
+portproxy_lock_release (unsigned int *lock)
+{
+  unsigned int v = __atomic_load_n (lock, __ATOMIC_RELAXED);
+  unsigned int n;
+
+  do
+    if ((v & PORTPROXY_LOCK_WRITER)
+        || (v & PORTPROXY_LOCK_READERS) == 1)
+      n = 0;
+    else
+      n = v - 1;
+  while (!__atomic_compare_exchange_n (lock, &v, n, 1,
+                                       __ATOMIC_RELEASE,
+                                       __ATOMIC_RELAXED));
+
+  if (__builtin_expect ((v & PORTPROXY_LOCK_SLEEPERS) && n == 0, 0))
+    portproxy_lock_wake (lock);
+}
+
+/* Send-once proxies are only ever used by whoever copied the right in,
+   so they don't have a lock to take.  */
 static inline void
 portproxy_rdlock (void *proxy)
 {
   struct portproxy *p = proxy;
 
-  pthread_rwlock_rdlock (&p->lock);
+  if (p->type == PORTPROXY_TYPE_SEND_ONCE)
+    return;
+
+  portproxy_lock_read (&p->lock);
 }
 
 static inline void
@@ -106,7 +774,10 @@ portproxy_wrlock (void *proxy)
 {
   struct portproxy *p = proxy;
 
-  pthread_rwlock_wrlock (&p->lock);
+  if (p->type == PORTPROXY_TYPE_SEND_ONCE)
+    return;
+
+  portproxy_lock_write (&p->lock);
 }
 
 static inline void
@@ -114,7 +785,10 @@ portproxy_unlock (void *proxy)
 {
   struct portproxy *p = proxy;
 
-  pthread_rwlock_unlock (&p->lock);
+  if (p->type == PORTPROXY_TYPE_SEND_ONCE)
+    return;
+
+  portproxy_lock_release (&p->lock);
 }
 
 static inline mach_port_right_t
@@ -139,21 +813,19 @@ portproxy_conversion_to_type (mach_msg_type_name_t conversion)
     }
 }
 
+void *
+portproxy_chase_slow (void *proxy);
+
+/* Follow the migrations of the read-locked PROXY to the proxy that is
+   current, and return it read-locked instead.  Chains get shortened as
+   they are walked, so that stale proxies point at the current one.  */
 static inline void *
 portproxy_chase (void *proxy)
 {
   struct portproxy *p = proxy;
-  struct portproxy *next;
 
-  while (p->migrated)
-    {
-      next = p->migrated;
-      portproxy_ref (next);
-      portproxy_unlock (p);
-      portproxy_deref (p);
-      portproxy_rdlock (next);
-      p = next;
-    }
+  if (__builtin_expect (p->migrated == NULL, 1))
+    return p;
 
-  return p;
+  return portproxy_chase_slow (p);
 }
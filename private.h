@@ -1,5 +1,851 @@
 #include <pthread.h>
-#include <hurd/ihash.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
 
-extern struct hurd_ihash send_proxies[16];
-extern pthread_mutex_t send_proxies_lock[16];
+/* Take a reference on REF, unless it has already dropped to zero.  */
+static inline int
+refcount_ref_unless_zero (refcount_t *ref)
+{
+  unsigned int r = __atomic_load_n (ref, __ATOMIC_RELAXED);
+
+  do
+    if (r == 0)
+      return 0;
+  while (!__atomic_compare_exchange_n (ref, &r, r + 1, 1,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+
+  return 1;
+}
+
+/* Take a hard reference on REF, unless that has already dropped to
+   zero.  */
+static inline int
+refcounts_ref_unless_zero (refcounts_t *ref)
+{
+  union _references r, n;
+
+  r.value = __atomic_load_n (&ref->value, __ATOMIC_RELAXED);
+  do
+    {
+      if (r.references.hard == 0)
+        return 0;
+      n = r;
+      n.references.hard++;
+    }
+  while (!__atomic_compare_exchange_n (&ref->value, &r.value, n.value, 1,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+
+  return 1;
+}
+
+/* A slot of a proxy table.  A slot's name is set once, when the slot is
+   first used, and never changes afterwards; its proxy can be replaced,
+   or cleared when the proxy is removed.  */
+struct proxy_slot
+{
+  mach_port_t name;
+  struct portproxy *proxy;
+};
+
+/* An open-addressed table of proxies, keyed by port name.  Readers
+   may probe it without holding any locks, as long as they are inside an
+   epoch (see below); writers must hold the lock of the shard the table
+   belongs to.
+
+   Besides send proxies, which it's mostly about, it also indexes
+   receive proxies under the name of their receive right, so that an
+   incoming send right resolves to either kind in one probe.  libports
+   frees receive proxies without waiting for an epoch to end, so their
+   entries are tagged (see receive_entry ()), and may only be followed
+   with the shard's lock held.  Instead of being resized in place, a
+   table is replaced with a new one, which the entries of the old one
+   are moved over to a few at a time, by the writers that come after;
+   until they all are, the old one is kept up to date as well, and
+   readers that don't find a name in the new one look in the old one
+   too.  Then the old one is retired.  */
+struct proxy_table
+{
+  size_t mask;
+  size_t used;          /* Slots with a name set.  */
+  size_t count;         /* Proxies in it, counting those still in OLD.  */
+  struct proxy_table *old;      /* Still being moved over from, if any.  */
+  size_t moved;                 /* Slots of OLD moved over so far.  */
+  struct proxy_slot slots[];
+};
+
+/* Send proxies are spread over a number of shards, each with its own
+   table and lock.  */
+struct shard
+{
+  pthread_mutex_t lock;
+  struct proxy_table *table;
+  unsigned long generation;     /* See shard_invalidate ().  */
+  struct portproxy_domain *domain;
+} __attribute__ ((aligned (64)));
+
+/* A domain has shards, pools and statistics of its own.  The default
+   domain has the buckets that haven't been given to any other, and
+   gets its shards from portproxy_init () or on first use; the others
+   get theirs when they are created.  Domains are never destroyed.  */
+#define DOMAIN_MAX 16
+#define DOMAIN_BUCKETS_MAX 64
+
+struct portproxy_domain
+{
+  struct shard *shards;
+  unsigned int nr_shards;
+  unsigned int id;              /* Its index into thread_stats.  */
+  processor_set_t pset;         /* Where its servers run, if pinned.  */
+
+  struct portproxy_pool *pools;
+  pthread_mutex_t pools_lock;
+
+  struct stats *stats;          /* The records of all threads.  */
+};
+
+extern struct portproxy_domain default_domain;
+
+/* All domains, by id; the default one is the first.  Entries are filled
+   in before they are counted.  */
+extern struct portproxy_domain *domains[DOMAIN_MAX];
+extern unsigned int nr_domains;
+
+error_t
+domain_shards_setup (struct portproxy_domain *domain, unsigned int n);
+
+void
+shards_init (void);
+
+/* Buckets given to domains other than the default one.  Entries are
+   filled in before they are counted, and never taken out again.  */
+struct domain_bucket
+{
+  struct port_bucket *bucket;
+  struct portproxy_domain *domain;
+};
+
+extern struct domain_bucket domain_buckets[DOMAIN_BUCKETS_MAX];
+extern unsigned int nr_domain_buckets;
+
+/* The bucket each thread last looked the domain of up, and what it
+   found with the first NR_BUCKETS entries of domain_buckets.  Buckets
+   only ever move from the default domain to another one, when a new
+   entry is counted, so the result holds for as long as there are that
+   many.  */
+struct domain_cache
+{
+  struct port_bucket *bucket;
+  struct portproxy_domain *domain;
+  unsigned int nr_buckets;
+};
+
+extern __thread struct domain_cache domain_cache;
+
+struct portproxy_domain *
+domain_lookup_bucket (struct port_bucket *bucket, unsigned int n);
+
+void
+domain_pin_self (struct portproxy_domain *domain);
+
+/* Get the domain of BUCKET.  Costs a load and a branch until a bucket is
+   given to some other domain than the default one, and only searches
+   domain_buckets when asked about another bucket than last time.  */
+static inline struct portproxy_domain *
+domain_for_bucket (struct port_bucket *bucket)
+{
+  unsigned int n = __atomic_load_n (&nr_domain_buckets, __ATOMIC_ACQUIRE);
+
+  if (n == 0)
+    return &default_domain;
+
+  if (domain_cache.bucket == bucket && domain_cache.nr_buckets == n)
+    return domain_cache.domain;
+
+  return domain_lookup_bucket (bucket, n);
+}
+
+/* Statistics.  Each thread counts into a record of its own for each
+   domain, which only it writes to, and portproxy_stats_snapshot () adds
+   up those of a domain.  Records are never freed; the records of a
+   thread that has exited are reused by the next threads that need
+   them.  Defining PORTPROXY_DISABLE_STATS compiles the counting out.  */
+struct shard_stats
+{
+  unsigned long hits;
+  unsigned long misses;
+};
+
+struct stats
+{
+  struct stats *next;
+  int in_use;
+  unsigned long created[4];     /* By enum portproxy_type.  */
+  unsigned long destroyed[4];
+  unsigned long bytes_created;  /* Of send and send-once proxies.  */
+  unsigned long bytes_destroyed;
+  unsigned long migrations;
+  unsigned long chases;
+  unsigned long chase_hops;
+  unsigned long copyout_rejected;
+  unsigned long thread_cache_hits;
+  unsigned long thread_cache_misses;
+  unsigned long splits;
+  unsigned long split_collapses;
+  struct shard_stats *shards;   /* One for each shard, once needed.  */
+};
+
+extern __thread struct stats *thread_stats[DOMAIN_MAX];
+
+struct stats *
+stats_register (struct portproxy_domain *domain);
+
+struct shard_stats *
+stats_shards (struct portproxy_domain *domain, struct stats *stats);
+
+static inline void
+stat_add (unsigned long *counter, unsigned long n)
+{
+  __atomic_store_n (counter, __atomic_load_n (counter, __ATOMIC_RELAXED) + n,
+                    __ATOMIC_RELAXED);
+}
+
+#ifdef PORTPROXY_DISABLE_STATS
+
+#define STAT_ADD(domain, field, n) ((void) 0)
+#define STAT_SHARD(shard, field) ((void) 0)
+
+#else
+
+static inline struct stats *
+stats_self (struct portproxy_domain *domain)
+{
+  struct stats *stats = thread_stats[domain->id];
+
+  if (__builtin_expect (stats == NULL, 0))
+    stats = stats_register (domain);
+  return stats;
+}
+
+#define STAT_ADD(domain, field, n)                                      \
+  do                                                                    \
+    {                                                                   \
+      struct stats *__stats = stats_self (domain);                      \
+      if (__stats)                                                      \
+        stat_add (&__stats->field, (n));                                \
+    }                                                                   \
+  while (0)
+
+#define STAT_SHARD(shard, field)                                        \
+  do                                                                    \
+    {                                                                   \
+      struct portproxy_domain *__domain = (shard)->domain;              \
+      struct stats *__stats = stats_self (__domain);                    \
+      struct shard_stats *__shards;                                     \
+      if (__stats                                                       \
+          && (__shards = __stats->shards                                \
+                         ?: stats_shards (__domain, __stats)))          \
+        stat_add (&__shards[(shard) - __domain->shards].field, 1);      \
+    }                                                                   \
+  while (0)
+
+#endif
+
+/* Wait and latency histograms, in nanoseconds, log2-bucketed: bucket I
+   counts times in [2^I, 2^(I + 1)), and bucket 0 also counts zero.
+   HISTOGRAMS is NULL unless they are enabled; once allocated, they are
+   never freed, so whoever has seen the pointer can keep using it.  */
+#define HIST_BUCKETS 32
+
+struct hist
+{
+  unsigned long counts[HIST_BUCKETS];
+};
+
+struct histograms
+{
+  struct hist copyin[4];        /* By right type, see hist_right ().  */
+  struct hist copyout[4];
+  struct hist proxy_wait[2];    /* Read and write proxy lock waits.  */
+  struct hist shard_wait[];     /* One for each default domain shard.  */
+};
+
+extern struct histograms *histograms;
+
+/* Return the histograms to record into, or NULL if they're disabled.
+   This is all it costs when they are.  */
+static inline struct histograms *
+histograms_get (void)
+{
+  struct histograms *h = __atomic_load_n (&histograms, __ATOMIC_ACQUIRE);
+
+  if (__builtin_expect (h != NULL, 0))
+    return h;
+  return NULL;
+}
+
+static inline uint64_t
+hist_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Count the time since START in HIST.  */
+static inline void
+hist_record (struct hist *hist, uint64_t start)
+{
+  uint64_t ns = hist_now () - start;
+  unsigned int bucket = ns ? 63 - __builtin_clzll (ns) : 0;
+
+  if (bucket >= HIST_BUCKETS)
+    bucket = HIST_BUCKETS - 1;
+  __atomic_add_fetch (&hist->counts[bucket], 1, __ATOMIC_RELAXED);
+}
+
+/* The histogram index for a right of TYPE.  */
+static inline unsigned int
+hist_right (mach_port_right_t type)
+{
+  switch (type)
+    {
+    case MACH_PORT_RIGHT_SEND:
+      return 0;
+    case MACH_PORT_RIGHT_RECEIVE:
+      return 1;
+    case MACH_PORT_RIGHT_SEND_ONCE:
+      return 2;
+    default:
+      return 3;
+    }
+}
+
+void
+shard_lock_timed (struct histograms *h, struct shard *shard);
+
+/* Lock SHARD, timing the wait if it has to wait and histograms are
+   enabled.  */
+static inline void
+shard_lock (struct shard *shard)
+{
+  struct histograms *h = histograms_get ();
+
+  if (h)
+    shard_lock_timed (h, shard);
+  else
+    pthread_mutex_lock (&shard->lock);
+}
+
+/* Port names keep their generation number in the low bits, so mix them
+   before using them to pick a shard or a table slot.  */
+static inline uint32_t
+port_name_hash (mach_port_t name)
+{
+  uint32_t h = name;
+
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+
+  return h;
+}
+
+/* Get the shard of DOMAIN for the send proxy of NAME.  Shards are picked
+   by the high bits of the hash, tables slots by the low bits.  */
+static inline struct shard *
+shard_for_port (struct portproxy_domain *domain, mach_port_t name)
+{
+  struct shard *shards = __atomic_load_n (&domain->shards, __ATOMIC_ACQUIRE);
+
+  if (__builtin_expect (shards == NULL, 0))
+    {
+      shards_init ();
+      shards = domain->shards;
+    }
+
+  return &shards[((uint64_t) port_name_hash (name)
+                  * domain->nr_shards) >> 32];
+}
+
+struct portproxy *
+proxy_table_find (struct proxy_table **table, mach_port_t name);
+
+error_t
+proxy_table_reserve (struct proxy_table **table);
+
+error_t
+proxy_table_resize (struct proxy_table **table, size_t count);
+
+error_t
+proxy_table_add (struct proxy_table **table, mach_port_t name,
+                 struct portproxy *proxy);
+
+void
+proxy_table_remove (struct proxy_table **table, mach_port_t name,
+                    struct portproxy *proxy);
+
+int
+proxy_table_replace (struct proxy_table **table, mach_port_t name,
+                     struct portproxy *old, struct portproxy *proxy);
+
+/* The table entry for the receive proxy PROXY.  */
+static inline struct portproxy *
+receive_entry (struct portproxy *proxy)
+{
+  return (struct portproxy *) ((uintptr_t) proxy | 1);
+}
+
+/* Whether ENTRY, as found in a table, is that of a receive proxy.  */
+static inline int
+is_receive_entry (struct portproxy *entry)
+{
+  return (uintptr_t) entry & 1;
+}
+
+static inline struct portproxy *
+entry_proxy (struct portproxy *entry)
+{
+  return (struct portproxy *) ((uintptr_t) entry & ~(uintptr_t) 1);
+}
+
+/* Whether the receive proxy of ENTRY no longer has the receive right
+   NAME it was indexed under, so that its entry can be dropped.  Must be
+   called with the lock of the shard of NAME held.  */
+static inline int
+receive_entry_stale (struct portproxy *entry, mach_port_t name)
+{
+  struct portproxy *p = entry_proxy (entry);
+
+  return __atomic_load_n (&p->pi.port_right, __ATOMIC_RELAXED) != name;
+}
+
+error_t
+copyin_right (mach_port_t right,
+              mach_port_right_t type,
+              struct port_class *port_class,
+              struct port_bucket *bucket,
+              size_t size,
+              void *p_existing,
+              void *p_created);
+
+error_t
+send_proxy_lookup (struct shard *shard,
+                   mach_port_t right,
+                   struct port_class *port_class,
+                   struct port_bucket *bucket,
+                   size_t size,
+                   struct portproxy **existing,
+                   struct portproxy **created);
+
+/* Set while translating a port array of more than one right, so that
+   send proxies copied out for it hand out MACH_MSG_TYPE_COPY_SEND even
+   when they could move a reference, and the array doesn't have to be
+   turned into moved rights one trap at a time.  */
+extern __thread int copyout_copy_send;
+
+error_t
+copyout_receive_prepare (struct portproxy_domain *domain,
+                         struct portproxy *existing,
+                         struct port_class *port_class,
+                         size_t size,
+                         mach_port_t *right,
+                         struct portproxy **created);
+
+error_t
+copyout_receive_add (struct shard *shard,
+                     struct portproxy *existing,
+                     struct portproxy *created);
+
+error_t
+copyout_receive_finish (struct portproxy *existing,
+                        struct portproxy *created,
+                        mach_port_t *right,
+                        mach_msg_type_name_t *conversion,
+                        error_t err);
+
+/* A per-thread, direct-mapped cache of the send proxies a thread has
+   recently looked up, which saves probing the shared tables for rights
+   that keep coming back.  An entry is only good for as long as the
+   generation of its shard stays the same, which guarantees the proxy
+   hasn't been freed in the meantime; like the tables, it may only be
+   used inside an epoch.  Entries are for the shard they were found in,
+   as the same name can have a send proxy in each domain.  */
+#define THREAD_CACHE_SIZE 64
+
+struct thread_cache_entry
+{
+  mach_port_t name;
+  struct shard *shard;
+  struct portproxy *proxy;
+  unsigned long generation;
+};
+
+/* Split reference counts.  A send proxy that lookups keep failing to
+   take a reference on at the first try gets, for as long as it stays
+   hot, SPLIT_STRIPES counters on cache lines of their own, each shared
+   by the threads that picked it.  */
+#define SPLIT_STRIPES 16
+#define SPLIT_MAX 64
+#define SPLIT_CONTENDED 8
+
+extern int split_refs_enabled;
+
+void
+split_contended (struct portproxy *p);
+
+int
+split_ref_unless_zero (struct portproxy *p);
+
+/* Take a reference on the send proxy P, unless it has already dropped
+   to zero; like refcount_ref_unless_zero (), but adding to its split
+   count if it has one, and noticing if its count is contended.  */
+static inline int
+proxy_ref_unless_zero (struct portproxy *p)
+{
+  unsigned int r = __atomic_load_n (&p->refcount, __ATOMIC_RELAXED);
+
+  while (1)
+    {
+      if (r == 0)
+        return 0;
+
+      if (r & PORTPROXY_REF_SPLIT)
+        return split_ref_unless_zero (p);
+
+      if (__atomic_compare_exchange_n (&p->refcount, &r, r + 1, 0,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return 1;
+
+      if (__builtin_expect (split_refs_enabled, 0))
+        split_contended (p);
+    }
+}
+
+extern __thread struct thread_cache_entry thread_cache[THREAD_CACHE_SIZE];
+extern int thread_cache_enabled;
+
+/* Invalidate all entries the thread caches have for SHARD.  Must be
+   called before a proxy that was in its table is freed, and when one
+   is migrated.  */
+static inline void
+shard_invalidate (struct shard *shard)
+{
+  __atomic_add_fetch (&shard->generation, 1, __ATOMIC_RELEASE);
+}
+
+/* Find the send proxy for RIGHT without taking any locks, and take a
+   reference on it.  Must be called inside an epoch.  */
+static inline struct portproxy *
+send_proxy_probe (struct shard *shard, mach_port_t right)
+{
+  struct portproxy *proxy = proxy_table_find (&shard->table, right);
+
+  /* Leave receive proxies to send_proxy_lookup ().  */
+  if (proxy && (is_receive_entry (proxy)
+                || !proxy_ref_unless_zero (proxy)))
+    proxy = NULL;
+
+  if (proxy)
+    STAT_SHARD (shard, hits);
+  return proxy;
+}
+
+/* Like send_proxy_probe (), but try this thread's cache first.  */
+static inline struct portproxy *
+send_proxy_find (struct shard *shard, mach_port_t right)
+{
+  struct thread_cache_entry *entry;
+  struct portproxy *proxy;
+  unsigned long generation;
+
+  if (__builtin_expect (!thread_cache_enabled, 1))
+    return send_proxy_probe (shard, right);
+
+  entry = &thread_cache[port_name_hash (right) & (THREAD_CACHE_SIZE - 1)];
+  generation = __atomic_load_n (&shard->generation, __ATOMIC_ACQUIRE);
+
+  if (entry->name == right && entry->shard == shard
+      && entry->generation == generation
+      && proxy_ref_unless_zero (entry->proxy))
+    {
+      STAT_ADD (shard->domain, thread_cache_hits, 1);
+      STAT_SHARD (shard, hits);
+      return entry->proxy;
+    }
+
+  STAT_ADD (shard->domain, thread_cache_misses, 1);
+  proxy = send_proxy_probe (shard, right);
+  if (proxy)
+    {
+      entry->name = right;
+      entry->shard = shard;
+      entry->proxy = proxy;
+      entry->generation = generation;
+    }
+  return proxy;
+}
+
+/* Fail a copyout into DOMAIN with KERN_INVALID_RIGHT, and count it.  */
+static inline error_t
+copyout_rejected (struct portproxy_domain *domain)
+{
+  STAT_ADD (domain, copyout_rejected, 1);
+  return KERN_INVALID_RIGHT;
+}
+
+/* Deferred deallocation of send rights.  When enabled, each thread
+   queues up the send rights it drops, adding up user references to the
+   same name, and they are dropped in batches, by a reaper thread or by
+   the thread itself once its queue fills up.  */
+#define DEALLOC_MAX_PENDING 64
+#define DEALLOC_MAX_REFS 1024
+
+extern unsigned int dealloc_max_pending;
+
+void
+dealloc_defer (mach_port_t name, unsigned int refs);
+
+void
+dealloc_refs (mach_port_t name, unsigned int refs);
+
+/* Drop REFS user references to the send right NAME, now or later.  */
+static inline void
+send_right_release (mach_port_t name, unsigned int refs)
+{
+  if (__atomic_load_n (&dealloc_max_pending, __ATOMIC_RELAXED))
+    dealloc_defer (name, refs);
+  else
+    dealloc_refs (name, refs);
+}
+
+static inline void
+send_right_deallocate (mach_port_t name)
+{
+  send_right_release (name, 1);
+}
+
+/* Send proxies keep the user references to their send right that are
+   copied in again, and hand them back out instead of copies.  Once they
+   have this many, all but one are dropped.  */
+#define SEND_PROXY_MAX_UREFS 256
+
+void
+send_proxy_trim_urefs (struct portproxy *p);
+
+/* Account for the user reference to the send right RIGHT that was just
+   copied in and found to have the proxy P.  */
+static inline void
+send_right_keep (struct portproxy *p, mach_port_t right)
+{
+  if (p->type != PORTPROXY_TYPE_SEND)
+    {
+      /* A receive proxy makes send rights as needed.  */
+      send_right_deallocate (right);
+      return;
+    }
+
+  if (__builtin_expect (__atomic_add_fetch (&p->urefs, 1, __ATOMIC_RELAXED)
+                        >= SEND_PROXY_MAX_UREFS, 0))
+    send_proxy_trim_urefs (p);
+}
+
+/* Take one of the user references the send proxy P holds, unless it
+   has only the one left, and return whether we did.  */
+static inline int
+send_proxy_take_uref (struct portproxy *p)
+{
+  unsigned int urefs = __atomic_load_n (&p->urefs, __ATOMIC_RELAXED);
+
+  while (urefs > 1)
+    if (__atomic_compare_exchange_n (&p->urefs, &urefs, urefs - 1, 1,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      return 1;
+
+  return 0;
+}
+
+/* Sort the N indices in ORDER by the shard each one refers to in SHARDS,
+   so that entries for the same shard end up next to each other.  Batches
+   are small, so insertion sort does.  */
+static inline void
+sort_by_shard (unsigned int *order, struct shard **shards, unsigned int n)
+{
+  unsigned int i, j, k;
+
+  for (i = 1; i < n; i++)
+    {
+      k = order[i];
+      for (j = i; j > 0 && shards[order[j - 1]] > shards[k]; j--)
+        order[j] = order[j - 1];
+      order[j] = k;
+    }
+}
+
+/* Send and send-once proxies are allocated from per-class pools, one for
+   each proxy size in each domain.  Each thread keeps a couple of
+   magazines of free objects for the pools it uses recently, and
+   exchanges full and empty magazines with the pool's depot.  */
+#define MAGAZINE_SIZE 32
+
+struct magazine
+{
+  struct magazine *next;
+  unsigned int rounds;
+  void *objs[MAGAZINE_SIZE];
+};
+
+struct portproxy_pool
+{
+  struct portproxy_domain *domain;
+  struct port_class *port_class;
+  size_t size;
+  struct portproxy_pool *next;
+
+  pthread_mutex_t lock;
+  /* The depot.  Magazines on the full list may be only partially full,
+     but never empty.  */
+  struct magazine *full;
+  struct magazine *empty;
+  size_t cached;
+
+  /* Threads fold their counts in when they visit the depot.  */
+  unsigned long allocated;
+  unsigned long freed;
+  unsigned long malloced;
+};
+
+void *
+pool_alloc (struct portproxy_domain *domain,
+            struct port_class *port_class, size_t size);
+
+void
+pool_free (void *proxy);
+
+/* The domain of the proxy P.  */
+static inline struct portproxy_domain *
+proxy_domain (struct portproxy *p)
+{
+  switch (p->type)
+    {
+    case PORTPROXY_TYPE_SEND:
+    case PORTPROXY_TYPE_SEND_ONCE:
+      return p->pool->domain;
+    default:
+      return domain_for_bucket (p->pi.bucket);
+    }
+}
+
+/* Epoch-based reclamation.  Memory that lock-free readers might still be
+   looking at is retired instead of being freed; it is only freed once
+   every thread that was inside an epoch at the time has left it.  */
+struct epoch_record;
+
+struct epoch_record *
+epoch_enter (void);
+
+void
+epoch_exit (struct epoch_record *record);
+
+void
+epoch_retire (void *ptr, void (*free_routine) (void *));
+
+void
+epoch_retire_locked (void *ptr, void (*free_routine) (void *));
+
+void
+epoch_poll (void);
+
+extern __thread int epoch_deferred;
+
+/* Free what epoch_retire_locked () has left behind, if anything.  Call
+   this once the locks it was called with are dropped; otherwise, what
+   it retired stays in limbo until something else is retired.  */
+static inline void
+epoch_poll_deferred (void)
+{
+  if (epoch_deferred)
+    {
+      epoch_deferred = 0;
+      epoch_poll ();
+    }
+}
+
+extern int epoch_borrowers;
+
+/* Whether anybody may be borrowing proxies, and so may still be looking
+   at what the caller has just made unreachable.  */
+static inline int
+epoch_borrowed (void)
+{
+  /* Pairs with the fence in epoch_enter (): either a borrower doesn't
+     find what we've just unlinked, or we see that it's borrowing.  */
+  __atomic_thread_fence (__ATOMIC_SEQ_CST);
+  return __atomic_load_n (&epoch_borrowers, __ATOMIC_RELAXED);
+}
+
+/* How many chain lengths portproxy_chase_lengths () tells apart.  */
+#define CHASE_LENGTHS 16
+
+/* The layout of a message: where its type descriptors are, and what
+   they say.  Two messages of the same size whose type descriptors
+   are the same at the same offsets have the same layout, so the port
+   rights in the second one can be found without decoding the data
+   descriptors in between.  */
+#define LAYOUT_MAX_DESCS 16
+
+struct layout_desc
+{
+  uint32_t offset;      /* Of the type descriptor, from the header.  */
+  uint8_t longform;
+  uint8_t ports;        /* Whether it describes port rights.  */
+  uint32_t words[3];    /* What the type descriptor says.  */
+};
+
+struct layout
+{
+  unsigned int seq;     /* Odd while the entry is being written.  */
+  mach_msg_id_t id;
+  mach_msg_size_t size;
+  unsigned int nr_descs;
+  struct layout_desc descs[LAYOUT_MAX_DESCS];
+};
+
+#define LAYOUT_CACHE_SIZE 256
+
+/* A direct-mapped cache of layouts, keyed by msgh_id.  Entries are
+   written under a sequence lock; readers copy them out without
+   locking, and treat a copy that raced with a writer as a miss.  */
+struct portproxy_layout_cache
+{
+  struct layout entries[LAYOUT_CACHE_SIZE];
+};
+
+/* Read the words of the type descriptor at PTR into WORDS.  */
+static inline void
+layout_desc_words (const unsigned char *ptr, int longform,
+                   uint32_t words[3])
+{
+  const mach_msg_type_long_t *long_type = (const void *) ptr;
+
+  memcpy (&words[0], ptr, sizeof words[0]);
+  if (longform)
+    {
+      words[1] = long_type->msgtl_name | (long_type->msgtl_size << 16);
+      words[2] = long_type->msgtl_number;
+    }
+  else
+    words[1] = words[2] = 0;
+}
+
+int
+layout_lookup (struct portproxy_layout_cache *cache,
+               const mach_msg_header_t *msg,
+               struct layout *layout);
+
+void
+layout_store (struct portproxy_layout_cache *cache,
+              const struct layout *layout);
@@ -0,0 +1,41 @@
+#include "portproxy.h"
+#include "private.h"
+
+error_t
+portproxy_domain_reserve (struct portproxy_domain *domain, size_t n)
+{
+  error_t err = 0;
+  struct shard *shard;
+  struct proxy_table *table;
+  unsigned int i;
+  size_t count;
+
+  if (!domain)
+    domain = &default_domain;
+  if (!__atomic_load_n (&domain->shards, __ATOMIC_ACQUIRE))
+    shards_init ();
+
+  /* Names don't spread out over the shards perfectly evenly.  */
+  count = n / domain->nr_shards;
+  count += count / 4 + 1;
+
+  for (i = 0; i < domain->nr_shards && !err; i++)
+    {
+      shard = &domain->shards[i];
+
+      shard_lock (shard);
+      table = shard->table;
+      if (!table || count * 4 > (table->mask + 1) * 3)
+        err = proxy_table_resize (&shard->table, count);
+      pthread_mutex_unlock (&shard->lock);
+    }
+
+  epoch_poll_deferred ();
+  return err;
+}
+
+error_t
+portproxy_reserve (size_t n)
+{
+  return portproxy_domain_reserve (NULL, n);
+}
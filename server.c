@@ -0,0 +1,238 @@
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "portproxy.h"
+#include "private.h"
+
+/* What message buffers start out as.  */
+#define SERVER_MSG_SIZE 4096
+
+struct server
+{
+  const struct portproxy_translator *translator;
+  struct portproxy_server_hooks hooks;
+  unsigned int max_threads;
+  unsigned int thread_timeout;
+
+  /* The threads serving, and how many of them are waiting for a
+     message.  The last thread to leave frees the server.  */
+  unsigned int nr_threads;
+  unsigned int nr_idle;
+};
+
+static void *
+server_thread (void *arg);
+
+/* Start another thread, unless there are MAX_THREADS already.  */
+static void
+server_spawn (struct server *server)
+{
+  pthread_t thread;
+  unsigned int n = __atomic_load_n (&server->nr_threads, __ATOMIC_RELAXED);
+
+  do
+    if (server->max_threads && n >= server->max_threads)
+      return;
+  while (!__atomic_compare_exchange_n (&server->nr_threads, &n, n + 1, 1,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+  if (pthread_create (&thread, NULL, server_thread, server))
+    __atomic_sub_fetch (&server->nr_threads, 1, __ATOMIC_RELAXED);
+  else
+    pthread_detach (thread);
+}
+
+static void
+server_leave (struct server *server)
+{
+  if (__atomic_sub_fetch (&server->nr_threads, 1, __ATOMIC_ACQ_REL) == 0)
+    free (server);
+}
+
+/* Drop MSG because of ERR, destroying it if DESTROY.  */
+static void
+server_drop (struct server *server, mach_msg_header_t *msg, error_t err,
+             int destroy)
+{
+  if (server->hooks.dropped)
+    (*server->hooks.dropped) (msg, err, server->hooks.hook);
+  if (destroy)
+    mach_msg_destroy (msg);
+}
+
+/* Turn the translated message MSG around to be forwarded, and return
+   its size.  */
+static mach_msg_size_t
+server_forward (mach_msg_header_t *msg)
+{
+  mach_msg_bits_t bits;
+  mach_port_t local;
+
+  /* What the local port was translated to is where the message goes;
+     what it was sent to is where replies go.  */
+  bits = msg->msgh_bits;
+  msg->msgh_bits = MACH_MSGH_BITS (MACH_MSGH_BITS_LOCAL (bits),
+                                   MACH_MSGH_BITS_REMOTE (bits))
+                   | MACH_MSGH_BITS_OTHER (bits);
+  local = msg->msgh_local_port;
+  msg->msgh_local_port = msg->msgh_remote_port;
+  msg->msgh_remote_port = local;
+
+  return msg->msgh_size;
+}
+
+/* Translate the message MSG that was just received, and turn it around
+   to be forwarded.  Returns its size, or zero if it was dropped.  */
+static mach_msg_size_t
+server_handle (struct server *server, mach_msg_header_t *msg)
+{
+  error_t err = 0;
+
+  if (server->hooks.filter
+      && !portproxy_filter_msg (server->hooks.filter, msg, server->translator))
+    {
+      mach_msg_destroy (msg);
+      return 0;
+    }
+
+  if (server->hooks.received)
+    err = (*server->hooks.received) (msg, server->hooks.hook);
+
+  if (!err)
+    {
+      if (server->hooks.translate)
+        err = (*server->hooks.translate) (msg, server->translator,
+                                          server->hooks.hook);
+      else
+        err = portproxy_translate_msg (msg, server->translator);
+    }
+
+  if (err)
+    {
+      server_drop (server, msg, err, 1);
+      return 0;
+    }
+
+  server_forward (msg);
+
+  if (server->hooks.forwarding)
+    (*server->hooks.forwarding) (msg, server->hooks.hook);
+
+  return msg->msgh_size;
+}
+
+static error_t
+server_loop (struct server *server, int first)
+{
+  mach_msg_return_t err;
+  mach_msg_header_t *msg, *bigger;
+  mach_msg_size_t size = SERVER_MSG_SIZE, send_size = 0;
+  mach_msg_option_t option;
+  mach_port_t portset = server->translator->bucket->portset;
+  int timeout = !first && server->thread_timeout;
+
+  msg = malloc (size);
+  if (!msg)
+    return ENOMEM;
+
+  domain_pin_self (domain_for_bucket (server->translator->bucket));
+
+  while (1)
+    {
+      option = MACH_RCV_MSG | MACH_RCV_LARGE;
+      if (send_size)
+        option |= MACH_SEND_MSG;
+      if (timeout)
+        option |= MACH_RCV_TIMEOUT;
+
+      __atomic_add_fetch (&server->nr_idle, 1, __ATOMIC_RELAXED);
+      err = mach_msg (msg, option, send_size, size, portset,
+                      timeout ? server->thread_timeout : 0,
+                      MACH_PORT_NULL);
+      if (__atomic_sub_fetch (&server->nr_idle, 1, __ATOMIC_RELAXED) == 0
+          && err == MACH_MSG_SUCCESS)
+        /* Make sure somebody is left waiting for the next one.  */
+        server_spawn (server);
+
+      if (send_size
+          && err >= MACH_SEND_IN_PROGRESS && err < MACH_RCV_IN_PROGRESS)
+        {
+          /* Nothing was received.  The message is only left to us, as
+             it was, if its destination was bad or sending it timed
+             out; otherwise, the kernel has already destroyed what it
+             could not send, and destroying that again would release
+             rights and memory twice.  */
+          server_drop (server, msg, err,
+                       err == MACH_SEND_INVALID_DEST
+                       || err == MACH_SEND_TIMED_OUT);
+          send_size = 0;
+          continue;
+        }
+      send_size = 0;
+
+      switch (err)
+        {
+        case MACH_MSG_SUCCESS:
+          send_size = server_handle (server, msg);
+          break;
+
+        case MACH_RCV_TOO_LARGE:
+          /* It's left queued, with its size in the header.  */
+          size = msg->msgh_size;
+          bigger = realloc (msg, size);
+          if (!bigger)
+            {
+              free (msg);
+              return ENOMEM;
+            }
+          msg = bigger;
+          break;
+
+        case MACH_RCV_TIMED_OUT:
+          free (msg);
+          return 0;
+
+        case MACH_RCV_INTERRUPTED:
+          break;
+
+        default:
+          free (msg);
+          return err;
+        }
+    }
+}
+
+static void *
+server_thread (void *arg)
+{
+  struct server *server = arg;
+
+  server_loop (server, 0);
+  server_leave (server);
+  return NULL;
+}
+
+error_t
+portproxy_server (const struct portproxy_translator *translator,
+                  const struct portproxy_server_hooks *hooks,
+                  unsigned int max_threads,
+                  unsigned int thread_timeout)
+{
+  error_t err;
+  struct server *server;
+
+  server = calloc (1, sizeof *server);
+  if (!server)
+    return ENOMEM;
+
+  server->translator = translator;
+  if (hooks)
+    server->hooks = *hooks;
+  server->max_threads = max_threads;
+  server->thread_timeout = thread_timeout;
+  server->nr_threads = 1;
+
+  err = server_loop (server, 1);
+  server_leave (server);
+  return err;
+}
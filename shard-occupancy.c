@@ -0,0 +1,32 @@
+#include "portproxy.h"
+#include "private.h"
+
+unsigned int
+portproxy_domain_shard_occupancy (struct portproxy_domain *domain,
+                                  size_t *counts, unsigned int n)
+{
+  struct shard *shard;
+  unsigned int i;
+
+  if (!domain)
+    domain = &default_domain;
+  if (!__atomic_load_n (&domain->shards, __ATOMIC_ACQUIRE))
+    shards_init ();
+
+  for (i = 0; i < n && i < domain->nr_shards; i++)
+    {
+      shard = &domain->shards[i];
+
+      pthread_mutex_lock (&shard->lock);
+      counts[i] = shard->table ? shard->table->count : 0;
+      pthread_mutex_unlock (&shard->lock);
+    }
+
+  return domain->nr_shards;
+}
+
+unsigned int
+portproxy_shard_occupancy (size_t *counts, unsigned int n)
+{
+  return portproxy_domain_shard_occupancy (NULL, counts, n);
+}
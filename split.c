@@ -0,0 +1,420 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "portproxy.h"
+#include "private.h"
+
+/* A proxy that took fewer references than this since the last check
+   has cooled down.  */
+#define SPLIT_COOL 256
+
+struct split_stripe
+{
+  long count;
+  unsigned long ops;
+} __attribute__ ((aligned (64)));
+
+/* The split count of PROXY: the references to it are what its refcount
+   says, minus PORTPROXY_REF_BIAS, plus the counts of all stripes.  */
+struct split_ref
+{
+  struct split_stripe stripes[SPLIT_STRIPES];
+  struct portproxy *proxy;
+  unsigned long last_ops;       /* As of the last check.  */
+};
+
+/* Open addressing, keyed by the proxy.  Lookups go without locking,
+   inside an epoch; changes are made under split_lock, and removed
+   entries leave a tombstone behind.  */
+#define SPLIT_TABLE_SIZE (2 * SPLIT_MAX)
+#define SPLIT_TOMBSTONE ((struct split_ref *) 1)
+
+static struct split_ref *split_table[SPLIT_TABLE_SIZE];
+static unsigned int nr_split;
+static pthread_mutex_t split_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Serializes scans, so that once one is over, what it took apart has
+   been retired.  */
+static pthread_mutex_t scan_lock = PTHREAD_MUTEX_INITIALIZER;
+
+__attribute__ ((visibility("hidden")))
+int split_refs_enabled;
+
+static unsigned int split_interval;
+
+static unsigned int next_stripe;
+static __thread unsigned int stripe;    /* Plus one; zero until picked.  */
+
+/* The proxy this thread last found contended, since when, and how many
+   times.  */
+static __thread struct portproxy *contended;
+static __thread uint64_t contended_since;
+static __thread unsigned int nr_contended;
+
+/* Protects starting the scanner, and wakes it up.  */
+static pthread_mutex_t scanner_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scanner_wakeup = PTHREAD_COND_INITIALIZER;
+static int scanner_running;
+
+static inline unsigned int
+split_hash (struct portproxy *p)
+{
+  return port_name_hash ((uintptr_t) p >> 4) & (SPLIT_TABLE_SIZE - 1);
+}
+
+/* Find the split count of P.  Must be called inside an epoch, or with
+   split_lock held.  */
+static struct split_ref *
+split_find (struct portproxy *p)
+{
+  struct split_ref *s;
+  unsigned int i, n;
+
+  for (i = split_hash (p), n = 0;
+       n < SPLIT_TABLE_SIZE;
+       i = (i + 1) & (SPLIT_TABLE_SIZE - 1), n++)
+    {
+      s = __atomic_load_n (&split_table[i], __ATOMIC_ACQUIRE);
+      if (!s)
+        break;
+      if (s != SPLIT_TOMBSTONE && s->proxy == p)
+        return s;
+    }
+
+  return NULL;
+}
+
+/* Remove S from split_table.  Must be called with split_lock held.  */
+static void
+split_remove (struct split_ref *s)
+{
+  unsigned int i;
+
+  for (i = split_hash (s->proxy);
+       split_table[i] != s;
+       i = (i + 1) & (SPLIT_TABLE_SIZE - 1))
+    ;
+
+  __atomic_store_n (&split_table[i], SPLIT_TOMBSTONE, __ATOMIC_RELEASE);
+  nr_split--;
+}
+
+/* Add DELTA to this thread's stripe of the split count of P, and
+   return whether it has one.  */
+static int
+split_stripe_add (struct portproxy *p, int delta)
+{
+  struct epoch_record *record;
+  struct split_ref *s = NULL;
+  struct split_stripe *st;
+  unsigned int i;
+
+  record = epoch_enter ();
+  if (record)
+    {
+      s = split_find (p);
+
+      /* It may be one that's still being set up, or has just been
+         taken apart; the refcount itself always works, though.  */
+      if (s && !(__atomic_load_n (&p->refcount, __ATOMIC_ACQUIRE)
+                 & PORTPROXY_REF_SPLIT))
+        s = NULL;
+    }
+
+  if (s)
+    {
+      i = stripe;
+      if (!i)
+        stripe = i = (__atomic_fetch_add (&next_stripe, 1, __ATOMIC_RELAXED)
+                      % SPLIT_STRIPES) + 1;
+
+      st = &s->stripes[i - 1];
+      __atomic_add_fetch (&st->count, delta, __ATOMIC_RELEASE);
+      __atomic_add_fetch (&st->ops, 1, __ATOMIC_RELAXED);
+    }
+
+  if (record)
+    epoch_exit (record);
+
+  return s != NULL;
+}
+
+void
+portproxy_split_ref_add (void *proxy, int delta)
+{
+  struct portproxy *p = proxy;
+
+  if (split_stripe_add (p, delta))
+    return;
+
+  if (delta > 0)
+    refcount_ref (&p->refcount);
+  else if (refcount_deref (&p->refcount) == 0)
+    {
+      if (p->clean_routine)
+        (*p->clean_routine) (proxy);
+      else
+        portproxy_clean (proxy);
+    }
+}
+
+/* Take a reference on P, which has had its count split, unless it has
+   dropped to zero in the meantime.  */
+__attribute__ ((visibility("hidden")))
+int
+split_ref_unless_zero (struct portproxy *p)
+{
+  return split_stripe_add (p, 1) || refcount_ref_unless_zero (&p->refcount);
+}
+
+/* Put the count of S back together, once nobody can be adding to its
+   stripes anymore.  */
+static void
+split_fold (void *arg)
+{
+  struct split_ref *s = arg;
+  struct portproxy *p = s->proxy;
+  unsigned int i, r;
+  long sum = 0;
+
+  for (i = 0; i < SPLIT_STRIPES; i++)
+    sum += __atomic_load_n (&s->stripes[i].count, __ATOMIC_ACQUIRE);
+  free (s);
+
+  r = __atomic_add_fetch (&p->refcount,
+                          (unsigned int) (sum - PORTPROXY_REF_BIAS),
+                          __ATOMIC_ACQ_REL);
+  if (r == 0)
+    {
+      if (p->clean_routine)
+        (*p->clean_routine) (p);
+      else
+        portproxy_clean (p);
+    }
+}
+
+/* Stop adding references to S, and take it out of split_table; it is
+   then to be retired with split_fold ().  Must be called with
+   split_lock held.  */
+static void
+split_collapse (struct split_ref *s)
+{
+  __atomic_fetch_and (&s->proxy->refcount, ~PORTPROXY_REF_SPLIT,
+                      __ATOMIC_SEQ_CST);
+  split_remove (s);
+  STAT_ADD (s->proxy->pool->domain, split_collapses, 1);
+}
+
+/* Split the count of P, unless it has dropped to zero.  Callers may
+   hold a shard lock.  */
+static void
+split_promote (struct portproxy *p)
+{
+  struct split_ref *s;
+  unsigned int i, r;
+
+  if (p->type != PORTPROXY_TYPE_SEND)
+    return;
+
+  s = aligned_alloc (__alignof__ (struct split_stripe), sizeof *s);
+  if (!s)
+    return;
+  memset (s, 0, sizeof *s);
+  s->proxy = p;
+
+  pthread_mutex_lock (&split_lock);
+
+  if (!__atomic_load_n (&split_refs_enabled, __ATOMIC_RELAXED)
+      || nr_split >= SPLIT_MAX || split_find (p))
+    {
+      pthread_mutex_unlock (&split_lock);
+      free (s);
+      return;
+    }
+
+  for (i = split_hash (p);
+       split_table[i] && split_table[i] != SPLIT_TOMBSTONE;
+       i = (i + 1) & (SPLIT_TABLE_SIZE - 1))
+    ;
+  __atomic_store_n (&split_table[i], s, __ATOMIC_RELEASE);
+  nr_split++;
+
+  /* A count that was split before and hasn't been folded back in yet
+     still has its bias, so leave it alone until it has.  */
+  r = __atomic_load_n (&p->refcount, __ATOMIC_RELAXED);
+  do
+    if (r == 0 || r >= PORTPROXY_REF_BIAS)
+      break;
+  while (!__atomic_compare_exchange_n (&p->refcount, &r,
+                                       r | PORTPROXY_REF_SPLIT
+                                       | PORTPROXY_REF_BIAS,
+                                       1, __ATOMIC_SEQ_CST,
+                                       __ATOMIC_RELAXED));
+
+  if (r == 0 || r >= PORTPROXY_REF_BIAS)
+    {
+      /* It's on its way out, or still being put back together.
+         Somebody may have found S already, but won't use it without
+         the bit set.  */
+      split_remove (s);
+      pthread_mutex_unlock (&split_lock);
+      epoch_retire_locked (s, free);
+      return;
+    }
+
+  pthread_mutex_unlock (&split_lock);
+  STAT_ADD (p->pool->domain, splits, 1);
+}
+
+__attribute__ ((visibility("hidden")))
+void
+split_contended (struct portproxy *p)
+{
+  uint64_t now = hist_now ();
+
+  if (p != contended || now - contended_since > 1000000)
+    {
+      contended = p;
+      contended_since = now;
+      nr_contended = 0;
+    }
+
+  if (++nr_contended < SPLIT_CONTENDED)
+    return;
+
+  contended = NULL;
+  split_promote (p);
+}
+
+void
+portproxy_ref_split (void *proxy)
+{
+  if (__atomic_load_n (&split_refs_enabled, __ATOMIC_RELAXED))
+    {
+      split_promote (proxy);
+      epoch_poll_deferred ();
+    }
+}
+
+/* Put the counts of all proxies that have cooled down, or whose last
+   reference has been dropped, back together; or of all of them, if
+   ALL.  */
+static void
+split_scan (int all)
+{
+  struct split_ref *s, *collapsed[SPLIT_MAX];
+  unsigned int i, j, n = 0, r;
+  unsigned long ops;
+  long sum;
+
+  pthread_mutex_lock (&scan_lock);
+  pthread_mutex_lock (&split_lock);
+
+  for (i = 0; i < SPLIT_TABLE_SIZE; i++)
+    {
+      s = split_table[i];
+      if (!s || s == SPLIT_TOMBSTONE)
+        continue;
+
+      for (j = 0, ops = 0, sum = 0; j < SPLIT_STRIPES; j++)
+        {
+          ops += __atomic_load_n (&s->stripes[j].ops, __ATOMIC_RELAXED);
+          sum += __atomic_load_n (&s->stripes[j].count, __ATOMIC_RELAXED);
+        }
+      r = __atomic_load_n (&s->proxy->refcount, __ATOMIC_RELAXED);
+
+      if (all || ops - s->last_ops < SPLIT_COOL
+          || ((r & ~PORTPROXY_REF_SPLIT) - PORTPROXY_REF_BIAS
+              + (unsigned int) sum) == 0)
+        {
+          split_collapse (s);
+          collapsed[n++] = s;
+        }
+      else
+        s->last_ops = ops;
+    }
+
+  /* Nothing is left but tombstones; start over.  */
+  if (nr_split == 0)
+    for (i = 0; i < SPLIT_TABLE_SIZE; i++)
+      __atomic_store_n (&split_table[i], NULL, __ATOMIC_RELAXED);
+
+  pthread_mutex_unlock (&split_lock);
+
+  /* This may run clean routines, which take shard locks.  */
+  for (i = 0; i < n; i++)
+    epoch_retire (collapsed[i], split_fold);
+  epoch_poll ();
+
+  pthread_mutex_unlock (&scan_lock);
+}
+
+static void *
+scanner (void *arg)
+{
+  struct timespec deadline;
+  unsigned int interval;
+
+  pthread_mutex_lock (&scanner_lock);
+  while (1)
+    {
+      interval = split_interval;
+      if (interval)
+        {
+          clock_gettime (CLOCK_REALTIME, &deadline);
+          deadline.tv_sec += interval / 1000;
+          deadline.tv_nsec += (interval % 1000) * 1000000;
+          if (deadline.tv_nsec >= 1000000000)
+            {
+              deadline.tv_sec++;
+              deadline.tv_nsec -= 1000000000;
+            }
+          pthread_cond_timedwait (&scanner_wakeup, &scanner_lock, &deadline);
+        }
+      else
+        pthread_cond_wait (&scanner_wakeup, &scanner_lock);
+
+      pthread_mutex_unlock (&scanner_lock);
+      split_scan (0);
+      pthread_mutex_lock (&scanner_lock);
+    }
+
+  return NULL;
+}
+
+error_t
+portproxy_split_refs (unsigned int interval)
+{
+  error_t err = 0;
+  pthread_t thread;
+
+  pthread_mutex_lock (&scanner_lock);
+
+  if (interval && !scanner_running)
+    {
+      err = pthread_create (&thread, NULL, scanner, NULL);
+      if (!err)
+        {
+          pthread_detach (thread);
+          scanner_running = 1;
+        }
+    }
+
+  if (!err)
+    {
+      split_interval = interval;
+      __atomic_store_n (&split_refs_enabled, interval != 0,
+                        __ATOMIC_RELAXED);
+    }
+
+  /* Let the scanner pick up the new interval.  */
+  pthread_cond_signal (&scanner_wakeup);
+  pthread_mutex_unlock (&scanner_lock);
+
+  /* No more counts get split; put those that are back together.  */
+  if (!interval)
+    split_scan (1);
+
+  return err;
+}
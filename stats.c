@@ -0,0 +1,178 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "portproxy.h"
+#include "private.h"
+
+__attribute__ ((visibility("hidden")))
+__thread struct stats *thread_stats[DOMAIN_MAX];
+
+static __thread int thread_stats_registered;
+static pthread_key_t stats_key;
+static pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
+static error_t stats_key_error;
+
+static void
+release_stats (void *arg)
+{
+  struct stats **stats = arg;
+  int i;
+
+  for (i = 0; i < DOMAIN_MAX; i++)
+    if (stats[i])
+      __atomic_store_n (&stats[i]->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void
+create_stats_key (void)
+{
+  stats_key_error = pthread_key_create (&stats_key, release_stats);
+}
+
+/* Find or make a record for this thread to count into for DOMAIN.
+   Returns NULL if there is none to be had, in which case counts are
+   dropped.  */
+__attribute__ ((visibility("hidden")))
+struct stats *
+stats_register (struct portproxy_domain *domain)
+{
+  struct stats *stats;
+  int in_use;
+
+  if (!thread_stats_registered)
+    {
+      /* Make sure our records get released when this thread exits.  */
+      pthread_once (&stats_key_once, create_stats_key);
+      if (stats_key_error
+          || pthread_setspecific (stats_key, thread_stats))
+        return NULL;
+      thread_stats_registered = 1;
+    }
+
+  for (stats = __atomic_load_n (&domain->stats, __ATOMIC_ACQUIRE);
+       stats;
+       stats = stats->next)
+    {
+      in_use = 0;
+      if (__atomic_compare_exchange_n (&stats->in_use, &in_use, 1, 0,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        break;
+    }
+
+  if (!stats)
+    {
+      stats = calloc (1, sizeof *stats);
+      if (!stats)
+        return NULL;
+
+      stats->in_use = 1;
+      stats->next = __atomic_load_n (&domain->stats, __ATOMIC_RELAXED);
+      while (!__atomic_compare_exchange_n (&domain->stats, &stats->next,
+                                           stats, 1, __ATOMIC_RELEASE,
+                                           __ATOMIC_RELAXED))
+        ;
+    }
+
+  thread_stats[domain->id] = stats;
+  return stats;
+}
+
+/* Give STATS, a record for DOMAIN, its per-shard counters.  Only called
+   once the shards have been set up, since counting into them means
+   looking at one.  */
+__attribute__ ((visibility("hidden")))
+struct shard_stats *
+stats_shards (struct portproxy_domain *domain, struct stats *stats)
+{
+  struct shard_stats *shards;
+
+  shards = calloc (domain->nr_shards, sizeof *shards);
+  __atomic_store_n (&stats->shards, shards, __ATOMIC_RELEASE);
+  return shards;
+}
+
+unsigned int
+portproxy_domain_stats_snapshot (struct portproxy_domain *domain,
+                                 struct portproxy_stats *snapshot,
+                                 unsigned long *hits, unsigned long *misses,
+                                 unsigned int n)
+{
+  struct stats *stats;
+  struct shard_stats *shards;
+  unsigned long bytes_created = 0, bytes_destroyed = 0;
+  unsigned int i, nr_shards;
+
+#define READ(field) __atomic_load_n (&(field), __ATOMIC_RELAXED)
+
+  if (!domain)
+    domain = &default_domain;
+
+  memset (snapshot, 0, sizeof *snapshot);
+  nr_shards = __atomic_load_n (&domain->shards, __ATOMIC_ACQUIRE)
+              ? domain->nr_shards : 0;
+  if (n > nr_shards)
+    n = nr_shards;
+  for (i = 0; i < n; i++)
+    {
+      if (hits)
+        hits[i] = 0;
+      if (misses)
+        misses[i] = 0;
+    }
+
+  for (stats = __atomic_load_n (&domain->stats, __ATOMIC_ACQUIRE);
+       stats;
+       stats = stats->next)
+    {
+      for (i = 0; i < 4; i++)
+        {
+          snapshot->created[i] += READ (stats->created[i]);
+          snapshot->destroyed[i] += READ (stats->destroyed[i]);
+        }
+      bytes_created += READ (stats->bytes_created);
+      bytes_destroyed += READ (stats->bytes_destroyed);
+      snapshot->migrations += READ (stats->migrations);
+      snapshot->chases += READ (stats->chases);
+      snapshot->chase_hops += READ (stats->chase_hops);
+      snapshot->copyout_rejected += READ (stats->copyout_rejected);
+      snapshot->thread_cache_hits += READ (stats->thread_cache_hits);
+      snapshot->thread_cache_misses += READ (stats->thread_cache_misses);
+      snapshot->splits += READ (stats->splits);
+      snapshot->split_collapses += READ (stats->split_collapses);
+
+      shards = __atomic_load_n (&stats->shards, __ATOMIC_ACQUIRE);
+      if (!shards)
+        continue;
+
+      for (i = 0; i < nr_shards; i++)
+        {
+          snapshot->lookup_hits += READ (shards[i].hits);
+          snapshot->lookup_misses += READ (shards[i].misses);
+          if (i < n && hits)
+            hits[i] += READ (shards[i].hits);
+          if (i < n && misses)
+            misses[i] += READ (shards[i].misses);
+        }
+    }
+
+#undef READ
+
+  /* Counters are read one by one while they keep changing, so a
+     destruction may be seen without the matching creation.  */
+  for (i = 0; i < 4; i++)
+    if (snapshot->created[i] > snapshot->destroyed[i])
+      snapshot->live += snapshot->created[i] - snapshot->destroyed[i];
+  if (bytes_created > bytes_destroyed)
+    snapshot->live_bytes = bytes_created - bytes_destroyed;
+
+  return nr_shards;
+}
+
+unsigned int
+portproxy_stats_snapshot (struct portproxy_stats *snapshot,
+                          unsigned long *hits, unsigned long *misses,
+                          unsigned int n)
+{
+  return portproxy_domain_stats_snapshot (NULL, snapshot, hits, misses, n);
+}
@@ -0,0 +1,280 @@
+#include <stdlib.h>
+
+#include "portproxy.h"
+#include "private.h"
+
+/* How many slots of the old table each insertion moves over to the
+   new one, while a table is being resized, at the least.  */
+#define TABLE_MOVE_STEP 8
+
+/* Find the slot for NAME in TABLE, or return NULL if it has none.  */
+static struct proxy_slot *
+table_probe (struct proxy_table *table, mach_port_t name)
+{
+  mach_port_t n;
+  size_t i;
+
+  for (i = port_name_hash (name) & table->mask;; i = (i + 1) & table->mask)
+    {
+      n = __atomic_load_n (&table->slots[i].name, __ATOMIC_ACQUIRE);
+      if (n == name)
+        return &table->slots[i];
+      if (n == MACH_PORT_NULL)
+        return NULL;
+    }
+}
+
+/* Look NAME up in *TABLE.  This does not take any locks, and neither
+   does it take a reference on the proxy it returns; the caller must
+   either hold the table's lock, or be inside an epoch and only use
+   proxy_ref_unless_zero () on the result.  */
+__attribute__ ((visibility("hidden")))
+struct portproxy *
+proxy_table_find (struct proxy_table **p_table, mach_port_t name)
+{
+  struct proxy_table *table, *old;
+  struct proxy_slot *slot;
+  struct portproxy *proxy = NULL;
+
+  table = __atomic_load_n (p_table, __ATOMIC_ACQUIRE);
+  if (!table)
+    return NULL;
+
+  slot = table_probe (table, name);
+  if (slot)
+    proxy = __atomic_load_n (&slot->proxy, __ATOMIC_ACQUIRE);
+
+  /* It may not have been moved over yet.  */
+  if (!proxy)
+    {
+      old = __atomic_load_n (&table->old, __ATOMIC_ACQUIRE);
+      if (old)
+        {
+          slot = table_probe (old, name);
+          if (slot)
+            proxy = __atomic_load_n (&slot->proxy, __ATOMIC_ACQUIRE);
+        }
+    }
+
+  return proxy;
+}
+
+/* Put PROXY under NAME, which it doesn't have, into TABLE.  */
+static void
+table_append (struct proxy_table *table, mach_port_t name,
+              struct portproxy *proxy)
+{
+  struct proxy_slot *slot;
+  size_t i;
+
+  for (i = port_name_hash (name) & table->mask;
+       table->slots[i].name != MACH_PORT_NULL;
+       i = (i + 1) & table->mask)
+    ;
+
+  /* Publish the proxy before the name,
+     since readers match on the name.  */
+  slot = &table->slots[i];
+  __atomic_store_n (&slot->proxy, proxy, __ATOMIC_RELAXED);
+  __atomic_store_n (&slot->name, name, __ATOMIC_RELEASE);
+  table->used++;
+}
+
+/* Move up to N more slots of the table TABLE is replacing over to it,
+   but not the names of removed proxies, nor those TABLE has had set
+   since, and retire the old table once all of them are.  */
+static void
+table_move (struct proxy_table *table, size_t n)
+{
+  struct proxy_table *old = table->old;
+  struct proxy_slot *slot;
+
+  for (; n && table->moved <= old->mask; n--, table->moved++)
+    {
+      slot = &old->slots[table->moved];
+      if (slot->proxy && !table_probe (table, slot->name))
+        table_append (table, slot->name, slot->proxy);
+    }
+
+  if (table->moved > old->mask)
+    {
+      __atomic_store_n (&table->old, NULL, __ATOMIC_RELEASE);
+
+      /* Lock-free readers may still be probing it.  We hold a shard
+         lock, which clean routines take.  */
+      epoch_retire_locked (old, free);
+    }
+}
+
+/* Replace *TABLE with a new table with room for COUNT proxies, which
+   its proxies are moved over to bit by bit.  */
+__attribute__ ((visibility("hidden")))
+error_t
+proxy_table_resize (struct proxy_table **p_table, size_t count)
+{
+  struct proxy_table *old = *p_table;
+  struct proxy_table *table;
+  size_t size = 16;
+
+  /* Keep it at most half full, so that there's room left for what
+     gets added until the old one is all moved over.  */
+  while (count * 2 > size)
+    size *= 2;
+
+  table = calloc (1, sizeof *table + size * sizeof table->slots[0]);
+  if (!table)
+    return ENOMEM;
+
+  /* Only ever move from one table at a time.  */
+  if (old && old->old)
+    table_move (old, SIZE_MAX);
+
+  table->mask = size - 1;
+  if (old)
+    {
+      table->count = old->count;
+      table->old = old;
+    }
+
+  __atomic_store_n (p_table, table, __ATOMIC_RELEASE);
+
+  if (old && old->count == 0)
+    table_move (table, SIZE_MAX);
+
+  return 0;
+}
+
+/* Make sure one more name can go into *TABLE without it having to
+   grow, so that the next proxy_table_add () can't fail; and move some
+   more of the table it's replacing over to it, if any.  */
+__attribute__ ((visibility("hidden")))
+error_t
+proxy_table_reserve (struct proxy_table **p_table)
+{
+  struct proxy_table *table = *p_table;
+
+  /* Move faster when coming from a table that was larger, so as to
+     be done before this one fills up.  */
+  if (table && table->old)
+    table_move (table, TABLE_MOVE_STEP
+                       * ((table->old->mask + 1) / (table->mask + 1) + 1));
+
+  /* Keep the table at most 3/4 full, counting the names of removed
+     proxies, so that probes always terminate quickly.  */
+  if (table && (table->used + 1) * 4 <= (table->mask + 1) * 3)
+    return 0;
+
+  return proxy_table_resize (p_table, table ? table->count + 1 : 1);
+}
+
+__attribute__ ((visibility("hidden")))
+error_t
+proxy_table_add (struct proxy_table **p_table, mach_port_t name,
+                 struct portproxy *proxy)
+{
+  error_t err;
+  struct proxy_table *table;
+  struct proxy_slot *slot, *old_slot = NULL;
+
+  err = proxy_table_reserve (p_table);
+  if (err)
+    return err;
+  table = *p_table;
+
+  /* Only a receive proxy that has lost its receive right, and whose
+     clean routine is yet to remove it, can have been left behind
+     under NAME.  libports may not have cleared its port_right yet.  */
+  if (table->old)
+    {
+      old_slot = table_probe (table->old, name);
+      if (old_slot && !old_slot->proxy)
+        old_slot = NULL;
+      if (old_slot)
+        assert_backtrace (is_receive_entry (old_slot->proxy));
+    }
+
+  slot = table_probe (table, name);
+  if (slot && slot->proxy)
+    assert_backtrace (is_receive_entry (slot->proxy));
+  else if (!old_slot)
+    table->count++;
+
+  if (slot)
+    __atomic_store_n (&slot->proxy, proxy, __ATOMIC_RELEASE);
+  else
+    table_append (table, name, proxy);
+
+  /* Keep the old table up to date, for readers still looking there.  */
+  if (old_slot)
+    __atomic_store_n (&old_slot->proxy, proxy, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+__attribute__ ((visibility("hidden")))
+void
+proxy_table_remove (struct proxy_table **p_table, mach_port_t name,
+                    struct portproxy *proxy)
+{
+  struct proxy_table *table = *p_table;
+  struct proxy_slot *slot;
+  int removed = 0;
+
+  if (!table)
+    return;
+
+  /* It might have been replaced already.  */
+  slot = table_probe (table, name);
+  if (slot && slot->proxy == proxy)
+    {
+      __atomic_store_n (&slot->proxy, NULL, __ATOMIC_RELEASE);
+      removed = 1;
+    }
+
+  if (table->old)
+    {
+      slot = table_probe (table->old, name);
+      if (slot && slot->proxy == proxy)
+        {
+          __atomic_store_n (&slot->proxy, NULL, __ATOMIC_RELEASE);
+          removed = 1;
+        }
+    }
+
+  if (removed)
+    table->count--;
+}
+
+/* Put PROXY in the place of OLD under NAME in *TABLE, and return
+   whether OLD was there.  This never has to grow the table.  */
+__attribute__ ((visibility("hidden")))
+int
+proxy_table_replace (struct proxy_table **p_table, mach_port_t name,
+                     struct portproxy *old, struct portproxy *proxy)
+{
+  struct proxy_table *table = *p_table;
+  struct proxy_slot *slot, *old_slot = NULL;
+
+  if (!table)
+    return 0;
+
+  slot = table_probe (table, name);
+  if (slot && !slot->proxy)
+    slot = NULL;
+  if (table->old)
+    {
+      old_slot = table_probe (table->old, name);
+      if (old_slot && old_slot->proxy != old)
+        old_slot = NULL;
+    }
+
+  /* What the new table has takes precedence.  */
+  if (slot ? slot->proxy != old : !old_slot)
+    return 0;
+
+  if (slot)
+    __atomic_store_n (&slot->proxy, proxy, __ATOMIC_RELEASE);
+  if (old_slot)
+    __atomic_store_n (&old_slot->proxy, proxy, __ATOMIC_RELEASE);
+  return 1;
+}
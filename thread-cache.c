@@ -0,0 +1,14 @@
+#include "portproxy.h"
+#include "private.h"
+
+__attribute__ ((visibility("hidden")))
+__thread struct thread_cache_entry thread_cache[THREAD_CACHE_SIZE];
+
+__attribute__ ((visibility("hidden")))
+int thread_cache_enabled;
+
+void
+portproxy_thread_cache_enable (int enable)
+{
+  __atomic_store_n (&thread_cache_enabled, !!enable, __ATOMIC_RELAXED);
+}
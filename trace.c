@@ -0,0 +1,343 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "portproxy.h"
+#include "private.h"
+
+/* Records in each thread's ring.  */
+#define TRACE_RING_SIZE 4096
+
+/* A thread's ring.  The thread only moves head, and the writer only
+   tail, so they keep to cache lines of their own.  */
+struct trace_ring
+{
+  struct trace_ring *next;
+  int in_use;
+  unsigned int thread;
+  unsigned long head;
+  unsigned long dropped;
+
+  unsigned long tail __attribute__ ((aligned (64)));
+  unsigned long dropped_reported;
+  unsigned long dropped_base;   /* As of portproxy_trace_start ().  */
+
+  struct portproxy_trace_record records[TRACE_RING_SIZE];
+};
+
+static int tracing;
+
+/* Rings are never freed; the ring of a thread that has exited is
+   reused by the next thread that traces.  */
+static struct trace_ring *rings;
+static unsigned int next_thread;
+
+static __thread struct trace_ring *self;
+static pthread_key_t self_key;
+static pthread_once_t self_key_once = PTHREAD_ONCE_INIT;
+static error_t self_key_error;
+
+/* Protects the file, and starting and stopping the writer, which it
+   wakes up.  */
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_wakeup = PTHREAD_COND_INITIALIZER;
+static pthread_t writer_thread;
+static int writer_stopping;
+static unsigned int trace_interval;
+static int trace_fd = -1;
+static error_t trace_error;
+
+static void
+release_ring (void *arg)
+{
+  struct trace_ring *ring = arg;
+
+  __atomic_store_n (&ring->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void
+create_self_key (void)
+{
+  self_key_error = pthread_key_create (&self_key, release_ring);
+}
+
+static struct trace_ring *
+get_ring (void)
+{
+  struct trace_ring *ring;
+  int in_use;
+
+  pthread_once (&self_key_once, create_self_key);
+  if (self_key_error)
+    return NULL;
+
+  for (ring = __atomic_load_n (&rings, __ATOMIC_ACQUIRE);
+       ring;
+       ring = ring->next)
+    {
+      in_use = 0;
+      if (__atomic_compare_exchange_n (&ring->in_use, &in_use, 1, 0,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        break;
+    }
+
+  if (!ring)
+    {
+      ring = aligned_alloc (__alignof__ (struct trace_ring), sizeof *ring);
+      if (!ring)
+        return NULL;
+
+      memset (ring, 0, offsetof (struct trace_ring, records));
+      ring->in_use = 1;
+      ring->next = __atomic_load_n (&rings, __ATOMIC_RELAXED);
+      while (!__atomic_compare_exchange_n (&rings, &ring->next, ring,
+                                           1, __ATOMIC_RELEASE,
+                                           __ATOMIC_RELAXED))
+        ;
+    }
+
+  if (pthread_setspecific (self_key, ring))
+    {
+      release_ring (ring);
+      return NULL;
+    }
+
+  ring->thread = __atomic_fetch_add (&next_thread, 1, __ATOMIC_RELAXED);
+  self = ring;
+  return ring;
+}
+
+void
+portproxy_trace (enum portproxy_trace_kind kind, mach_msg_id_t id,
+                 unsigned int proxy, mach_port_t right,
+                 unsigned int disposition, unsigned int arg)
+{
+  struct trace_ring *ring = self;
+  struct portproxy_trace_record *record;
+  unsigned long head, used;
+
+  if (!__atomic_load_n (&tracing, __ATOMIC_RELAXED))
+    return;
+
+  if (!ring)
+    {
+      ring = get_ring ();
+      if (!ring)
+        return;
+    }
+
+  head = ring->head;
+  used = head - __atomic_load_n (&ring->tail, __ATOMIC_ACQUIRE);
+  if (used >= TRACE_RING_SIZE)
+    {
+      __atomic_store_n (&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+      return;
+    }
+
+  record = &ring->records[head & (TRACE_RING_SIZE - 1)];
+  record->time = hist_now ();
+  record->thread = ring->thread;
+  record->kind = kind;
+  record->disposition = disposition;
+  record->id = id;
+  record->proxy = proxy;
+  record->right = right;
+  record->arg = arg;
+  __atomic_store_n (&ring->head, head + 1, __ATOMIC_RELEASE);
+
+  /* Don't wait for the writer's next round to make room.  */
+  if (used == TRACE_RING_SIZE / 2)
+    pthread_cond_signal (&writer_wakeup);
+}
+
+static void
+trace_write (const void *buf, size_t size)
+{
+  ssize_t n;
+
+  while (size && !trace_error)
+    {
+      n = write (trace_fd, buf, size);
+      if (n < 0)
+        {
+          if (errno != EINTR)
+            trace_error = errno;
+          continue;
+        }
+      buf = (const char *) buf + n;
+      size -= n;
+    }
+}
+
+/* Write out what is in the rings.  Must be called with trace_lock
+   held.  */
+static void
+trace_drain (void)
+{
+  struct trace_ring *ring;
+  struct portproxy_trace_record dropped;
+  unsigned long head, tail, end, n;
+
+  for (ring = __atomic_load_n (&rings, __ATOMIC_ACQUIRE);
+       ring;
+       ring = ring->next)
+    {
+      head = __atomic_load_n (&ring->head, __ATOMIC_ACQUIRE);
+      tail = ring->tail;
+
+      while (tail != head)
+        {
+          /* Up to where the ring wraps around.  */
+          end = (tail | (TRACE_RING_SIZE - 1)) + 1;
+          n = (head < end ? head : end) - tail;
+          trace_write (&ring->records[tail & (TRACE_RING_SIZE - 1)],
+                       n * sizeof ring->records[0]);
+          tail += n;
+        }
+      __atomic_store_n (&ring->tail, tail, __ATOMIC_RELEASE);
+
+      n = __atomic_load_n (&ring->dropped, __ATOMIC_RELAXED);
+      if (n != ring->dropped_reported)
+        {
+          memset (&dropped, 0, sizeof dropped);
+          dropped.time = hist_now ();
+          dropped.thread = ring->thread;
+          dropped.kind = PORTPROXY_TRACE_DROPPED;
+          dropped.arg = n - ring->dropped_reported;
+          trace_write (&dropped, sizeof dropped);
+          ring->dropped_reported = n;
+        }
+    }
+}
+
+static void *
+writer (void *arg)
+{
+  struct timespec deadline;
+
+  pthread_mutex_lock (&trace_lock);
+  while (!writer_stopping)
+    {
+      clock_gettime (CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += trace_interval / 1000;
+      deadline.tv_nsec += (trace_interval % 1000) * 1000000;
+      if (deadline.tv_nsec >= 1000000000)
+        {
+          deadline.tv_sec++;
+          deadline.tv_nsec -= 1000000000;
+        }
+      pthread_cond_timedwait (&writer_wakeup, &trace_lock, &deadline);
+
+      trace_drain ();
+    }
+  pthread_mutex_unlock (&trace_lock);
+
+  return NULL;
+}
+
+error_t
+portproxy_trace_start (const char *path, unsigned int interval)
+{
+  error_t err;
+  struct trace_ring *ring;
+  struct portproxy_trace_header header;
+
+  pthread_mutex_lock (&trace_lock);
+
+  if (trace_fd != -1)
+    {
+      pthread_mutex_unlock (&trace_lock);
+      return EBUSY;
+    }
+
+  trace_fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (trace_fd == -1)
+    {
+      err = errno;
+      pthread_mutex_unlock (&trace_lock);
+      return err;
+    }
+
+  trace_error = 0;
+  memset (&header, 0, sizeof header);
+  memcpy (header.magic, PORTPROXY_TRACE_MAGIC, sizeof PORTPROXY_TRACE_MAGIC);
+  header.version = PORTPROXY_TRACE_VERSION;
+  header.record_size = sizeof (struct portproxy_trace_record);
+  trace_write (&header, sizeof header);
+
+  /* Forget whatever was left over from last time.  */
+  for (ring = __atomic_load_n (&rings, __ATOMIC_ACQUIRE);
+       ring;
+       ring = ring->next)
+    {
+      __atomic_store_n (&ring->tail,
+                        __atomic_load_n (&ring->head, __ATOMIC_ACQUIRE),
+                        __ATOMIC_RELEASE);
+      ring->dropped_reported = ring->dropped_base
+        = __atomic_load_n (&ring->dropped, __ATOMIC_RELAXED);
+    }
+
+  trace_interval = interval ?: 1;
+  writer_stopping = 0;
+  err = trace_error ?: pthread_create (&writer_thread, NULL, writer, NULL);
+  if (err)
+    {
+      close (trace_fd);
+      trace_fd = -1;
+    }
+  else
+    __atomic_store_n (&tracing, 1, __ATOMIC_RELAXED);
+
+  pthread_mutex_unlock (&trace_lock);
+  return err;
+}
+
+error_t
+portproxy_trace_stop (void)
+{
+  error_t err;
+
+  pthread_mutex_lock (&trace_lock);
+
+  if (trace_fd == -1)
+    {
+      pthread_mutex_unlock (&trace_lock);
+      return 0;
+    }
+
+  __atomic_store_n (&tracing, 0, __ATOMIC_RELAXED);
+  writer_stopping = 1;
+  pthread_cond_signal (&writer_wakeup);
+  pthread_mutex_unlock (&trace_lock);
+
+  pthread_join (writer_thread, NULL);
+
+  pthread_mutex_lock (&trace_lock);
+  trace_drain ();
+  if (close (trace_fd) && !trace_error)
+    trace_error = errno;
+  trace_fd = -1;
+  err = trace_error;
+  pthread_mutex_unlock (&trace_lock);
+
+  return err;
+}
+
+unsigned long
+portproxy_trace_dropped (void)
+{
+  struct trace_ring *ring;
+  unsigned long dropped = 0;
+
+  for (ring = __atomic_load_n (&rings, __ATOMIC_ACQUIRE);
+       ring;
+       ring = ring->next)
+    dropped += __atomic_load_n (&ring->dropped, __ATOMIC_RELAXED)
+               - ring->dropped_base;
+
+  return dropped;
+}
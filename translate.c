@@ -0,0 +1,575 @@
+#include "portproxy.h"
+#include "private.h"
+
+/* Inline data in messages is padded to this alignment.  */
+#define MSG_ALIGN(x) \
+  (((x) + __alignof__ (uintptr_t) - 1) & ~(__alignof__ (uintptr_t) - 1))
+
+/* Translate PROXY, which is locked and referenced, and release it.  */
+static error_t
+translate_proxy (const struct portproxy_translator *t,
+                 struct portproxy *proxy,
+                 mach_port_right_t type,
+                 mach_port_t *right,
+                 mach_msg_type_name_t *conversion)
+{
+  error_t err;
+
+  err = t->translate (proxy, type, right, conversion, t->hook);
+
+  portproxy_unlock (proxy);
+  portproxy_deref (proxy);
+  return err;
+}
+
+/* Translate the send right *RIGHT, of disposition *NAME, by borrowing
+   its proxy, and return whether it had one that could be, and so was
+   translated, with the result in *ERR.  */
+static int
+translate_borrowed (const struct portproxy_translator *t,
+                    mach_port_t *right,
+                    mach_msg_type_name_t *name,
+                    error_t *err)
+{
+  struct portproxy *proxy;
+
+  if (portproxy_epoch_enter ())
+    return 0;
+
+  proxy = portproxy_domain_borrow (domain_for_bucket (t->bucket), *right);
+  if (proxy)
+    *err = t->translate (proxy, MACH_PORT_RIGHT_SEND, right, name,
+                         t->hook);
+
+  portproxy_epoch_exit ();
+  return proxy != NULL;
+}
+
+/* Copy in the right *RIGHT of disposition *NAME and replace it with
+   its translation.  If translating it fails once it has been copied
+   in, its proxy has it, and it is cleared.  */
+static error_t
+translate_right (const struct portproxy_translator *t,
+                 mach_port_t *right,
+                 mach_msg_type_name_t *name)
+{
+  error_t err;
+  mach_port_right_t type;
+  struct portproxy *existing, *created;
+
+  type = portproxy_conversion_to_type (*name);
+
+  if (t->borrow && type == MACH_PORT_RIGHT_SEND
+      && translate_borrowed (t, right, name, &err))
+    return err;
+
+  err = portproxy_copyin (*right, type, t->port_class, t->bucket,
+                          t->size, &existing, &created);
+  if (err)
+    return err;
+
+  if (!created)
+    err = translate_proxy (t, existing, type, right, name);
+  else
+    {
+      if (t->init)
+        t->init (created, existing, t->hook);
+      if (existing)
+        {
+          portproxy_unlock (existing);
+          portproxy_deref (existing);
+        }
+
+      err = translate_proxy (t, created, type, right, name);
+    }
+
+  if (err)
+    *right = MACH_PORT_NULL;
+  return err;
+}
+
+/* Return the moved disposition that CONVERSION amounts to.  */
+static inline mach_msg_type_name_t
+moved (mach_msg_type_name_t conversion)
+{
+  switch (conversion)
+    {
+    case MACH_MSG_TYPE_COPY_SEND:
+    case MACH_MSG_TYPE_MAKE_SEND:
+      return MACH_MSG_TYPE_MOVE_SEND;
+
+    case MACH_MSG_TYPE_MAKE_SEND_ONCE:
+      return MACH_MSG_TYPE_MOVE_SEND_ONCE;
+
+    default:
+      return conversion;
+    }
+}
+
+/* Turn the right *RIGHT of disposition *CONVERSION into one that is
+   moved, so that it can share a descriptor with rights of other
+   dispositions.  */
+static error_t
+make_move (mach_port_t *right, mach_msg_type_name_t *conversion)
+{
+  error_t err;
+  mach_msg_type_name_t acquired;
+
+  switch (*conversion)
+    {
+    case MACH_MSG_TYPE_COPY_SEND:
+      err = mach_port_mod_refs (mach_task_self (), *right,
+                                MACH_PORT_RIGHT_SEND, 1);
+      *conversion = MACH_MSG_TYPE_MOVE_SEND;
+      return err;
+
+    case MACH_MSG_TYPE_MAKE_SEND:
+      err = mach_port_insert_right (mach_task_self (), *right, *right,
+                                    MACH_MSG_TYPE_MAKE_SEND);
+      *conversion = MACH_MSG_TYPE_MOVE_SEND;
+      return err;
+
+    case MACH_MSG_TYPE_MAKE_SEND_ONCE:
+      err = mach_port_extract_right (mach_task_self (), *right,
+                                     MACH_MSG_TYPE_MAKE_SEND_ONCE,
+                                     right, &acquired);
+      *conversion = MACH_MSG_TYPE_MOVE_SEND_ONCE;
+      return err;
+
+    default:
+      return 0;
+    }
+}
+
+/* Drop the translated right *RIGHT of disposition NAME, which was not
+   sent after all, and clear it.  Copied and made rights would only have
+   been acquired by sending them, so there is nothing to drop for
+   those.  */
+static void
+untranslate_right (mach_port_t *right, mach_msg_type_name_t name)
+{
+  switch (name)
+    {
+    case MACH_MSG_TYPE_MOVE_SEND:
+    case MACH_MSG_TYPE_MOVE_SEND_ONCE:
+      mach_port_deallocate (mach_task_self (), *right);
+      break;
+
+    case MACH_MSG_TYPE_MOVE_RECEIVE:
+      mach_port_mod_refs (mach_task_self (), *right,
+                          MACH_PORT_RIGHT_RECEIVE, -1);
+      break;
+
+    default:
+      break;
+    }
+
+  *right = MACH_PORT_NULL;
+}
+
+/* Likewise for the first NUMBER ports in RIGHTS.  */
+static void
+untranslate_rights (mach_port_t *rights, size_t number,
+                    mach_msg_type_name_t name)
+{
+  size_t i;
+
+  for (i = 0; i < number; i++)
+    if (MACH_PORT_VALID (rights[i]))
+      untranslate_right (&rights[i], name);
+}
+
+/* Translate the NUMBER ports in RIGHTS, which all have disposition
+   *NAME.  The translations of a single right may come with any
+   disposition.  Send proxies copied out for an array of more than one
+   hand out copied rights, so that those agree; if they still differ,
+   all of them are turned into moved rights.  On error, the rights
+   translated so far are dropped and cleared, as is the one that failed
+   if it was copied in, and the others are left as they were, so that
+   they still all have disposition *NAME.  */
+static error_t
+translate_rights (const struct portproxy_translator *t,
+                  mach_port_t *rights,
+                  size_t number,
+                  mach_msg_type_name_t *name)
+{
+  error_t err;
+  size_t i, j;
+  int copy_send = copyout_copy_send;
+  mach_msg_type_name_t in = *name;
+  mach_msg_type_name_t out = 0, conversion, fixed;
+
+  for (i = 0; i < number; i++)
+    {
+      if (!MACH_PORT_VALID (rights[i]))
+        continue;
+
+      conversion = in;
+      copyout_copy_send = copy_send || number > 1;
+      err = translate_right (t, &rights[i], &conversion);
+      copyout_copy_send = copy_send;
+      if (err)
+        {
+          untranslate_rights (rights, i, out);
+          return err;
+        }
+
+      if (out == 0)
+        out = conversion;
+      else if (conversion != out)
+        {
+          if (moved (out) != out)
+            {
+              /* Go back and fix up the ones translated so far.  */
+              for (j = 0; j < i; j++)
+                if (MACH_PORT_VALID (rights[j]))
+                  {
+                    fixed = out;
+                    err = make_move (&rights[j], &fixed);
+                    if (err)
+                      {
+                        untranslate_rights (rights, j, moved (out));
+                        untranslate_rights (rights + j, i - j, out);
+                        untranslate_right (&rights[i], conversion);
+                        return err;
+                      }
+                  }
+              out = moved (out);
+            }
+
+          fixed = conversion;
+          err = make_move (&rights[i], &fixed);
+          if (!err)
+            {
+              conversion = fixed;
+              if (conversion != out)
+                err = KERN_INVALID_RIGHT;
+            }
+          if (err)
+            {
+              untranslate_rights (rights, i, out);
+              untranslate_right (&rights[i], conversion);
+              return err;
+            }
+        }
+    }
+
+  if (out != 0)
+    *name = out;
+  return 0;
+}
+
+/* Have the out-of-line memory described by the type descriptor at PTR
+   moved along with the message when it is sent on, instead of copied
+   and left behind in our address space; its contents are never looked
+   at.  */
+static inline void
+move_ool (unsigned char *ptr)
+{
+  mach_msg_type_t *type = (mach_msg_type_t *) ptr;
+
+  if (!type->msgt_inline)
+    type->msgt_deallocate = 1;
+}
+
+/* Drop and clear the rights of MSG that have been translated: those
+   in its header, and those described by the type descriptors before
+   STOP, which have already been checked to fit into the message.  */
+static void
+untranslate_msg (mach_msg_header_t *msg, unsigned char *stop)
+{
+  unsigned char *ptr, *data;
+  mach_msg_type_name_t name;
+  unsigned int size;
+  mach_msg_type_number_t number;
+  mach_port_t *rights;
+
+  untranslate_right (&msg->msgh_remote_port,
+                     MACH_MSGH_BITS_REMOTE (msg->msgh_bits));
+  untranslate_right (&msg->msgh_local_port,
+                     MACH_MSGH_BITS_LOCAL (msg->msgh_bits));
+
+  for (ptr = (unsigned char *) (msg + 1); ptr < stop; ptr = data)
+    {
+      mach_msg_type_t *type = (mach_msg_type_t *) ptr;
+      mach_msg_type_long_t *long_type = (mach_msg_type_long_t *) ptr;
+
+      if (type->msgt_longform)
+        {
+          name = long_type->msgtl_name;
+          size = long_type->msgtl_size;
+          number = long_type->msgtl_number;
+          data = ptr + sizeof *long_type;
+        }
+      else
+        {
+          name = type->msgt_name;
+          size = type->msgt_size;
+          number = type->msgt_number;
+          data = ptr + sizeof *type;
+        }
+
+      if (type->msgt_inline)
+        rights = (mach_port_t *) data;
+      else
+        rights = (mach_port_t *) *(vm_offset_t *) data;
+
+      /* Translated rights may also be copied or made.  */
+      if (MACH_MSG_TYPE_PORT_ANY (name))
+        untranslate_rights (rights, number, name);
+
+      if (type->msgt_inline)
+        data += MSG_ALIGN ((size_t) (((uint64_t) number * size + 7) / 8));
+      else
+        data += MSG_ALIGN (sizeof (vm_offset_t));
+    }
+}
+
+/* Translate the local (destination) port of MSG, which is one of
+   our receive proxies.  */
+static error_t
+translate_local (const struct portproxy_translator *t,
+                 mach_msg_header_t *msg,
+                 mach_msg_type_name_t *bits)
+{
+  error_t err;
+  struct portproxy *proxy;
+
+  proxy = portproxy_lookup_local (msg, t->bucket, t->port_class);
+  if (!proxy)
+    return KERN_INVALID_NAME;
+
+  err = portproxy_copyin_request_port (proxy);
+  if (err)
+    {
+      portproxy_unlock (proxy);
+      portproxy_deref (proxy);
+      return err;
+    }
+
+  if (*bits == MACH_MSG_TYPE_PROTECTED_PAYLOAD)
+    *bits = proxy->type == PORTPROXY_TYPE_RECEIVE
+              ? MACH_MSG_TYPE_MOVE_SEND
+              : MACH_MSG_TYPE_MOVE_SEND_ONCE;
+
+  return translate_proxy (t, proxy, portproxy_conversion_to_type (*bits),
+                          &msg->msgh_local_port, bits);
+}
+
+/* Translate the port rights described by the type descriptor at PTR,
+   which have already been checked to fit into the message.  */
+static error_t
+translate_desc (const struct portproxy_translator *t,
+                unsigned char *ptr)
+{
+  error_t err;
+  mach_msg_type_t *type = (mach_msg_type_t *) ptr;
+  mach_msg_type_long_t *long_type = (mach_msg_type_long_t *) ptr;
+  mach_msg_type_name_t name;
+  mach_msg_type_number_t number;
+  unsigned char *data;
+  mach_port_t *rights;
+
+  if (type->msgt_longform)
+    {
+      name = long_type->msgtl_name;
+      number = long_type->msgtl_number;
+      data = ptr + sizeof *long_type;
+    }
+  else
+    {
+      name = type->msgt_name;
+      number = type->msgt_number;
+      data = ptr + sizeof *type;
+    }
+
+  if (type->msgt_inline)
+    rights = (mach_port_t *) data;
+  else
+    rights = (mach_port_t *) *(vm_offset_t *) data;
+
+  err = translate_rights (t, rights, number, &name);
+  if (err)
+    return err;
+
+  if (type->msgt_longform)
+    long_type->msgtl_name = name;
+  else
+    type->msgt_name = name;
+  return 0;
+}
+
+/* Translate the port rights in the body of MSG using its cached
+   LAYOUT.  On error, drop and clear what has been translated, header
+   included.  */
+static error_t
+translate_cached (const struct portproxy_translator *t,
+                  mach_msg_header_t *msg,
+                  const struct layout *layout)
+{
+  error_t err;
+  unsigned int i;
+  unsigned char *ptr;
+
+  for (i = 0; i < layout->nr_descs; i++)
+    {
+      ptr = (unsigned char *) msg + layout->descs[i].offset;
+      if (layout->descs[i].ports)
+        {
+          err = translate_desc (t, ptr);
+          if (err)
+            {
+              untranslate_msg (msg, ptr);
+              return err;
+            }
+        }
+      move_ool (ptr);
+    }
+
+  return 0;
+}
+
+/* Walk the body of MSG, translating the port rights in it, and record
+   its layout in LAYOUT, if not NULL.  On error, drop and clear what has
+   been translated, header included.  */
+static error_t
+translate_walk (const struct portproxy_translator *t,
+                mach_msg_header_t *msg,
+                struct layout *layout)
+{
+  error_t err;
+  unsigned char *ptr, *end, *data;
+  mach_msg_type_name_t name;
+  unsigned int size;
+  mach_msg_type_number_t number;
+  uint64_t bytes;
+  struct layout_desc *desc;
+
+  ptr = (unsigned char *) (msg + 1);
+  end = (unsigned char *) msg + msg->msgh_size;
+
+  while (ptr < end)
+    {
+      mach_msg_type_t *type = (mach_msg_type_t *) ptr;
+      mach_msg_type_long_t *long_type = (mach_msg_type_long_t *) ptr;
+
+      if (type->msgt_longform)
+        {
+          if (ptr + sizeof *long_type > end)
+            goto bad;
+          name = long_type->msgtl_name;
+          size = long_type->msgtl_size;
+          number = long_type->msgtl_number;
+          data = ptr + sizeof *long_type;
+        }
+      else
+        {
+          if (ptr + sizeof *type > end)
+            goto bad;
+          name = type->msgt_name;
+          size = type->msgt_size;
+          number = type->msgt_number;
+          data = ptr + sizeof *type;
+        }
+
+      if (type->msgt_inline)
+        {
+          /* NUMBER comes from the sender, and multiplying it in a
+             size_t could wrap around on 32-bit systems.  */
+          bytes = ((uint64_t) number * size + 7) / 8;
+          if (bytes > (uint64_t) (end - data))
+            goto bad;
+          data += MSG_ALIGN ((size_t) bytes);
+        }
+      else
+        data += MSG_ALIGN (sizeof (vm_offset_t));
+      if (data > end)
+        goto bad;
+
+      if (layout)
+        {
+          if (layout->nr_descs < LAYOUT_MAX_DESCS)
+            {
+              /* Record the descriptor before it gets rewritten.  */
+              desc = &layout->descs[layout->nr_descs++];
+              desc->offset = ptr - (unsigned char *) msg;
+              desc->longform = type->msgt_longform;
+              desc->ports = MACH_MSG_TYPE_PORT_ANY_RIGHT (name) && number;
+              layout_desc_words (ptr, desc->longform, desc->words);
+            }
+          else
+            layout = NULL;
+        }
+
+      if (MACH_MSG_TYPE_PORT_ANY_RIGHT (name) && number)
+        {
+          if (size != 8 * sizeof (mach_port_t))
+            goto bad;
+
+          err = translate_desc (t, ptr);
+          if (err)
+            goto fail;
+        }
+
+      move_ool (ptr);
+      ptr = data;
+    }
+
+  if (layout && layout->nr_descs)
+    layout_store (t->layout_cache, layout);
+  return 0;
+
+ bad:
+  err = MIG_TYPE_ERROR;
+ fail:
+  untranslate_msg (msg, ptr);
+  return err;
+}
+
+error_t
+portproxy_translate_msg (mach_msg_header_t *msg,
+                         const struct portproxy_translator *t)
+{
+  error_t err;
+  mach_msg_type_name_t local_bits, remote_bits;
+  struct layout layout;
+
+  assert_backtrace (t->size >= sizeof (struct portproxy));
+  assert_backtrace (t->translate);
+
+  local_bits = MACH_MSGH_BITS_LOCAL (msg->msgh_bits);
+  remote_bits = MACH_MSGH_BITS_REMOTE (msg->msgh_bits);
+
+  err = translate_local (t, msg, &local_bits);
+  if (err)
+    return err;
+
+  if (MACH_PORT_VALID (msg->msgh_remote_port))
+    {
+      err = translate_right (t, &msg->msgh_remote_port, &remote_bits);
+      if (err)
+        {
+          /* The header bits still say how the local port was
+             received.  */
+          untranslate_right (&msg->msgh_local_port, local_bits);
+          return err;
+        }
+    }
+
+  msg->msgh_bits = MACH_MSGH_BITS_OTHER (msg->msgh_bits)
+                   | MACH_MSGH_BITS (remote_bits, local_bits);
+
+  if (!(msg->msgh_bits & MACH_MSGH_BITS_COMPLEX))
+    return 0;
+
+  if (!t->layout_cache)
+    return translate_walk (t, msg, NULL);
+
+  if (layout_lookup (t->layout_cache, msg, &layout))
+    return translate_cached (t, msg, &layout);
+
+  layout.id = msg->msgh_id;
+  layout.size = msg->msgh_size;
+  layout.nr_descs = 0;
+  return translate_walk (t, msg, &layout);
+}